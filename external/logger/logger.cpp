@@ -1,8 +1,16 @@
 
 #include "logger.h"
 #include <sys/time.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <ctime>
 #include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
 
 
 namespace fan_controller {
@@ -49,16 +57,167 @@ int SeverityToIndex(Severity severity) {
   }
 }
 
-// Default implementation of the logging function which prints to console
-void DefaultConsoleLogging(const char* file, int line, Severity severity, const char* log) {
+// Milliseconds of the monotonic clock
+uint64_t MonotonicNowMs() {
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return static_cast<uint64_t>(now.tv_sec) * 1000 + now.tv_nsec / 1000000;
+}
+
+// Suppression of repeated messages. Every call site hashes into one entry which remembers a
+// hash of the last text printed from there, when it was printed and how often it was repeated
+// since.
+struct CallSite {
+  const char* file = nullptr;
+  int line = 0;
+  Severity severity = Severity::DEBUG;
+  uint64_t text_hash = 0;
+  uint64_t printed_ms = 0;
+  uint64_t repeats = 0;
+};
+constexpr size_t kCallSiteCount = 256;
+CallSite s_call_sites[kCallSiteCount];
+std::mutex s_call_sites_mutex;
+std::atomic<bool> s_suppress_duplicates{false};
+std::atomic<uint64_t> s_duplicate_window_ms{0};
+
+// How often pending repeat counts are checked for call sites which went quiet
+constexpr uint64_t kRepeatFlushIntervalMs = 1000;
+std::atomic<uint64_t> s_next_repeat_flush_ms{0};
+
+// FNV-1a, good enough to tell log lines apart
+uint64_t HashText(const char* text) {
+  uint64_t hash = 14695981039346656037ull;
+  for (; *text != '\0'; text++) {
+    hash = (hash ^ static_cast<unsigned char>(*text)) * 1099511628211ull;
+  }
+  return hash;
+}
+
+// Returns true if `log` repeats the last message of its call site within the suppression window
+// and should not be printed. Otherwise returns false and sets `*repeats` to the number of repeats
+// of the previous message which were not printed.
+bool IsDuplicate(const char* file, int line, Severity severity, const char* log,
+                 uint64_t* repeats) {
+  *repeats = 0;
+  if (!s_suppress_duplicates) {
+    return false;
+  }
+  const uint64_t now_ms = MonotonicNowMs();
+  const uint64_t text_hash = HashText(log);
+  const size_t index =
+      (reinterpret_cast<uintptr_t>(file) ^ static_cast<uintptr_t>(line) * 2654435761u) %
+      kCallSiteCount;
+  std::lock_guard<std::mutex> lock(s_call_sites_mutex);
+  CallSite& site = s_call_sites[index];
+  const bool same_site = site.file == file && site.line == line;
+  if (same_site && site.text_hash == text_hash &&
+      now_ms - site.printed_ms < s_duplicate_window_ms.load(std::memory_order_relaxed)) {
+    site.repeats++;
+    return true;
+  }
+  if (same_site) {
+    *repeats = site.repeats;
+  }
+  site.file = file;
+  site.line = line;
+  site.severity = severity;
+  site.text_hash = text_hash;
+  site.printed_ms = now_ms;
+  site.repeats = 0;
+  return false;
+}
+
+// Prints the message `log` from `file`:`line` logged at time `tv` with the pattern of
+// `severity_int` to `outstream`
+void PrintLine(std::FILE* outstream, const timeval& tv, const char* file, int line,
+               int severity_int, const char* log) {
+  // Create a string with date and time
+  struct tm* tm_info;
+  tm local_tm;
+  tm_info = localtime_r(&tv.tv_sec, &local_tm);
+  char time_str[20];
+  strftime(time_str, 20, "%Y-%m-%d %H:%M:%S", tm_info);
+
+  // Patterns have the following arguments: time, time in ms, file, line, message
+  std::fprintf(outstream, s_patterns[severity_int], time_str, tv.tv_usec / 1000, file, line, log);
+}
+
+// Prints how often the previous message of a call site was repeated without being printed
+void PrintRepeats(std::FILE* outstream, const timeval& tv, const char* file, int line,
+                  int severity_int, uint64_t repeats) {
+  char repeated[64];
+  std::snprintf(repeated, sizeof(repeated), "Previous message repeated %lu times",
+                static_cast<unsigned long>(repeats));
+  PrintLine(outstream, tv, file, line, severity_int, repeated);
+}
+
+// Prints the repeat counts of call sites whose window ran out without them logging again, or of
+// all call sites if `all` is set. Keeps the texts, so further repeats stay suppressed.
+void FlushRepeats(bool all) {
+  if (!s_suppress_duplicates) {
+    return;
+  }
+  struct Pending {
+    const char* file;
+    int line;
+    Severity severity;
+    uint64_t repeats;
+  };
+  Pending pending[kCallSiteCount];
+  size_t pending_count = 0;
+  const uint64_t now_ms = MonotonicNowMs();
+  {
+    std::lock_guard<std::mutex> lock(s_call_sites_mutex);
+    for (CallSite& site : s_call_sites) {
+      if (site.repeats != 0 &&
+          (all || now_ms - site.printed_ms >=
+                      s_duplicate_window_ms.load(std::memory_order_relaxed))) {
+        pending[pending_count++] = {site.file, site.line, site.severity, site.repeats};
+        site.printed_ms = now_ms;
+        site.repeats = 0;
+      }
+    }
+  }
+  // The I/O happens outside of the lock
+  timeval tv;
+  gettimeofday(&tv, NULL);
+  for (size_t i = 0; i < pending_count; i++) {
+    const int severity_int = SeverityToIndex(pending[i].severity);
+    std::FILE* outstream = s_sinks[severity_int];
+    if (outstream != nullptr && IsEnabled(pending[i].severity)) {
+      PrintRepeats(outstream, tv, pending[i].file, pending[i].line, severity_int,
+                   pending[i].repeats);
+      std::fflush(outstream);
+    }
+  }
+}
+
+// Checks for repeat counts to print at most every kRepeatFlushIntervalMs
+void MaybeFlushRepeats() {
+  if (s_suppress_duplicates &&
+      internal::TakeThrottle(&s_next_repeat_flush_ms, kRepeatFlushIntervalMs)) {
+    FlushRepeats(false);
+  }
+}
+
+void FlushAllRepeats() {
+  FlushRepeats(true);
+}
+
+// Prints a message which was logged at time `tv` to its sink. Rate limited messages are never
+// suppressed as duplicates, their call sites already decide how often they print. Returns the
+// stream written to or nullptr if the message was filtered.
+std::FILE* WriteToConsole(const timeval& tv, const char* file, int line, Severity severity,
+                          const char* log, bool rate_limited) {
   if (severity == Severity::ALL || severity == Severity::COUNT) {
     std::fprintf(stderr, "DefaultConsoleLogging: Log severity cannot be `ALL` or `COUNT`.");
     std::abort();
   }
 
   // Ignore severity if requested
-  if (s_severity == Severity::NONE || severity > s_severity) {
-    return;
+  if (!IsEnabled(severity)) {
+    return nullptr;
   }
 
   const int severity_int = SeverityToIndex(severity);
@@ -66,22 +225,200 @@ void DefaultConsoleLogging(const char* file, int line, Severity severity, const
   // Find the filestream on which to print the message
   std::FILE* outstream = s_sinks[severity_int];
   if (outstream == nullptr) {
-    return;
+    return nullptr;
   }
 
-  // Create a string with current date and time
-  struct tm* tm_info;
+  uint64_t repeats = 0;
+  if (!rate_limited && IsDuplicate(file, line, severity, log, &repeats)) {
+    return nullptr;
+  }
+
+  // Print the log message to the stream
+  if (repeats != 0) {
+    PrintRepeats(outstream, tv, file, line, severity_int, repeats);
+  }
+  PrintLine(outstream, tv, file, line, severity_int, log);
+  return outstream;
+}
+
+// Prints a message logged now and flushes its stream
+void ConsoleLog(const char* file, int line, Severity severity, const char* log,
+                bool rate_limited) {
   struct timeval tv;
   gettimeofday(&tv, NULL);
-  tm local_tm;
-  tm_info = localtime_r(&tv.tv_sec, &local_tm);
-  char time_str[20];
-  strftime(time_str, 20, "%Y-%m-%d %H:%M:%S", tm_info);
+  std::FILE* outstream = WriteToConsole(tv, file, line, severity, log, rate_limited);
+  if (outstream != nullptr) {
+    std::fflush(outstream);
+  }
+  MaybeFlushRepeats();
+}
 
-  // Print the log message to the stream
-  // Patterns have the following arguments: time, time in ms, file, line, message
-  std::fprintf(outstream, s_patterns[severity_int], time_str, tv.tv_usec / 1000, file, line, log);
-  std::fflush(outstream);
+// Default implementation of the logging function which prints to console
+void DefaultConsoleLogging(const char* file, int line, Severity severity, const char* log) {
+  ConsoleLog(file, line, severity, log, false);
+}
+
+// A message waiting in a ring for the background thread
+struct LogRecord {
+  timeval time;
+  const char* file;
+  int line;
+  Severity severity;
+  bool rate_limited;
+  char message[kAsyncMessageSize];
+};
+
+// Single producer / single consumer ring owned by one logging thread. The owner only writes
+// `head`, the background thread only writes `tail`, so neither needs a lock. The padding keeps
+// the two counters on separate cache lines.
+struct ThreadRing {
+  std::vector<LogRecord> records;
+  size_t mask;
+  char padding0[64];
+  std::atomic<size_t> head{0};
+  std::atomic<uint64_t> dropped{0};
+  // Set by the owner while it queues a message, StopAsync waits for it to clear
+  std::atomic<bool> busy{false};
+  char padding1[64];
+  std::atomic<size_t> tail{0};
+
+  explicit ThreadRing(size_t capacity) : records(capacity), mask(capacity - 1) {}
+};
+
+// State of the asynchronous backend
+std::atomic<bool> s_async{false};
+OverflowPolicy s_policy = OverflowPolicy::DROP;
+size_t s_ring_capacity = 1024;
+
+// All rings ever created. Rings are never freed, a thread which exits leaves its messages behind
+// for the background thread.
+std::mutex s_rings_mutex;
+std::vector<std::unique_ptr<ThreadRing>> s_rings;
+
+// Ring of the calling thread, created on its first asynchronous message
+thread_local ThreadRing* t_ring = nullptr;
+
+// Background thread and its wake up
+std::thread s_writer;
+std::atomic<bool> s_writer_running{false};
+std::mutex s_writer_mutex;
+std::condition_variable s_writer_wake;
+
+// How long the background thread sleeps when all rings are empty
+constexpr std::chrono::milliseconds kWriterIdleSleep(1);
+
+ThreadRing* RegisterThreadRing() {
+  std::lock_guard<std::mutex> lock(s_rings_mutex);
+  s_rings.emplace_back(new ThreadRing(s_ring_capacity));
+  t_ring = s_rings.back().get();
+  return t_ring;
+}
+
+// Queues a message on `ring`, the ring of the calling thread
+void LogToRing(ThreadRing* ring, const char* file, int line, Severity severity, bool rate_limited,
+               const char* txt, va_list args) {
+  const size_t head = ring->head.load(std::memory_order_relaxed);
+  while (head - ring->tail.load(std::memory_order_acquire) > ring->mask) {
+    if (s_policy == OverflowPolicy::DROP || !s_writer_running.load()) {
+      ring->dropped.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    s_writer_wake.notify_one();
+    std::this_thread::yield();
+  }
+  LogRecord& record = ring->records[head & ring->mask];
+  gettimeofday(&record.time, NULL);
+  record.file = file;
+  record.line = line;
+  record.severity = severity;
+  record.rate_limited = rate_limited;
+  const int length = std::vsnprintf(record.message, kAsyncMessageSize, txt, args);
+  if (length >= static_cast<int>(kAsyncMessageSize)) {
+    std::memcpy(record.message + kAsyncMessageSize - 4, "...", 4);
+  }
+  ring->head.store(head + 1, std::memory_order_release);
+}
+
+// Hands one queued message to its sink, returns the stream it went to if it needs flushing
+std::FILE* WriteRecord(const LogRecord& record) {
+  if (LoggingFunction == DefaultConsoleLogging) {
+    return WriteToConsole(record.time, record.file, record.line, record.severity, record.message,
+                          record.rate_limited);
+  }
+  LoggingFunction(record.file, record.line, record.severity, record.message);
+  return nullptr;
+}
+
+// Writes everything queued so far, returns the number of messages written
+size_t DrainRings() {
+  size_t written = 0;
+  uint64_t dropped = 0;
+  bool flush_sinks[kNumSeverity] = {};
+  // Only the ring list is read under the lock, the I/O happens outside of it so neither a thread
+  // registering its ring nor DroppedMessages waits for the console. Rings are never freed, the
+  // pointers stay valid. Only the background thread drains, so the copy can be reused.
+  static std::vector<ThreadRing*> s_drained_rings;
+  {
+    std::lock_guard<std::mutex> lock(s_rings_mutex);
+    s_drained_rings.clear();
+    for (auto& ring : s_rings) {
+      s_drained_rings.push_back(ring.get());
+    }
+  }
+  for (ThreadRing* ring : s_drained_rings) {
+    size_t tail = ring->tail.load(std::memory_order_relaxed);
+    const size_t head = ring->head.load(std::memory_order_acquire);
+    for (; tail != head; tail++) {
+      const LogRecord& record = ring->records[tail & ring->mask];
+      if (WriteRecord(record) != nullptr) {
+        flush_sinks[static_cast<int>(record.severity)] = true;
+      }
+      written++;
+    }
+    ring->tail.store(tail, std::memory_order_release);
+    dropped += ring->dropped.load(std::memory_order_relaxed);
+  }
+
+  // Report new drops once per pass instead of once per message
+  static uint64_t s_reported_dropped = 0;
+  if (dropped != s_reported_dropped) {
+    char message[64];
+    std::snprintf(message, sizeof(message), "%lu log messages dropped, rings were full",
+                  static_cast<unsigned long>(dropped - s_reported_dropped));
+    s_reported_dropped = dropped;
+    LogRecord record;
+    gettimeofday(&record.time, NULL);
+    record.file = __FILE__;
+    record.line = __LINE__;
+    record.severity = Severity::WARNING;
+    record.rate_limited = true;
+    std::strcpy(record.message, message);
+    if (WriteRecord(record) != nullptr) {
+      flush_sinks[static_cast<int>(Severity::WARNING)] = true;
+    }
+  }
+
+  // One flush per stream and pass instead of one per message
+  for (int i = 0; i < kNumSeverity; i++) {
+    if (flush_sinks[i] && s_sinks[i] != nullptr) {
+      std::fflush(s_sinks[i]);
+    }
+  }
+  return written;
+}
+
+void WriterLoop() {
+  while (s_writer_running.load()) {
+    if (LoggingFunction == DefaultConsoleLogging) {
+      MaybeFlushRepeats();
+    }
+    if (DrainRings() == 0) {
+      std::unique_lock<std::mutex> lock(s_writer_mutex);
+      s_writer_wake.wait_for(lock, kWriterIdleSleep);
+    }
+  }
+  // Whatever was logged before StopAsync
+  DrainRings();
 }
 
 }  // namespace
@@ -103,6 +440,131 @@ void Redirect(std::FILE* file, Severity severity) {
   }
 }
 
+bool IsEnabled(Severity severity) {
+  return s_severity != Severity::NONE && severity <= s_severity;
+}
+
+void SetDuplicateSuppression(bool enabled, uint64_t window_ms) {
+  s_duplicate_window_ms = window_ms;
+  s_suppress_duplicates = enabled;
+  // Counts still pending at exit are printed
+  static std::once_flag s_at_exit;
+  if (enabled) {
+    std::call_once(s_at_exit, [] { std::atexit(FlushAllRepeats); });
+  }
+}
+
+namespace internal {
+
+bool TakeThrottle(std::atomic<uint64_t>* next_ms, uint64_t ms) {
+  const uint64_t now_ms = MonotonicNowMs();
+  uint64_t next = next_ms->load(std::memory_order_relaxed);
+  // Only one of several racing threads wins the slot
+  return now_ms >= next &&
+         next_ms->compare_exchange_strong(next, now_ms + ms, std::memory_order_relaxed);
+}
+
+}  // namespace internal
+
+namespace internal {
+
+void VLogAt(const char* file, int line, Severity severity, bool rate_limited, const char* txt,
+            va_list args) {
+  if (s_async.load(std::memory_order_relaxed)) {
+    ThreadRing* ring = t_ring != nullptr ? t_ring : RegisterThreadRing();
+    // Either StopAsync sees `busy` and waits for the message to be queued before the final
+    // drain, or this thread sees the backend stopped and logs synchronously
+    ring->busy.store(true);
+    if (s_async.load()) {
+      LogToRing(ring, file, line, severity, rate_limited, txt, args);
+      ring->busy.store(false, std::memory_order_release);
+      return;
+    }
+    ring->busy.store(false, std::memory_order_relaxed);
+  }
+
+  // Format on the stack, only very long messages need the heap
+  char buffer[kAsyncMessageSize];
+  va_list args_copy;
+  va_copy(args_copy, args);
+  const int length = std::vsnprintf(buffer, sizeof(buffer), txt, args);
+  std::vector<char> long_buffer;
+  const char* log = buffer;
+  if (length >= static_cast<int>(sizeof(buffer))) {
+    long_buffer.resize(length + 1);
+    std::vsnprintf(long_buffer.data(), long_buffer.size(), txt, args_copy);
+    log = long_buffer.data();
+  }
+  va_end(args_copy);
+  if (LoggingFunction == DefaultConsoleLogging) {
+    ConsoleLog(file, line, severity, log, rate_limited);
+  } else {
+    LoggingFunction(file, line, severity, log);
+  }
+}
+
+}  // namespace internal
+
+void VLog(const char* file, int line, Severity severity, const char* txt, va_list args) {
+  internal::VLogAt(file, line, severity, false, txt, args);
+}
+
+void StartAsync(OverflowPolicy policy, size_t ring_capacity) {
+  if (s_async.load()) {
+    return;
+  }
+  if (ring_capacity == 0 || (ring_capacity & (ring_capacity - 1)) != 0) {
+    std::fprintf(stderr, "StartAsync: Ring capacity must be a power of two.\n");
+    std::abort();
+  }
+  s_policy = policy;
+  {
+    std::lock_guard<std::mutex> lock(s_rings_mutex);
+    s_ring_capacity = ring_capacity;
+  }
+  s_writer_running = true;
+  s_writer = std::thread(WriterLoop);
+  s_async = true;
+  // Messages queued before exit are written, and the writer is joined before its std::thread
+  // is destroyed
+  static std::once_flag s_at_exit;
+  std::call_once(s_at_exit, [] { std::atexit(StopAsync); });
+}
+
+void StopAsync() {
+  if (!s_async.load()) {
+    return;
+  }
+  s_async = false;
+  // Let threads which saw the backend running finish queueing their message, the writer keeps
+  // draining meanwhile. A ring registered after this snapshot belongs to a thread which sees
+  // `s_async` cleared.
+  std::vector<ThreadRing*> rings;
+  {
+    std::lock_guard<std::mutex> lock(s_rings_mutex);
+    for (auto& ring : s_rings) {
+      rings.push_back(ring.get());
+    }
+  }
+  for (ThreadRing* ring : rings) {
+    while (ring->busy.load()) {
+      std::this_thread::yield();
+    }
+  }
+  s_writer_running = false;
+  s_writer_wake.notify_one();
+  s_writer.join();
+}
+
+uint64_t DroppedMessages() {
+  std::lock_guard<std::mutex> lock(s_rings_mutex);
+  uint64_t dropped = 0;
+  for (auto& ring : s_rings) {
+    dropped += ring->dropped.load(std::memory_order_relaxed);
+  }
+  return dropped;
+}
+
 void SetSeverity(Severity severity) {
   if (severity == Severity::COUNT) {
     std::fprintf(stderr, "SetSeverity: Log severity cannot be `COUNT`.\n");
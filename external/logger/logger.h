@@ -1,24 +1,81 @@
 #pragma once
 
+#include <atomic>
 #include <cstdarg>
+#include <cstddef>
+#include <cstdint>
 #include <cstdio>
-#include <vector>
+
+// Messages less severe than this are removed at compile time, together with the evaluation of
+// their arguments: 0 PANIC, 1 ERROR, 2 WARNING, 3 INFO, 4 DEBUG.
+#ifndef LOG_COMPILED_SEVERITY
+#define LOG_COMPILED_SEVERITY 4
+#endif
+
+// True if messages of the numeric `level` are compiled in
+#define LOG_LEVEL_COMPILED(level) ((level) <= LOG_COMPILED_SEVERITY)
+
+// Logs a message of the given numeric level and severity. Neither formatting nor argument
+// evaluation happen if the level is compiled out or filtered by `SetSeverity`.
+#define LOG_AT(level, severity, ...)                                                          \
+  do {                                                                                        \
+    if (LOG_LEVEL_COMPILED(level) && ::fan_controller::logger::IsEnabled(severity)) {         \
+      ::fan_controller::logger::Log(__FILE__, __LINE__, severity, __VA_ARGS__);               \
+    }                                                                                         \
+  } while (0)
+
+// Logs only the first and then every `n`-th occurrence of this call site
+#define LOG_EVERY_N_AT(level, severity, n, ...)                                               \
+  do {                                                                                        \
+    static std::atomic<uint64_t> log_occurrences(0);                                          \
+    if (LOG_LEVEL_COMPILED(level) && ::fan_controller::logger::IsEnabled(severity) &&         \
+        log_occurrences.fetch_add(1, std::memory_order_relaxed) % (n) == 0) {                 \
+      ::fan_controller::logger::internal::LogRateLimited(__FILE__, __LINE__, severity,        \
+                                                         __VA_ARGS__);                        \
+    }                                                                                         \
+  } while (0)
+
+// Logs this call site at most once every `ms` milliseconds
+#define LOG_THROTTLED_AT(level, severity, ms, ...)                                            \
+  do {                                                                                        \
+    static std::atomic<uint64_t> log_next_ms(0);                                              \
+    if (LOG_LEVEL_COMPILED(level) && ::fan_controller::logger::IsEnabled(severity) &&         \
+        ::fan_controller::logger::internal::TakeThrottle(&log_next_ms, ms)) {                 \
+      ::fan_controller::logger::internal::LogRateLimited(__FILE__, __LINE__, severity,        \
+                                                         __VA_ARGS__);                        \
+    }                                                                                         \
+  } while (0)
 
 // Logs a debug message
-#define LOG_DEBUG(...) \
-  ::fan_controller::logger::Log(__FILE__, __LINE__, ::fan_controller::logger::Severity::DEBUG, __VA_ARGS__)
+#define LOG_DEBUG(...) LOG_AT(4, ::fan_controller::logger::Severity::DEBUG, __VA_ARGS__)
 
 // Logs an informational message
-#define LOG_INFO(...) \
-  ::fan_controller::logger::Log(__FILE__, __LINE__, ::fan_controller::logger::Severity::INFO, __VA_ARGS__)
+#define LOG_INFO(...) LOG_AT(3, ::fan_controller::logger::Severity::INFO, __VA_ARGS__)
 
 // Logs a warning
-#define LOG_WARNING(...) \
-  ::fan_controller::logger::Log(__FILE__, __LINE__, ::fan_controller::logger::Severity::WARNING, __VA_ARGS__)
+#define LOG_WARNING(...) LOG_AT(2, ::fan_controller::logger::Severity::WARNING, __VA_ARGS__)
 
 // Logs an error
-#define LOG_ERROR(...) \
-  ::fan_controller::logger::Log(__FILE__, __LINE__, ::fan_controller::logger::Severity::ERROR, __VA_ARGS__)
+#define LOG_ERROR(...) LOG_AT(1, ::fan_controller::logger::Severity::ERROR, __VA_ARGS__)
+
+// Rate limited variants, for messages which could otherwise be logged on every update
+#define LOG_DEBUG_EVERY_N(n, ...) \
+  LOG_EVERY_N_AT(4, ::fan_controller::logger::Severity::DEBUG, n, __VA_ARGS__)
+#define LOG_INFO_EVERY_N(n, ...) \
+  LOG_EVERY_N_AT(3, ::fan_controller::logger::Severity::INFO, n, __VA_ARGS__)
+#define LOG_WARNING_EVERY_N(n, ...) \
+  LOG_EVERY_N_AT(2, ::fan_controller::logger::Severity::WARNING, n, __VA_ARGS__)
+#define LOG_ERROR_EVERY_N(n, ...) \
+  LOG_EVERY_N_AT(1, ::fan_controller::logger::Severity::ERROR, n, __VA_ARGS__)
+
+#define LOG_DEBUG_THROTTLED(ms, ...) \
+  LOG_THROTTLED_AT(4, ::fan_controller::logger::Severity::DEBUG, ms, __VA_ARGS__)
+#define LOG_INFO_THROTTLED(ms, ...) \
+  LOG_THROTTLED_AT(3, ::fan_controller::logger::Severity::INFO, ms, __VA_ARGS__)
+#define LOG_WARNING_THROTTLED(ms, ...) \
+  LOG_THROTTLED_AT(2, ::fan_controller::logger::Severity::WARNING, ms, __VA_ARGS__)
+#define LOG_ERROR_THROTTLED(ms, ...) \
+  LOG_THROTTLED_AT(1, ::fan_controller::logger::Severity::ERROR, ms, __VA_ARGS__)
 
 namespace fan_controller {
 namespace logger {
@@ -39,27 +96,82 @@ enum class Severity {
   COUNT
 };
 
+// What a thread does when its asynchronous log ring is full
+enum class OverflowPolicy {
+  // Discard the message and count it, see `DroppedMessages`
+  DROP,
+  // Wait until the background thread made room
+  BLOCK
+};
+
+// Largest message kept by the asynchronous backend including the terminating zero. Longer
+// messages are truncated.
+constexpr size_t kAsyncMessageSize = 256;
+
 // Function which is used for logging. It can be changed to intercept the logged messages.
 extern void (*LoggingFunction)(const char* file, int line, Severity severity, const char* log);
 
 // Redirects the output for a given log severity.
 void Redirect(std::FILE* file, Severity severity = Severity::ALL);
 
-// Sets global log severity thus effectively disabling all logging with lower severity
+// Sets global log severity thus effectively disabling all logging with lower severity. Messages
+// filtered this way are neither formatted nor passed to LoggingFunction.
 void SetSeverity(Severity severity);
 
+// Returns true if messages of the given severity pass the global severity
+bool IsEnabled(Severity severity);
+
+// Turns suppression of repeated messages on or off, off by default. When a call site logs the same
+// text again within `window_ms` of printing it, it is not printed. The number of repeats is printed
+// once the call site logs something else or the window ran out, which is checked about once a
+// second while logging continues, and at exit. The rate limited macros are never suppressed.
+void SetDuplicateSuppression(bool enabled, uint64_t window_ms = 10000);
+
+// Switches to asynchronous logging. Every thread formats its messages into a lock-free ring of its
+// own, `ring_capacity` messages deep, without allocating. A background thread adds the time stamp
+// text and does the I/O, or hands the messages to LoggingFunction if it was changed.
+// Messages are time stamped when logged, not when written. Pending messages are written at exit.
+void StartAsync(OverflowPolicy policy = OverflowPolicy::DROP, size_t ring_capacity = 1024);
+
+// Writes all pending messages, stops the background thread and goes back to synchronous logging
+void StopAsync();
+
+// Number of messages discarded so far because a ring was full
+uint64_t DroppedMessages();
+
+namespace internal {
+
+// Returns true and moves `*next_ms` `ms` milliseconds ahead if the current monotonic time has
+// passed it. Used by the throttled macros.
+bool TakeThrottle(std::atomic<uint64_t>* next_ms, uint64_t ms);
+
+// VLog for messages which are rate limited by their call site if `rate_limited` is set, they are
+// exempt from duplicate suppression
+void VLogAt(const char* file, int line, Severity severity, bool rate_limited, const char* txt,
+            va_list args);
+
+// Log for the every-N and throttled macros
+template<typename... Args>
+void LogRateLimited(const char* file, int line, Severity severity, const char* txt, ...) {
+  va_list args;
+  va_start(args, txt);
+  VLogAt(file, line, severity, true, txt, args);
+  va_end(args);
+}
+
+}  // namespace internal
+
+// Formats the message and either queues it for the background thread or passes it to
+// LoggingFunction directly.
+void VLog(const char* file, int line, Severity severity, const char* txt, va_list args);
+
 // Converts the message and argument into a string and pass it to LoggingFunction.
 template<typename... Args>
 void Log(const char* file, int line, Severity severity, const char* txt, ...) {
-  va_list args1;
-  va_start(args1, txt);
-  va_list args2;
-  va_copy(args2, args1);
-  std::vector<char> buf(1 + std::vsnprintf(NULL, 0, txt, args1));
-  va_end(args1);
-  std::vsnprintf(buf.data(), buf.size(), txt, args2);
-  va_end(args2);
-  LoggingFunction(file, line, severity, buf.data());
+  va_list args;
+  va_start(args, txt);
+  VLog(file, line, severity, txt, args);
+  va_end(args);
 }
 
 }  // namespace logger
@@ -0,0 +1,376 @@
+// End to end latency benchmark. For every combination of transport, sensor
+// count and fan count the real controller is forked as a child process, like
+// main does, and driven by a synthetic producer and consumer:
+// the producer flips one sensor between two temperatures, which forces a new
+// max temperature and therefore a register publish, and measures the time
+// until the consumer has received the new PWM counts from RegisterShared.
+// Only one update is in flight at a time, so updates/s is the sustained
+// closed loop rate. Results go to stdout and, with --output, to a JSON file.
+
+#include <getopt.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <atomic>
+#include <boost/interprocess/shared_memory_object.hpp>
+#include <boost/thread.hpp>
+#include <cstdio>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "../logger/logger.h"
+#include "controller.h"
+#include "histogram.h"
+#include "register_subscriber.h"
+#include "sensor_publisher.h"
+#include "shard_ingest.h"
+
+using ::fan_controller::Histogram;
+using ::fan_controller::loadgen::RegisterSubscriber;
+using ::fan_controller::loadgen::SensorPublisher;
+
+namespace {
+
+// Give up on a single update after this long and count it as a timeout
+const uint64_t UPDATE_TIMEOUT_NS = 1000000000ull;
+
+// Percentiles printed in the HDR style distribution
+const double PERCENTILES[] = {0,  50,   75,    90,     99,
+                              99.9, 99.99, 99.999, 100};
+
+struct BenchResult {
+  std::string transport_;
+  // "threads", "event_loop" or "shards"
+  std::string core_;
+  uint32_t sensor_count_ = 0;
+  uint32_t fan_count_ = 0;
+  uint64_t timeouts_ = 0;
+  double updates_per_second_ = 0;
+  Histogram latency_ns_;
+};
+
+// Consumer thread state, written by the consumer and polled by the producer
+struct Consumer {
+  std::atomic<uint64_t> generation;
+  std::atomic<uint64_t> received_ns;
+  std::atomic<bool> done;
+  uint32_t fan_count;
+  Consumer(uint32_t fans)
+      : generation(0), received_ns(0), done(false), fan_count(fans) {}
+
+  void Run() {
+    RegisterSubscriber subscriber(fan_count);
+    while (!done && !subscriber.Attach(100)) {
+    }
+    std::vector<u_int32_t> registers(fan_count);
+    while (!done) {
+      if (!subscriber.Receive(registers.data(), 100)) continue;
+      received_ns.store(::MonotonicNowNs(), std::memory_order_relaxed);
+      generation.fetch_add(1, std::memory_order_release);
+    }
+  }
+};
+
+// Spins until the consumer saw a generation newer than last, returns false on
+// timeout
+bool WaitForGeneration(const Consumer& consumer, uint64_t last,
+                       uint64_t timeout_ns) {
+  const uint64_t deadline = ::MonotonicNowNs() + timeout_ns;
+  uint32_t spins = 0;
+  while (consumer.generation.load(std::memory_order_acquire) == last) {
+    // Spin briefly, then give the controller our core in case it shares it
+    if (++spins < 128) continue;
+    sched_yield();
+    if (::MonotonicNowNs() > deadline) return false;
+  }
+  return true;
+}
+
+const char* TransportName(SensorTransport transport) {
+  switch (transport) {
+    case SensorTransport::SEQLOCK:
+      return "seqlock";
+    case SensorTransport::RING:
+      return "ring";
+    case SensorTransport::SLOTS:
+      return "slots";
+    case SensorTransport::SEMAPHORE:
+    default:
+      return "semaphore";
+  }
+}
+
+bool RunOne(SensorTransport transport, const std::string& core,
+            uint32_t shard_count, uint32_t sensor_count, uint32_t fan_count,
+            uint64_t warmup, uint64_t iterations, BenchResult* result) {
+  InputConfiguration config(fan_count, sensor_count);
+  config.transport_ = transport;
+  config.event_loop_ = core == "event_loop";
+  if (core == "shards") config.shard_count_ = shard_count;
+  // One subsystem per sensor, the worst case for the dirty bitmap scan
+  config.subsystem_count_ = sensor_count;
+  // Large maxima keep the PWM counts of the two temperatures apart
+  config.max_pwm_values.assign(fan_count, 1000000);
+
+  result->transport_ = TransportName(transport);
+  result->core_ = core;
+  result->sensor_count_ = sensor_count;
+  result->fan_count_ = fan_count;
+
+  SensorPublisher publisher(config, sensor_count);
+  if (!publisher.Open()) return false;
+  // All sensors start cool, sensor 0 will carry the updates
+  std::vector<uint32_t> ids(sensor_count);
+  std::vector<float> values(sensor_count, 20.0f);
+  for (uint32_t i = 0; i < sensor_count; i++) ids[i] = i;
+  publisher.Publish(ids.data(), values.data(), sensor_count);
+
+  boost::interprocess::shared_memory_object::remove(
+      register_memory_name.c_str());
+  pid_t controller_pid = fork();
+  if (controller_pid == 0) {
+    ::fan_controller::logger::SetSeverity(
+        ::fan_controller::logger::Severity::WARNING);
+    ::fan_controller::logger::StartAsync();
+    const bool started =
+        ::fan_controller::controller::StartController(config);
+    ::fan_controller::logger::StopAsync();
+    _exit(started ? 0 : 1);
+  }
+  // Shards add a process hop between the slots and the controller
+  std::vector<pid_t> shard_pids;
+  for (uint32_t shard = 0; shard < config.shard_count_; shard++) {
+    const pid_t pid = fork();
+    if (pid == 0) {
+      ::fan_controller::logger::SetSeverity(
+          ::fan_controller::logger::Severity::WARNING);
+      ::fan_controller::logger::StartAsync();
+      const bool started =
+          ::fan_controller::controller::StartShard(config, shard);
+      ::fan_controller::logger::StopAsync();
+      _exit(started ? 0 : 1);
+    }
+    shard_pids.push_back(pid);
+  }
+
+  Consumer consumer(fan_count);
+  boost::thread consumer_thread(boost::bind(&Consumer::Run, &consumer));
+
+  // The controller publishes once for the initial values, this also covers
+  // its start up delay
+  bool ok = WaitForGeneration(consumer, 0, 10 * UPDATE_TIMEOUT_NS);
+  if (!ok)
+    LOG_ERROR("Controller did not start for %s\n", result->transport_.c_str());
+
+  uint64_t measured_start = 0;
+  for (uint64_t i = 0; ok && i < warmup + iterations; i++) {
+    if (i == warmup) measured_start = ::MonotonicNowNs();
+    const uint32_t id = 0;
+    const float value = (i % 2 == 0) ? 60.0f : 40.0f;
+    const uint64_t generation = consumer.generation.load();
+    const uint64_t sent_ns = ::MonotonicNowNs();
+    publisher.Publish(&id, &value, 1);
+    if (!WaitForGeneration(consumer, generation, UPDATE_TIMEOUT_NS)) {
+      if (i >= warmup) result->timeouts_++;
+      continue;
+    }
+    if (i >= warmup)
+      result->latency_ns_.Record(consumer.received_ns.load() - sent_ns);
+  }
+  if (ok) {
+    const double seconds = (::MonotonicNowNs() - measured_start) / 1e9;
+    result->updates_per_second_ = result->latency_ns_.Count() / seconds;
+  }
+
+  consumer.done = true;
+  consumer_thread.join();
+  for (pid_t pid : shard_pids) {
+    kill(pid, SIGTERM);
+    waitpid(pid, nullptr, 0);
+  }
+  kill(controller_pid, SIGTERM);
+  waitpid(controller_pid, nullptr, 0);
+  boost::interprocess::shared_memory_object::remove(
+      register_memory_name.c_str());
+  return ok;
+}
+
+void PrintResult(const BenchResult& result) {
+  const Histogram& h = result.latency_ns_;
+  std::printf(
+      "%-9s %-10s sensors=%-5u fans=%-5u n=%-8lu timeouts=%-4lu "
+      "p50=%8.2fus p99=%8.2fus p99.9=%8.2fus max=%8.2fus %10.0f updates/s\n",
+      result.transport_.c_str(), result.core_.c_str(), result.sensor_count_, result.fan_count_,
+      h.Count(), result.timeouts_, h.ValueAtPercentile(50) / 1e3,
+      h.ValueAtPercentile(99) / 1e3, h.ValueAtPercentile(99.9) / 1e3,
+      h.Max() / 1e3, result.updates_per_second_);
+  std::printf("  %12s %12s %12s\n", "Value(us)", "Percentile", "TotalCount");
+  for (double percentile : PERCENTILES) {
+    std::printf("  %12.3f %12.5f %12lu\n",
+                h.ValueAtPercentile(percentile) / 1e3, percentile / 100,
+                static_cast<uint64_t>(percentile / 100 * h.Count() + 0.5));
+  }
+}
+
+bool WriteJson(const std::string& path,
+               const std::vector<BenchResult>& results) {
+  FILE* out = std::fopen(path.c_str(), "w");
+  if (out == nullptr) {
+    LOG_ERROR("Cannot write %s\n", path.c_str());
+    return false;
+  }
+  std::fprintf(out, "{\n  \"benchmark\": \"bench_e2e\",\n  \"results\": [\n");
+  for (size_t r = 0; r < results.size(); r++) {
+    const BenchResult& result = results[r];
+    const Histogram& h = result.latency_ns_;
+    std::fprintf(out,
+                 "    {\"transport\": \"%s\", \"core\": \"%s\", \"sensors\": %u, "
+                 "\"fans\": %u, "
+                 "\"count\": %lu, \"timeouts\": %lu, \"updates_per_s\": %.1f,"
+                 "\n     \"latency_ns\": {\"min\": %lu, \"mean\": %.1f, "
+                 "\"p50\": %lu, \"p99\": %lu, \"p99_9\": %lu, \"max\": %lu},"
+                 "\n     \"histogram_ns\": [",
+                 result.transport_.c_str(), result.core_.c_str(),
+                 result.sensor_count_, result.fan_count_, h.Count(), result.timeouts_,
+                 result.updates_per_second_, h.Min(), h.Mean(),
+                 h.ValueAtPercentile(50), h.ValueAtPercentile(99),
+                 h.ValueAtPercentile(99.9), h.Max());
+    // Non empty buckets as [upper bound, count] pairs
+    bool first = true;
+    for (uint32_t i = 0; i < Histogram::BUCKET_COUNT; i++) {
+      if (h.BucketCount(i) == 0) continue;
+      std::fprintf(out, "%s[%lu, %lu]", first ? "" : ", ",
+                   Histogram::BucketUpperBound(i), h.BucketCount(i));
+      first = false;
+    }
+    std::fprintf(out, "]}%s\n", r + 1 == results.size() ? "" : ",");
+  }
+  std::fprintf(out, "  ]\n}\n");
+  std::fclose(out);
+  return true;
+}
+
+// Parses a comma separated list of positive numbers
+bool ParseCounts(const std::string& list, uint32_t max,
+                 std::vector<uint32_t>* counts) {
+  std::istringstream in(list);
+  std::string item;
+  counts->clear();
+  while (std::getline(in, item, ',')) {
+    uint32_t count = atoi(item.c_str());
+    if (count == 0 || count > max) return false;
+    counts->push_back(count);
+  }
+  return !counts->empty();
+}
+
+bool ParseTransports(const std::string& list,
+                     std::vector<SensorTransport>* transports) {
+  std::istringstream in(list);
+  std::string item;
+  transports->clear();
+  while (std::getline(in, item, ',')) {
+    if (item == "semaphore")
+      transports->push_back(SensorTransport::SEMAPHORE);
+    else if (item == "seqlock")
+      transports->push_back(SensorTransport::SEQLOCK);
+    else if (item == "ring")
+      transports->push_back(SensorTransport::RING);
+    else if (item == "slots")
+      transports->push_back(SensorTransport::SLOTS);
+    else
+      return false;
+  }
+  return !transports->empty();
+}
+
+// Parses a comma separated list of controller cores, threads, event_loop or
+// shards
+bool ParseCores(const std::string& list, std::vector<std::string>* cores) {
+  std::istringstream in(list);
+  std::string item;
+  cores->clear();
+  while (std::getline(in, item, ',')) {
+    if (item != "threads" && item != "event_loop" && item != "shards")
+      return false;
+    cores->push_back(item);
+  }
+  return !cores->empty();
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  static const option long_options[] = {
+      {"sensors", required_argument, nullptr, 's'},
+      {"fans", required_argument, nullptr, 'f'},
+      {"transports", required_argument, nullptr, 't'},
+      {"iterations", required_argument, nullptr, 'i'},
+      {"warmup", required_argument, nullptr, 'w'},
+      {"cores", required_argument, nullptr, 'c'},
+      {"shards", required_argument, nullptr, 'S'},
+      {"output", required_argument, nullptr, 'o'},
+      {nullptr, 0, nullptr, 0}};
+
+  std::vector<uint32_t> sensor_counts = {1, 100, 10000};
+  std::vector<uint32_t> fan_counts = {1, 16, 256};
+  std::vector<SensorTransport> transports = {SensorTransport::SEMAPHORE,
+                                             SensorTransport::SEQLOCK,
+                                             SensorTransport::RING,
+                                             SensorTransport::SLOTS};
+  std::vector<std::string> cores = {"threads", "event_loop"};
+  uint32_t shard_count = 4;
+  uint64_t iterations = 10000, warmup = 1000;
+  std::string output;
+  int option;
+  while ((option = getopt_long(argc, argv, "", long_options, nullptr)) != -1) {
+    bool valid = true;
+    switch (option) {
+      case 's':
+        valid = ParseCounts(optarg, MAX_SENSOR_COUNT, &sensor_counts);
+        break;
+      case 'f': valid = ParseCounts(optarg, MAX_FAN_COUNT, &fan_counts); break;
+      case 't': valid = ParseTransports(optarg, &transports); break;
+      case 'i': iterations = atoll(optarg); break;
+      case 'w': warmup = atoll(optarg); break;
+      case 'c': valid = ParseCores(optarg, &cores); break;
+      case 'S': shard_count = atoi(optarg); break;
+      case 'o': output = optarg; break;
+      default: valid = false; break;
+    }
+    if (!valid || iterations == 0 || shard_count == 0) {
+      LOG_ERROR(
+          "Usage: bench_e2e [--sensors 1,100,10000] [--fans 1,16,256] "
+          "[--transports semaphore,seqlock,ring,slots] "
+          "[--cores threads,event_loop,shards] [--shards N] "
+          "[--iterations N] "
+          "[--warmup N] [--output FILE.json]\n");
+      return -1;
+    }
+  }
+  // Keep the benchmark output readable
+  ::fan_controller::logger::SetSeverity(
+      ::fan_controller::logger::Severity::WARNING);
+
+  std::vector<BenchResult> results;
+  bool ok = true;
+  for (SensorTransport transport : transports) {
+    for (const std::string& core : cores) {
+      for (uint32_t sensor_count : sensor_counts) {
+        for (uint32_t fan_count : fan_counts) {
+          // Shards split the slots transport's subsystems, one per sensor
+          if (core == "shards" && (transport != SensorTransport::SLOTS ||
+                                   sensor_count < shard_count))
+            continue;
+          results.push_back(BenchResult());
+          ok &= RunOne(transport, core, shard_count, sensor_count, fan_count,
+                       warmup, iterations, &results.back());
+          PrintResult(results.back());
+        }
+      }
+    }
+  }
+  if (!output.empty()) ok &= WriteJson(output, results);
+  return ok ? 0 : -1;
+}
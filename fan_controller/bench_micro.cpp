@@ -0,0 +1,580 @@
+// Microbenchmarks of the controller hot paths, one group per Makefile target:
+//   curve  fan curve lookup and a full control step across fan counts
+//   max    maximum over all sensors, rescan versus max tree, across sensor
+//          counts
+//   log    cost of a log call, filtered, formatted and queued
+//   ipc    round trips through the sensor semaphores and the register
+//          mailbox between two processes
+// Every case is pinned, warmed up for --warmup-ms, sized so one repetition
+// takes about --min-time-ms and run --repetitions times. Reported are the
+// median and best ns/op, ops/s of the median and heap allocations per op as
+// counted by operator new. Results go to stdout and, with --output, to a JSON
+// file.
+
+#include <getopt.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <new>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "../logger/logger.h"
+#include "common.h"
+#include "control_algorithm.h"
+#include "fan_curve.h"
+#include "max_reduce.h"
+#include "max_tree.h"
+
+using ::fan_controller::MaxTree;
+using ::fan_controller::controller::ControlAlgorithm;
+using ::fan_controller::controller::FanCurveEngine;
+
+// Heap allocations of the whole process through operator new, Measure reports
+// the ones made while a case runs
+static std::atomic<uint64_t> allocations(0);
+
+void* operator new(size_t size) {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  void* memory = std::malloc(size == 0 ? 1 : size);
+  if (memory == nullptr) throw std::bad_alloc();
+  return memory;
+}
+
+void* operator new[](size_t size) { return operator new(size); }
+
+void operator delete(void* memory) noexcept { std::free(memory); }
+
+void operator delete[](void* memory) noexcept { std::free(memory); }
+
+void operator delete(void* memory, size_t) noexcept { std::free(memory); }
+
+void operator delete[](void* memory, size_t) noexcept { std::free(memory); }
+
+namespace {
+
+struct MicroOptions {
+  uint64_t warmup_ns = 200000000;
+  uint64_t min_time_ns = 100000000;
+  uint32_t repetitions = 5;
+  int32_t cpu = 0;
+  // CPU of the second process of the ipc group, -1 picks the next one
+  int32_t peer_cpu = -1;
+};
+
+struct MicroResult {
+  std::string group_;
+  std::string case_;
+  // 0 where the case does not depend on it
+  uint32_t sensor_count_ = 0;
+  uint32_t fan_count_ = 0;
+  uint64_t iterations_ = 0;
+  double median_ns_ = 0;
+  double best_ns_ = 0;
+  double ops_per_second_ = 0;
+  double allocations_per_op_ = 0;
+};
+
+MicroOptions options;
+
+// Keeps the compiler from dropping the computation of value
+template <typename T>
+void KeepAlive(const T& value) {
+  asm volatile("" : : "r,m"(value) : "memory");
+}
+
+void PinToCpu(int32_t cpu) {
+  if (cpu < 0) return;
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(cpu, &cpus);
+  if (sched_setaffinity(0, sizeof(cpus), &cpus) < 0)
+    LOG_WARNING("Pinning to CPU %d failed: %s\n", cpu, strerror(errno));
+}
+
+// Runs op(i) with increasing i, warm up first, see the top of the file.
+// op is a template parameter so the call is inlined and only op is measured.
+template <typename Op>
+MicroResult Measure(const std::string& group, const std::string& name,
+                    uint32_t sensor_count, uint32_t fan_count, Op op) {
+  uint64_t i = 0;
+  // Warm up caches, branch predictors and CPU frequency and find the batch
+  // size of one repetition on the way
+  const uint64_t warmup_start = MonotonicNowNs();
+  uint64_t now = warmup_start;
+  while (now - warmup_start < options.warmup_ns) {
+    for (uint32_t n = 0; n < 64; n++) op(i++);
+    now = MonotonicNowNs();
+  }
+  const uint64_t batch = std::max<uint64_t>(
+      1, static_cast<double>(i) * options.min_time_ns /
+             std::max<uint64_t>(now - warmup_start, 1));
+
+  std::vector<double> ns_per_op;
+  ns_per_op.reserve(options.repetitions);
+  const uint64_t allocations_before = allocations.load();
+  for (uint32_t repetition = 0; repetition < options.repetitions;
+       repetition++) {
+    const uint64_t start = MonotonicNowNs();
+    for (uint64_t n = 0; n < batch; n++) op(i++);
+    const uint64_t end = MonotonicNowNs();
+    ns_per_op.push_back(static_cast<double>(end - start) / batch);
+  }
+  const uint64_t allocated = allocations.load() - allocations_before;
+  std::sort(ns_per_op.begin(), ns_per_op.end());
+
+  MicroResult result;
+  result.group_ = group;
+  result.case_ = name;
+  result.sensor_count_ = sensor_count;
+  result.fan_count_ = fan_count;
+  result.iterations_ = batch * options.repetitions;
+  result.median_ns_ = ns_per_op[ns_per_op.size() / 2];
+  result.best_ns_ = ns_per_op.front();
+  result.ops_per_second_ = result.median_ns_ > 0 ? 1e9 / result.median_ns_ : 0;
+  result.allocations_per_op_ =
+      static_cast<double>(allocated) / result.iterations_;
+  return result;
+}
+
+// Temperatures between 20° and 80°, so the curves see every segment and
+// consecutive steps always change the registers
+std::vector<float> Temperatures() {
+  std::vector<float> temperatures(1024);
+  for (size_t i = 0; i < temperatures.size(); i++)
+    temperatures[i] = 20.0f + (i * 37 % 1024) * 60.0f / 1024;
+  return temperatures;
+}
+
+void BenchCurve(const std::vector<uint32_t>& fan_counts,
+                std::vector<MicroResult>* results) {
+  const std::vector<float> temperatures = Temperatures();
+  for (uint32_t fan_count : fan_counts) {
+    InputConfiguration config(fan_count, 1);
+    config.max_pwm_values.assign(fan_count, 1000);
+    std::vector<u_int32_t> registers(fan_count);
+    {
+      FanCurveEngine engine(config);
+      results->push_back(
+          Measure("curve", "engine", 0, fan_count, [&](uint64_t i) {
+            KeepAlive(engine.Calculate(temperatures[i & 1023],
+                                       registers.data()));
+          }));
+    }
+    {
+      // Alternating curves, one gather per fan instead of a row copy
+      InputConfiguration mixed = config;
+      std::vector<CurvePoint> steep = {{30, 0}, {50, 100}};
+      for (uint32_t fan = 0; fan < fan_count; fan++)
+        mixed.fan_curves_.push_back(fan % 2 ? steep
+                                            : FanCurveEngine::DefaultCurve());
+      FanCurveEngine engine(mixed);
+      results->push_back(
+          Measure("curve", "engine_mixed", 0, fan_count, [&](uint64_t i) {
+            KeepAlive(engine.Calculate(temperatures[i & 1023],
+                                       registers.data()));
+          }));
+    }
+    {
+      // What the controller runs per sensor change: ingest, max, curve and
+      // register filters
+      ControlAlgorithm algorithm(config);
+      results->push_back(
+          Measure("curve", "control_step", 1, fan_count, [&](uint64_t i) {
+            algorithm.SetSensor(0, temperatures[i & 1023]);
+            KeepAlive(algorithm.Step(i * 1000));
+          }));
+    }
+  }
+}
+
+// Compares MaxReduce against MaxReduceScalar with a NaN sensor next to a
+// hot one for every pair of positions within the first vector blocks, so a
+// kernel that lets a NaN hide later values is not benchmarked
+bool CheckMaxReduce() {
+  const float nan = std::numeric_limits<float>::quiet_NaN();
+  for (uint32_t count : {15u, 16u, 33u, 64u, 100u}) {
+    for (uint32_t nan_id = 0; nan_id < count; nan_id++) {
+      for (uint32_t hot_id = 0; hot_id < count; hot_id++) {
+        if (hot_id == nan_id) continue;
+        std::vector<float> values(count, 10.0f);
+        values[nan_id] = nan;
+        values[hot_id] = 99.0f;
+        const float expected =
+            ::fan_controller::MaxReduceScalar(values.data(), count);
+        const float actual = ::fan_controller::MaxReduce(values.data(), count);
+        if (!(expected == actual ||
+              (std::isnan(expected) && std::isnan(actual)))) {
+          LOG_ERROR(
+              "MaxReduce returned %f instead of %f for %u sensors, NaN at %u "
+              "and 99 at %u\n",
+              actual, expected, count, nan_id, hot_id);
+          return false;
+        }
+      }
+    }
+  }
+  return true;
+}
+
+bool BenchMax(const std::vector<uint32_t>& sensor_counts,
+              std::vector<MicroResult>* results) {
+  if (!CheckMaxReduce()) return false;
+  const std::vector<float> temperatures = Temperatures();
+  for (uint32_t sensor_count : sensor_counts) {
+    std::vector<float> values(sensor_count);
+    for (uint32_t id = 0; id < sensor_count; id++)
+      values[id] = temperatures[id & 1023];
+    // Every op changes one sensor and asks for the new maximum, like the
+    // controller does per sensor update
+    results->push_back(
+        Measure("max", "rescan_scalar", sensor_count, 0, [&](uint64_t i) {
+          values[i % sensor_count] = temperatures[i & 1023];
+          KeepAlive(
+              ::fan_controller::MaxReduceScalar(values.data(), sensor_count));
+        }));
+    results->push_back(
+        Measure("max", "rescan_simd", sensor_count, 0, [&](uint64_t i) {
+          values[i % sensor_count] = temperatures[i & 1023];
+          KeepAlive(::fan_controller::MaxReduce(values.data(), sensor_count));
+        }));
+    MaxTree tree(sensor_count, 0);
+    tree.Assign(values.data());
+    results->push_back(
+        Measure("max", "tree_update", sensor_count, 0, [&](uint64_t i) {
+          tree.Update(i % sensor_count, temperatures[i & 1023]);
+          KeepAlive(tree.Max());
+        }));
+    // Every sensor changed, e.g. a full semaphore transport snapshot
+    results->push_back(
+        Measure("max", "tree_assign", sensor_count, 0, [&](uint64_t i) {
+          values[i % sensor_count] = temperatures[i & 1023];
+          tree.Assign(values.data());
+          KeepAlive(tree.Max());
+        }));
+  }  return true;
+}
+
+// Log sink dropping every message, so only the logger itself is measured
+void DiscardLog(const char*, int, ::fan_controller::logger::Severity,
+                const char* log) {
+  KeepAlive(log);
+}
+
+void BenchLog(std::vector<MicroResult>* results) {
+  namespace logger = ::fan_controller::logger;
+  const std::vector<float> temperatures = Temperatures();
+  auto previous_function = logger::LoggingFunction;
+  logger::LoggingFunction = DiscardLog;
+
+  // Compiled in but below the run time severity
+  logger::SetSeverity(logger::Severity::WARNING);
+  results->push_back(Measure("log", "filtered", 0, 0, [&](uint64_t i) {
+    LOG_INFO("Sensor %u changed to %f\n", static_cast<uint32_t>(i),
+             temperatures[i & 1023]);
+  }));
+
+  logger::SetSeverity(logger::Severity::INFO);
+  results->push_back(Measure("log", "sync", 0, 0, [&](uint64_t i) {
+    LOG_INFO("Sensor %u changed to %f\n", static_cast<uint32_t>(i),
+             temperatures[i & 1023]);
+  }));
+
+  // Blocking when the ring is full, dropped messages would not be formatted
+  logger::StartAsync(logger::OverflowPolicy::BLOCK);
+  results->push_back(Measure("log", "async", 0, 0, [&](uint64_t i) {
+    LOG_INFO("Sensor %u changed to %f\n", static_cast<uint32_t>(i),
+             temperatures[i & 1023]);
+  }));
+  logger::StopAsync();
+
+  logger::SetSeverity(logger::Severity::WARNING);
+  logger::LoggingFunction = previous_function;
+}
+
+// Shared between the two processes of an ipc case, the buffers follow on
+// cache lines of their own
+struct PingPong {
+  std::atomic<uint32_t> stop;
+  uint64_t sensor_offset;
+  uint64_t register_offset;
+  uint64_t size;
+
+  sensor_shared_memory_buffer* sensors() {
+    return reinterpret_cast<sensor_shared_memory_buffer*>(
+        reinterpret_cast<char*>(this) + sensor_offset);
+  }
+  register_shared_memory_buffer* registers() {
+    return reinterpret_cast<register_shared_memory_buffer*>(
+        reinterpret_cast<char*>(this) + register_offset);
+  }
+};
+
+uint64_t CacheAligned(uint64_t size) {
+  return (size + CACHE_LINE_SIZE - 1) /
+         CACHE_LINE_SIZE * CACHE_LINE_SIZE;
+}
+
+// Maps the sensor and register buffers the way SensorShared and
+// RegisterShared lay them out, but anonymously, so a running controller is
+// left alone
+PingPong* MapPingPong(uint32_t sensor_count, uint32_t fan_count) {
+  const uint64_t sensor_offset = CacheAligned(sizeof(PingPong));
+  const uint64_t register_offset =
+      sensor_offset + CacheAligned(sensor_shared_memory_buffer::Size(
+                          sensor_count));
+  const uint64_t size =
+      register_offset +
+      register_shared_memory_buffer::Size(fan_count);
+  void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (memory == MAP_FAILED) {
+    LOG_ERROR("mmap failed: %s\n", strerror(errno));
+    return nullptr;
+  }
+  PingPong* ping_pong = new (memory) PingPong();
+  ping_pong->stop = 0;
+  ping_pong->sensor_offset = sensor_offset;
+  ping_pong->register_offset = register_offset;
+  ping_pong->size = size;
+  new (ping_pong->sensors())
+      sensor_shared_memory_buffer(sensor_count);
+  new (ping_pong->registers())
+      register_shared_memory_buffer(fan_count);
+  // nempty starts at sensor_count, drain it so every round trip waits for
+  // the peer
+  for (uint32_t i = 0; i < sensor_count; i++)
+    ping_pong->sensors()->nempty.wait();
+  return ping_pong;
+}
+
+// Controller side of the ipc cases: takes the sensor values like
+// Controller::ReceiveSensors and either hands the slot back or, with
+// publish, answers through the register mailbox
+void RunPeer(PingPong* ping_pong, uint32_t sensor_count, uint32_t fan_count,
+             bool publish) {
+  PinToCpu(options.peer_cpu);
+  auto* sensors = ping_pong->sensors();
+  auto* registers = ping_pong->registers();
+  std::vector<float> values(sensor_count);
+  std::vector<u_int32_t> pwm(fan_count);
+  while (true) {
+    sensors->nstored.wait();
+    if (ping_pong->stop.load()) return;
+    sensors->mutex.wait();
+    std::copy(sensors->values(), sensors->values() + sensor_count,
+              values.begin());
+    sensors->mutex.post();
+    sensors->nempty.post();
+    if (publish) {
+      std::fill(pwm.begin(), pwm.end(), static_cast<u_int32_t>(values[0]));
+      registers->Publish(pwm.data());
+    }
+  }
+}
+
+// One ipc case in a forked peer, see RunPeer
+bool BenchPingPong(const std::string& name, uint32_t sensor_count,
+                   uint32_t fan_count, bool publish,
+                   std::vector<MicroResult>* results) {
+  PingPong* ping_pong = MapPingPong(sensor_count, fan_count);
+  if (ping_pong == nullptr) return false;
+  const uint64_t size = ping_pong->size;
+  const pid_t pid = fork();
+  if (pid == 0) {
+    RunPeer(ping_pong, sensor_count, fan_count, publish);
+    _exit(0);
+  }
+  auto* sensors = ping_pong->sensors();
+  auto* registers = ping_pong->registers();
+  std::vector<u_int32_t> pwm(fan_count);
+  uint32_t generation = 0;
+  bool ok = true;
+  results->push_back(Measure(
+      "ipc", name, sensor_count, publish ? fan_count : 0, [&](uint64_t i) {
+        // GUI side, like GUIWrapper::SendSensorValues
+        sensors->mutex.wait();
+        sensors->values()[i % sensor_count] = static_cast<float>(i & 1023);
+        sensors->mutex.post();
+        sensors->nstored.post();
+        if (publish) {
+          if (!registers->WaitForGeneration(generation, 1000000000ull)) {
+            ok = false;
+            return;
+          }
+          generation = registers->Read(pwm.data());
+        }
+        sensors->nempty.wait();
+      }));
+  ping_pong->stop = 1;
+  sensors->nstored.post();
+  waitpid(pid, nullptr, 0);
+  munmap(ping_pong, size);
+  if (!ok) LOG_ERROR("ipc %s: the peer stopped answering\n", name.c_str());
+  return ok;
+}
+
+bool BenchIpc(const std::vector<uint32_t>& sensor_counts,
+              const std::vector<uint32_t>& fan_counts,
+              std::vector<MicroResult>* results) {
+  bool ok = true;
+  // Semaphore handshake alone, the peer copies every sensor per round trip
+  for (uint32_t sensor_count : sensor_counts)
+    ok &= BenchPingPong("semaphore", sensor_count, 0, false, results);
+  // Sensor handshake there, register mailbox back
+  for (uint32_t fan_count : fan_counts)
+    ok &= BenchPingPong("semaphore_mailbox", 1, fan_count, true, results);
+  return ok;
+}
+
+void PrintResult(const MicroResult& result) {
+  std::printf(
+      "%-5s %-17s sensors=%-5u fans=%-5u n=%-10lu median=%10.1fns "
+      "best=%10.1fns %14.0f ops/s %8.3f allocs/op\n",
+      result.group_.c_str(), result.case_.c_str(), result.sensor_count_,
+      result.fan_count_, result.iterations_, result.median_ns_,
+      result.best_ns_, result.ops_per_second_, result.allocations_per_op_);
+  std::fflush(stdout);
+}
+
+bool WriteJson(const std::string& path,
+               const std::vector<MicroResult>& results) {
+  FILE* out = std::fopen(path.c_str(), "w");
+  if (out == nullptr) {
+    LOG_ERROR("Cannot write %s\n", path.c_str());
+    return false;
+  }
+  std::fprintf(out, "{\n  \"benchmark\": \"bench_micro\",\n  \"results\": [\n");
+  for (size_t r = 0; r < results.size(); r++) {
+    const MicroResult& result = results[r];
+    std::fprintf(out,
+                 "    {\"group\": \"%s\", \"case\": \"%s\", \"sensors\": %u, "
+                 "\"fans\": %u, \"iterations\": %lu, \"median_ns\": %.2f, "
+                 "\"best_ns\": %.2f, \"ops_per_s\": %.1f, "
+                 "\"allocations_per_op\": %.4f}%s\n",
+                 result.group_.c_str(), result.case_.c_str(),
+                 result.sensor_count_, result.fan_count_, result.iterations_,
+                 result.median_ns_, result.best_ns_, result.ops_per_second_,
+                 result.allocations_per_op_,
+                 r + 1 == results.size() ? "" : ",");
+  }
+  std::fprintf(out, "  ]\n}\n");
+  std::fclose(out);
+  return true;
+}
+
+// Parses a comma separated list of counts, each in [1, max]
+bool ParseCounts(const std::string& list, uint32_t max,
+                 std::vector<uint32_t>* counts) {
+  std::istringstream in(list);
+  std::string item;
+  counts->clear();
+  while (std::getline(in, item, ',')) {
+    uint32_t count = atoi(item.c_str());
+    if (count == 0 || count > max) return false;
+    counts->push_back(count);
+  }
+  return !counts->empty();
+}
+
+// Parses a comma separated list of groups, curve, max, log or ipc
+bool ParseGroups(const std::string& list, std::vector<std::string>* groups) {
+  std::istringstream in(list);
+  std::string item;
+  groups->clear();
+  while (std::getline(in, item, ',')) {
+    if (item != "curve" && item != "max" && item != "log" && item != "ipc")
+      return false;
+    groups->push_back(item);
+  }
+  return !groups->empty();
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  static const option long_options[] = {
+      {"groups", required_argument, nullptr, 'g'},
+      {"sensors", required_argument, nullptr, 's'},
+      {"fans", required_argument, nullptr, 'f'},
+      {"warmup-ms", required_argument, nullptr, 'w'},
+      {"min-time-ms", required_argument, nullptr, 't'},
+      {"repetitions", required_argument, nullptr, 'r'},
+      {"cpu", required_argument, nullptr, 'c'},
+      {"peer-cpu", required_argument, nullptr, 'p'},
+      {"output", required_argument, nullptr, 'o'},
+      {nullptr, 0, nullptr, 0}};
+
+  std::vector<std::string> groups = {"curve", "max", "log", "ipc"};
+  std::vector<uint32_t> sensor_counts = {16, 1024, 16384};
+  std::vector<uint32_t> fan_counts = {1, 16, 256};
+  std::string output;
+  int option;
+  while ((option = getopt_long(argc, argv, "", long_options, nullptr)) != -1) {
+    bool valid = true;
+    switch (option) {
+      case 'g': valid = ParseGroups(optarg, &groups); break;
+      case 's':
+        valid = ParseCounts(optarg, MAX_SENSOR_COUNT,
+                            &sensor_counts);
+        break;
+      case 'f':
+        valid = ParseCounts(optarg, MAX_FAN_COUNT,
+                            &fan_counts);
+        break;
+      case 'w': options.warmup_ns = atoll(optarg) * 1000000ull; break;
+      case 't': options.min_time_ns = atoll(optarg) * 1000000ull; break;
+      case 'r': options.repetitions = atoi(optarg); break;
+      case 'c': options.cpu = atoi(optarg); break;
+      case 'p': options.peer_cpu = atoi(optarg); break;
+      case 'o': output = optarg; break;
+      default: valid = false; break;
+    }
+    if (!valid || options.min_time_ns == 0 || options.repetitions == 0) {
+      LOG_ERROR(
+          "Usage: bench_micro [--groups curve,max,log,ipc] "
+          "[--sensors 16,1024,16384] [--fans 1,16,256] [--warmup-ms N] "
+          "[--min-time-ms N] [--repetitions N] [--cpu N] [--peer-cpu N] "
+          "[--output FILE.json]\n");
+      return -1;
+    }
+  }
+  // Keep the benchmark output readable
+  ::fan_controller::logger::SetSeverity(
+      ::fan_controller::logger::Severity::WARNING);
+
+  // The ipc peer runs on the next CPU, or next to the benchmark on a single
+  // CPU machine
+  if (options.peer_cpu < 0) {
+    const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    options.peer_cpu = options.cpu + 1 < cpus ? options.cpu + 1 : options.cpu;
+  }
+  PinToCpu(options.cpu);
+
+  std::vector<MicroResult> results;
+  bool ok = true;
+  for (const std::string& group : groups) {
+    const size_t first = results.size();
+    if (group == "curve")
+      BenchCurve(fan_counts, &results);
+    else if (group == "max")
+      ok &= BenchMax(sensor_counts, &results);
+    else if (group == "log")
+      BenchLog(&results);
+    else
+      ok &= BenchIpc(sensor_counts, fan_counts, &results);
+    for (size_t r = first; r < results.size(); r++) PrintResult(results[r]);
+  }
+  if (!output.empty()) ok &= WriteJson(output, results);
+  return ok ? 0 : -1;
+}
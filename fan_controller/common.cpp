@@ -1,5 +1,177 @@
 #include "common.h"
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <cerrno>
+#include <algorithm>
 #include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include "futex.h"
 
 InputConfiguration::InputConfiguration(uint32_t fan_count, uint32_t sensor_count)
-    : fan_count_(fan_count), sensor_count_(sensor_count) {}
\ No newline at end of file
+    : fan_count_(fan_count), sensor_count_(sensor_count) {}
+
+uint64_t MonotonicNowNs() {
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return static_cast<uint64_t>(now.tv_sec) * 1000000000ull + now.tv_nsec;
+}
+
+bool ParseMaxPwmList(const std::string& list, std::vector<u_int32_t>* values) {
+  std::istringstream in(list);
+  std::string item;
+  while (std::getline(in, item, ',')) {
+    if (item.empty() ||
+        item.find_first_not_of("0123456789") != std::string::npos)
+      return false;
+    // Digits only, so stoull can only fail by overflowing
+    unsigned long long value;
+    try {
+      value = std::stoull(item);
+    } catch (const std::out_of_range&) {
+      return false;
+    }
+    if (value > UINT32_MAX) return false;
+    values->push_back(static_cast<u_int32_t>(value));
+  }
+  return !values->empty();
+}
+
+void shared_segment_header::MarkReady() {
+  owner_pid.store(getpid(), std::memory_order_relaxed);
+  Beat(MonotonicNowNs());
+  magic.store(SEGMENT_MAGIC, std::memory_order_release);
+}
+
+bool shared_segment_header::OwnerAlive() const {
+  const int32_t pid = owner_pid.load(std::memory_order_relaxed);
+  if (pid <= 0 || (kill(pid, 0) != 0 && errno != EPERM)) return false;
+  // A reused pid does not beat
+  const uint64_t beat = heartbeat_ns.load(std::memory_order_relaxed);
+  const uint64_t now = MonotonicNowNs();
+  return beat >= now || now - beat < SEGMENT_OWNER_TIMEOUT_NS;
+}
+
+namespace {
+
+// Offset of the array following a buffer of type T, see SharedBufferSize
+template <typename T>
+uint32_t DataOffset() {
+  return SharedBufferSize<T, char>(0);
+}
+
+}  // namespace
+
+sensor_shared_memory_buffer::sensor_shared_memory_buffer(uint32_t sensor_count)
+    : header(Size(sensor_count), sensor_count,
+             DataOffset<sensor_shared_memory_buffer>()),
+      mutex(1),
+      nempty(sensor_count),
+      nstored(0) {
+  std::fill(values(), values() + sensor_count, TEMP_HUNDRED_PERCENT_CUTOFF);
+}
+
+register_shared_memory_buffer::register_shared_memory_buffer(
+    uint32_t fan_count)
+    : header(Size(fan_count), fan_count,
+             DataOffset<register_shared_memory_buffer>()),
+      sequence(0),
+      waiters(0) {
+  std::fill(registers(), registers() + fan_count, 0);
+}
+
+void register_shared_memory_buffer::Publish(const u_int32_t* values) {
+  sequence.store(sequence.load(std::memory_order_relaxed) + 1,
+                 std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  std::copy(values, values + header.count, registers());
+  // seq_cst store pairs with the waiters increment in WaitForGeneration
+  sequence.store(sequence.load(std::memory_order_relaxed) + 1);
+  if (waiters.load() != 0) ::fan_controller::FutexWake(&sequence);
+}
+
+void register_shared_memory_buffer::RecoverWriter() {
+  if (sequence.load() & 1) sequence.fetch_add(1);
+}
+
+uint32_t register_shared_memory_buffer::Read(u_int32_t* out) const {
+  uint32_t before, after;
+  do {
+    before = sequence.load(std::memory_order_acquire);
+    if (before & 1) continue;
+    const u_int32_t* shared_registers = registers();
+    for (uint32_t i = 0; i < header.count; i++) out[i] = shared_registers[i];
+    std::atomic_thread_fence(std::memory_order_acquire);
+    after = sequence.load(std::memory_order_relaxed);
+    if (before == after) break;
+  } while (true);
+  return before / 2;
+}
+
+bool register_shared_memory_buffer::WaitForGeneration(uint32_t last_generation,
+                                                      uint64_t timeout_ns) {
+  const uint64_t deadline = MonotonicNowNs() + timeout_ns;
+  while (true) {
+    const uint32_t current = sequence.load(std::memory_order_acquire);
+    if (current / 2 != last_generation) return true;
+    const uint64_t now = MonotonicNowNs();
+    if (now >= deadline) return false;
+    timespec timeout;
+    timeout.tv_sec = (deadline - now) / 1000000000ull;
+    timeout.tv_nsec = (deadline - now) % 1000000000ull;
+    waiters.fetch_add(1);
+    if (sequence.load() == current)
+      ::fan_controller::FutexWait(&sequence, current, &timeout);
+    waiters.fetch_sub(1);
+  }
+}
+
+sensor_seqlock_buffer::sensor_seqlock_buffer(uint32_t sensor_count)
+    : header(Size(sensor_count), sensor_count,
+             DataOffset<sensor_seqlock_buffer>()),
+      sequence(0),
+      waiters(0) {
+  std::fill(values(), values() + sensor_count, TEMP_HUNDRED_PERCENT_CUTOFF);
+}
+
+void sensor_seqlock_buffer::BeginWrite() {
+  sequence.store(sequence.load(std::memory_order_relaxed) + 1,
+                 std::memory_order_relaxed);
+  // Make sure the odd sequence is visible before any of the values
+  std::atomic_thread_fence(std::memory_order_release);
+}
+
+void sensor_seqlock_buffer::EndWrite() {
+  // seq_cst store pairs with the waiters increment in WaitForUpdate, so either
+  // the reader sees the new sequence or we see the reader
+  sequence.store(sequence.load(std::memory_order_relaxed) + 1);
+  if (waiters.load() != 0) ::fan_controller::FutexWake(&sequence);
+}
+
+void sensor_seqlock_buffer::RecoverWriter() {
+  if (sequence.load() & 1) sequence.fetch_add(1);
+}
+
+uint32_t sensor_seqlock_buffer::Read(float* out, uint32_t count) const {
+  uint32_t before, after;
+  do {
+    before = sequence.load(std::memory_order_acquire);
+    if (before & 1) continue;
+    const float* shared_values = values();
+    for (uint32_t i = 0; i < count; i++) out[i] = shared_values[i];
+    std::atomic_thread_fence(std::memory_order_acquire);
+    after = sequence.load(std::memory_order_relaxed);
+    if (before == after) break;
+  } while (true);
+  return before;
+}
+
+void sensor_seqlock_buffer::WaitForUpdate(uint32_t last_sequence) {
+  while (sequence.load(std::memory_order_acquire) == last_sequence) {
+    waiters.fetch_add(1);
+    if (sequence.load() == last_sequence)
+      ::fan_controller::FutexWait(&sequence, last_sequence);
+    waiters.fetch_sub(1);
+  }
+}
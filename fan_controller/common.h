@@ -1,14 +1,17 @@
 #pragma once
 
 #include <boost/interprocess/sync/interprocess_semaphore.hpp>
+#include <atomic>
+#include <cmath>
 #include <cstdint>
 #include <mutex>
 #include <string>
 #include <vector>
 
-// Change below values for testing
-const uint32_t MAX_FAN_COUNT = 5;
-const uint32_t MAX_SENSOR_COUNT = 5;
+// Upper bounds for the counts given at start up. The shared memory is sized
+// for the configured counts, so these only limit what is accepted.
+const uint32_t MAX_FAN_COUNT = 1024;
+const uint32_t MAX_SENSOR_COUNT = 16384;
 
 // Below this cut off temp in degree celcius fans run at 20% duty cycle
 const int TEMP_TWENTY_PERCENT_CUTOFF = 25;
@@ -23,17 +26,132 @@ const int DEFAULT_SENSOR_DEGREE = TEMP_HUNDRED_PERCENT_CUTOFF;
 // Name for sensor shared memory
 const std::string sensor_memory_name = "SensorShared";
 
+// Name for lock free (seqlock) sensor shared memory
+const std::string sensor_seqlock_memory_name = "SensorSeqlockShared";
+
 // Name for register shared memory
 const std::string register_memory_name = "RegisterShared";
 
+// Size of a cache line, used to keep independently written data apart
+const size_t CACHE_LINE_SIZE = 64;
+
+// How sensor values travel from the GUI to the controller
+enum class SensorTransport {
+  // Blocking handshake through the semaphores of sensor_shared_memory_buffer
+  SEMAPHORE,
+  // Non blocking sequence lock, see sensor_seqlock_buffer
+  SEQLOCK,
+  // Timestamped sample stream, see sensor_sample_ring in sample_ring.h
+  RING,
+  // Lock free slot per producing subsystem, see sensor_slot_buffer in
+  // sensor_slots.h
+  SLOTS
+};
+
+// One point of a piecewise linear fan curve
+struct CurvePoint {
+  // Temperature in degree celcius
+  float temperature_;
+  // Duty cycle in percent
+  float duty_cycle_;
+  CurvePoint(float temperature, float duty_cycle)
+      : temperature_(temperature), duty_cycle_(duty_cycle) {}
+};
+
+// Named group of sensors whose maximum drives a group of fans, see
+// InputConfiguration::zones_
+struct ZoneConfig {
+  std::string name_;
+  // Sensor ids and fan indices, in any order
+  std::vector<uint32_t> sensors_;
+  std::vector<uint32_t> fans_;
+  // Curve for all fans of the zone, empty keeps their fan_curves_ entries
+  std::vector<CurvePoint> curve_;
+};
+
 // Configuration that main will pass to controller and GUI at start up
 struct InputConfiguration {
   uint32_t fan_count_;
   uint32_t sensor_count_;
   std::vector<u_int32_t> max_pwm_values;
+  SensorTransport transport_ = SensorTransport::SEMAPHORE;
+  // SLOTS transport, number of subsystems the sensors are split between
+  uint32_t subsystem_count_ = 1;
+  // Sharded mode, 0 disables. The subsystems of the SLOTS transport are split
+  // between this many ingest processes, each publishing the maximum of its
+  // sensors to the controller, which then controls on one value per shard,
+  // see shard_ingest.h. Zones list shard indices instead of sensor ids.
+  uint32_t shard_count_ = 0;
+  // CPU each shard process is pinned to, -1 or missing leaves it unpinned
+  std::vector<int32_t> shard_cpus_;
+  // Fan curve per fan, points sorted by temperature. Below the first point
+  // and above the last one the duty cycle stays constant. Empty means every
+  // fan uses the default 20% at 25° to 100% at 75° curve, a single curve
+  // applies to all fans.
+  std::vector<std::vector<CurvePoint>> fan_curves_;
+  // Register filters between the fan curve and the published registers, all
+  // disabled by 0, see ControlAlgorithm:
+  // Falling temperatures are only followed once they dropped this many
+  // degrees below the temperature the fans were last set for, rising ones
+  // right away.
+  float hysteresis_c_ = 0;
+  // Register changes below this duty cycle delta in percent are held back,
+  // unless a fan goes to full speed.
+  float min_duty_delta_ = 0;
+  // Largest register change per fan in PWM counts per second, in both
+  // directions. Larger changes ramp in steps until the target is reached.
+  uint32_t slew_rate_ = 0;
+  // Cooling zones, each fan belongs to at most one. A zone's fans follow the
+  // maximum over its sensors only, sensors may be shared between zones. Fans
+  // outside every zone follow the maximum over all sensors, so no zones at
+  // all is a single zone driving every fan.
+  std::vector<ZoneConfig> zones_;
+  // Extra threads evaluating zones in parallel once there are many sensors,
+  // 0 evaluates them on the publishing thread only
+  uint32_t zone_workers_ = 0;
+  // Control loop rate in Hz. 0 recomputes on every sensor change, otherwise
+  // the controller recomputes and publishes at this fixed rate.
+  uint32_t control_rate_hz_ = 0;
+  // Event driven mode, sensor updates arriving within this many us of the
+  // first pending one are folded into one recompute and publish. The window
+  // closes early once no update arrived for a quarter of it. 0 disables.
+  uint32_t coalesce_window_us_ = 0;
+  // Run sensor ingest, recompute and register publish on one epoll driven
+  // thread instead of a receiver thread handing over to a processing thread.
+  // Producers wake it through the doorbell, see doorbell.h.
+  bool event_loop_ = false;
+  // CPU the event loop thread is pinned to, -1 leaves it unpinned
+  int32_t event_loop_cpu_ = -1;
+  // Device or file holding the fan registers, empty for none. Fan i's 32 bit
+  // register lives at register_offset_ + i * register_stride_ bytes.
+  std::string register_device_;
+  uint64_t register_offset_ = 0;
+  uint32_t register_stride_ = 4;
+  // Create register_device_ if missing and grow it to hold every register,
+  // for regular file stand-ins only. Otherwise it has to exist and be large
+  // enough.
+  bool register_stand_in_ = false;
+  // Telemetry recording, empty for none. Files are named
+  // <telemetry_path_>.<n>.tlm and rotate once they reach
+  // telemetry_file_bytes_, see telemetry_format.h.
+  std::string telemetry_path_;
+  uint64_t telemetry_file_bytes_ = 64ull << 20;
   InputConfiguration(uint32_t fan_count, uint32_t sensor_count);
 };
 
+// Current CLOCK_MONOTONIC time in nanoseconds
+uint64_t MonotonicNowNs();
+
+// True if a sensor reading did not change. Two NaN readings compare equal, so
+// a sensor stuck at NaN is not reported as changed on every snapshot.
+inline bool SameSensorValue(float a, float b) {
+  return a == b || (std::isnan(a) && std::isnan(b));
+}
+
+// Parses a comma separated list of PWM counts, e.g. "1000,2000,500". Returns
+// false unless every entry is a number that fits into 32 bits.
+bool ParseMaxPwmList(const std::string& list, std::vector<u_int32_t>* values);
+
 struct Sensor {
   int32_t id_ = -1;
   float value_ = TEMP_HUNDRED_PERCENT_CUTOFF;
@@ -41,29 +159,186 @@ struct Sensor {
       : id_(id), value_(value) {}
 };
 
-// Shared memory buffer for sending sensor data from GUI to controller
+// Marks a shared segment whose owner finished constructing it, "FANSEG01"
+const uint64_t SEGMENT_MAGIC = 0x31304745534e4146ull;
+// Bumped whenever the layout of a shared buffer changes
+const uint32_t SEGMENT_VERSION = 3;
+// Owners refresh their heartbeat at least this often while they run
+const uint64_t SEGMENT_HEARTBEAT_INTERVAL_NS = 1000000000ull;
+// A segment without a heartbeat for this long has no live owner
+const uint64_t SEGMENT_OWNER_TIMEOUT_NS = 3 * SEGMENT_HEARTBEAT_INTERVAL_NS;
+
+// Every runtime sized shared memory buffer starts with this header. It records
+// the layout chosen by the creator, so a process attaching later can check it
+// against its own configuration. The array lives data_offset bytes after the
+// start of the buffer, which works no matter where the segment is mapped.
+//
+// Readiness handshake: the owner constructs the buffer in a zero filled
+// segment and then calls MarkReady, peers look at nothing but Ready before.
+// While it runs the owner refreshes heartbeat_ns, so peers and a restarted
+// owner can tell a live segment from one left behind, see shared_segment.h.
+struct shared_segment_header {
+  std::atomic<uint64_t> magic;
+  uint32_t version;
+  // Number of elements in the array
+  uint32_t count;
+  // Bytes to map, header and array included
+  uint64_t size;
+  uint32_t data_offset;
+  // Process writing the buffer and the CLOCK_MONOTONIC time in ns it was last
+  // seen alive
+  std::atomic<int32_t> owner_pid;
+  std::atomic<uint64_t> heartbeat_ns;
+  shared_segment_header(uint64_t size, uint32_t count, uint32_t data_offset)
+      : magic(0),
+        version(SEGMENT_VERSION),
+        count(count),
+        size(size),
+        data_offset(data_offset),
+        owner_pid(0),
+        heartbeat_ns(0) {}
+
+  // Makes the calling process the owner and publishes the buffer to peers
+  void MarkReady();
+
+  // Whether the owner finished constructing a buffer of this version
+  bool Ready() const {
+    return magic.load(std::memory_order_acquire) == SEGMENT_MAGIC &&
+           version == SEGMENT_VERSION;
+  }
+
+  void Beat(uint64_t now_ns) {
+    heartbeat_ns.store(now_ns, std::memory_order_relaxed);
+  }
+
+  // Whether the owner process exists and beat within SEGMENT_OWNER_TIMEOUT_NS
+  bool OwnerAlive() const;
+};
+
+// Bytes needed for a buffer of type T followed by count elements of type E,
+// the array starts on a cache line of its own
+template <typename T, typename E>
+uint64_t SharedBufferSize(uint32_t count) {
+  return ((sizeof(T) + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE) *
+             CACHE_LINE_SIZE +
+         static_cast<uint64_t>(count) * sizeof(E);
+}
+
+// Shared memory buffer for sending sensor data from GUI to controller.
+// Sensor values are stored as one block of floats, indexed by sensor id.
 struct sensor_shared_memory_buffer {
-  uint32_t sensor_count = MAX_SENSOR_COUNT;
-  sensor_shared_memory_buffer()
-      : mutex(1), nempty(MAX_SENSOR_COUNT), nstored(0) {}
+  shared_segment_header header;
+  sensor_shared_memory_buffer(uint32_t sensor_count);
 
   // Semaphores to protect and synchronize access
   boost::interprocess::interprocess_semaphore mutex, nempty, nstored;
 
-  // Items to fill
-  Sensor sensors[MAX_SENSOR_COUNT];
+  // Items to fill, header.count temperatures in degree celcius
+  float* values() {
+    return reinterpret_cast<float*>(reinterpret_cast<char*>(this) +
+                                    header.data_offset);
+  }
+
+  // Bytes to allocate for sensor_count sensors
+  static uint64_t Size(uint32_t sensor_count) {
+    return SharedBufferSize<sensor_shared_memory_buffer, float>(sensor_count);
+  }
 };
 
-// Shared memory buffer for sending fan register values from controller to
-// GUI
+// Lock free alternative to sensor_shared_memory_buffer. The writer never
+// blocks, the reader always copies the latest consistent snapshot.
+// sequence is odd while a write is in progress, a reader retries if it saw an
+// odd value or if sequence moved while it was copying.
+// Assumes a single writer.
+struct sensor_seqlock_buffer {
+  shared_segment_header header;
+  sensor_seqlock_buffer(uint32_t sensor_count);
+
+  // Generation counter, also used as futex word for sleeping readers
+  alignas(CACHE_LINE_SIZE) std::atomic<uint32_t> sequence;
+
+  // Number of readers sleeping on sequence, lets the writer skip the wake up
+  // syscall when nobody waits
+  std::atomic<uint32_t> waiters;
+
+  // Items to fill, header.count temperatures in degree celcius
+  float* values() {
+    return reinterpret_cast<float*>(reinterpret_cast<char*>(this) +
+                                    header.data_offset);
+  }
+  const float* values() const {
+    return reinterpret_cast<const float*>(
+        reinterpret_cast<const char*>(this) + header.data_offset);
+  }
+
+  // Bytes to allocate for sensor_count sensors
+  static uint64_t Size(uint32_t sensor_count) {
+    return SharedBufferSize<sensor_seqlock_buffer, float>(sensor_count);
+  }
+
+  // Writer side, values may only be changed between these two calls
+  void BeginWrite();
+  void EndWrite();
+
+  // Copies a consistent snapshot of the first count values into out and
+  // returns the sequence number it belongs to
+  uint32_t Read(float* out, uint32_t count) const;
+
+  // Blocks until sequence differs from last_sequence
+  void WaitForUpdate(uint32_t last_sequence);
+
+  // Completes a write the previous owner died in, see shared_segment.h
+  void RecoverWriter();
+};
+
+// Latest value mailbox for the fan register values. The controller publishes
+// under a sequence lock and never waits for anyone, any number of readers
+// (GUI, loggers, monitoring) attach and copy consistent snapshots. Every
+// publish is one generation, sequence / 2, so readers can tell how many
+// they missed.
 struct register_shared_memory_buffer {
-  uint32_t fan_count = MAX_FAN_COUNT;
-  register_shared_memory_buffer()
-      : mutex(1), nempty(MAX_FAN_COUNT), nstored(0) {}
+  shared_segment_header header;
+  register_shared_memory_buffer(uint32_t fan_count);
 
-  // Semaphores to protect and synchronize access
-  boost::interprocess::interprocess_semaphore mutex, nempty, nstored;
+  // Sequence lock counter, odd while the controller writes. Also the futex
+  // word sleeping readers wait on.
+  alignas(CACHE_LINE_SIZE) std::atomic<uint32_t> sequence;
+
+  // Number of readers sleeping on sequence, lets the controller skip the wake
+  // up syscall when nobody waits
+  std::atomic<uint32_t> waiters;
+
+  // Items to fill, header.count PWM counts
+  u_int32_t* registers() {
+    return reinterpret_cast<u_int32_t*>(reinterpret_cast<char*>(this) +
+                                        header.data_offset);
+  }
+  const u_int32_t* registers() const {
+    return reinterpret_cast<const u_int32_t*>(
+        reinterpret_cast<const char*>(this) + header.data_offset);
+  }
+
+  // Writer side, copies header.count values and wakes up all readers. Never
+  // blocks.
+  void Publish(const u_int32_t* values);
+
+  // Copies a consistent snapshot of the registers into out and returns the
+  // generation it belongs to
+  uint32_t Read(u_int32_t* out) const;
+
+  // Generation of the latest complete publish
+  uint32_t Generation() const { return sequence.load() / 2; }
+
+  // Blocks until a generation newer than last_generation was published or
+  // timeout_ns passed. Returns false on timeout.
+  bool WaitForGeneration(uint32_t last_generation, uint64_t timeout_ns);
+
+  // Completes a publish the previous owner died in, see shared_segment.h
+  void RecoverWriter();
 
-  // Items to fill
-  u_int32_t registers[MAX_FAN_COUNT];
+  // Bytes to allocate for fan_count fans
+  static uint64_t Size(uint32_t fan_count) {
+    return SharedBufferSize<register_shared_memory_buffer, u_int32_t>(
+        fan_count);
+  }
 };
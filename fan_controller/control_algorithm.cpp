@@ -0,0 +1,398 @@
+#include "control_algorithm.h"
+#include <algorithm>
+#include <sstream>
+#include "../logger/logger.h"
+
+namespace fan_controller {
+namespace controller {
+
+namespace {
+
+// Parses "0-31,40" into the ids it lists
+bool ParseIdList(const std::string& text, std::vector<uint32_t>* ids) {
+  std::istringstream in(text);
+  std::string item;
+  ids->clear();
+  while (std::getline(in, item, ',')) {
+    std::istringstream range(item);
+    uint32_t first, last;
+    if (!(range >> first)) return false;
+    last = first;
+    char dash;
+    if (range >> dash && (dash != '-' || !(range >> last) || last < first))
+      return false;
+    if (!range.eof() || last - first >= MAX_SENSOR_COUNT) return false;
+    for (uint32_t id = first; id <= last; id++) ids->push_back(id);
+  }
+  return !ids->empty();
+}
+
+void SortUnique(std::vector<uint32_t>* ids) {
+  std::sort(ids->begin(), ids->end());
+  ids->erase(std::unique(ids->begin(), ids->end()), ids->end());
+}
+
+}  // namespace
+
+bool ControlAlgorithm::ParseZone(const std::string& text, ZoneConfig* zone) {
+  std::istringstream in(text);
+  std::string sensors, fans, curve;
+  if (!std::getline(in, zone->name_, '/') || zone->name_.empty() ||
+      !std::getline(in, sensors, '/') || !std::getline(in, fans, '/'))
+    return false;
+  if (!ParseIdList(sensors, &zone->sensors_) ||
+      !ParseIdList(fans, &zone->fans_))
+    return false;
+  zone->curve_.clear();
+  if (std::getline(in, curve) &&
+      !FanCurveEngine::ParseCurve(curve, &zone->curve_))
+    return false;
+  return true;
+}
+
+bool ControlAlgorithm::ValidateZones(const InputConfiguration& config) {
+  bool valid = true;
+  // Zone owning each fan, -1 for none
+  std::vector<int32_t> fan_owner(config.fan_count_, -1);
+  for (size_t i = 0; i < config.zones_.size(); i++) {
+    const ZoneConfig& zone = config.zones_[i];
+    const char* name = zone.name_.c_str();
+    if (zone.name_.empty()) {
+      LOG_ERROR("Zone %lu has no name\n", i);
+      valid = false;
+    }
+    for (size_t j = 0; j < i; j++) {
+      if (config.zones_[j].name_ == zone.name_) {
+        LOG_ERROR("Zone %s is defined twice\n", name);
+        valid = false;
+      }
+    }
+    if (zone.sensors_.empty() || zone.fans_.empty()) {
+      LOG_ERROR("Zone %s needs at least one sensor and one fan\n", name);
+      valid = false;
+    }
+    for (uint32_t id : zone.sensors_) {
+      if (id >= config.sensor_count_) {
+        LOG_ERROR("Zone %s uses sensor %d, sensor count is %d\n", name, id,
+                  config.sensor_count_);
+        valid = false;
+        break;
+      }
+    }
+    for (uint32_t fan : zone.fans_) {
+      if (fan >= config.fan_count_) {
+        LOG_ERROR("Zone %s uses fan %d, fan count is %d\n", name, fan,
+                  config.fan_count_);
+        valid = false;
+      } else if (fan_owner[fan] >= 0 && fan_owner[fan] != int32_t(i)) {
+        LOG_ERROR("Fan %d is in zone %s and zone %s\n", fan,
+                  config.zones_[fan_owner[fan]].name_.c_str(), name);
+        valid = false;
+      } else {
+        fan_owner[fan] = i;
+      }
+    }
+    if (!zone.curve_.empty() && !FanCurveEngine::IsValidCurve(zone.curve_)) {
+      LOG_ERROR("Zone %s has an invalid fan curve\n", name);
+      valid = false;
+    }
+  }
+  return valid;
+}
+
+InputConfiguration ControlAlgorithm::ZoneCurves(
+    const InputConfiguration& config, bool use_zones) {
+  InputConfiguration curves = config;
+  bool zone_curves = false;
+  for (const ZoneConfig& zone : config.zones_)
+    zone_curves |= use_zones && !zone.curve_.empty();
+  if (!zone_curves) return curves;
+  curves.fan_curves_.resize(config.fan_count_);
+  for (uint32_t fan = 0; fan < config.fan_count_; fan++) {
+    curves.fan_curves_[fan] =
+        config.fan_curves_.empty()
+            ? FanCurveEngine::DefaultCurve()
+            : config.fan_curves_[config.fan_curves_.size() == 1 ? 0 : fan];
+  }
+  for (const ZoneConfig& zone : config.zones_) {
+    if (zone.curve_.empty()) continue;
+    for (uint32_t fan : zone.fans_) curves.fan_curves_[fan] = zone.curve_;
+  }
+  return curves;
+}
+
+ControlAlgorithm::ControlAlgorithm(const InputConfiguration& config)
+    : ControlAlgorithm(config, ValidateZones(config)) {}
+
+ControlAlgorithm::ControlAlgorithm(const InputConfiguration& config,
+                                   bool use_zones)
+    : sensor_count_(config.sensor_count_),
+      sensor_values_(config.sensor_count_, TEMP_HUNDRED_PERCENT_CUTOFF),
+      max_tree_(config.sensor_count_, TEMP_HUNDRED_PERCENT_CUTOFF),
+      fan_curve_(ZoneCurves(config, use_zones)),
+      hysteresis_c_(config.hysteresis_c_),
+      min_duty_delta_(config.min_duty_delta_),
+      slew_rate_(config.slew_rate_),
+      max_pwm_values_(config.max_pwm_values),
+      fan_zone_(config.fan_count_, UINT32_MAX),
+      zone_slot_offsets_(config.sensor_count_ + 1, 0),
+      target_(config.fan_count_, 0),
+      registers_(config.fan_count_, 0) {
+  if (!use_zones)
+    LOG_ERROR("Invalid zone configuration, all fans follow all sensors\n");
+  for (size_t i = 0; use_zones && i < config.zones_.size(); i++) {
+    Zone zone(0);
+    zone.name_ = config.zones_[i].name_;
+    zone.sensors_ = config.zones_[i].sensors_;
+    zone.fans_ = config.zones_[i].fans_;
+    SortUnique(&zone.sensors_);
+    SortUnique(&zone.fans_);
+    zone.max_tree_ = MaxTree(zone.sensors_.size(), zone.input_);
+    for (uint32_t fan : zone.fans_) fan_zone_[fan] = zones_.size();
+    zones_.push_back(zone);
+  }
+  // The fans left over follow every sensor
+  Zone rest(0);
+  rest.name_ = zones_.empty() ? "all" : "default";
+  rest.all_sensors_ = true;
+  for (uint32_t fan = 0; fan < config.fan_count_; fan++) {
+    if (fan_zone_[fan] != UINT32_MAX) continue;
+    fan_zone_[fan] = zones_.size();
+    rest.fans_.push_back(fan);
+  }
+  rest.all_fans_ = rest.fans_.size() == config.fan_count_;
+  if (!rest.fans_.empty()) zones_.push_back(rest);
+
+  // Counting sort of the (zone, slot) pairs by sensor id
+  for (const Zone& zone : zones_)
+    for (uint32_t id : zone.sensors_) zone_slot_offsets_[id + 1]++;
+  for (uint32_t id = 0; id < sensor_count_; id++)
+    zone_slot_offsets_[id + 1] += zone_slot_offsets_[id];
+  zone_slots_.resize(zone_slot_offsets_[sensor_count_]);
+  std::vector<uint32_t> fill(zone_slot_offsets_.begin(),
+                             zone_slot_offsets_.end() - 1);
+  for (uint32_t index = 0; index < zones_.size(); index++) {
+    const Zone& zone = zones_[index];
+    for (uint32_t slot = 0; slot < zone.sensors_.size(); slot++)
+      zone_slots_[fill[zone.sensors_[slot]]++] = {index, slot};
+  }
+
+  for (Zone& zone : zones_) {
+    zone.duty_cycle_ = ComputeTargets(zone);
+    LOG_INFO("Zone %s: %lu sensors, %lu fans\n", zone.name_.c_str(),
+             zone.all_sensors_ ? sensor_count_ : zone.sensors_.size(),
+             zone.fans_.size());
+  }
+  dirty_zones_.reserve(zones_.size());
+  if (config.zone_workers_ > 0 && zones_.size() > 1 &&
+      sensor_count_ >= ZONE_PARALLEL_MIN_SENSORS) {
+    pool_.reset(new WorkerPool(config.zone_workers_, [this](uint32_t index) {
+      ControlZone(zones_[dirty_zones_[index]], control_now_ns_,
+                  control_force_);
+    }));
+  }
+}
+
+ControlAlgorithm::~ControlAlgorithm() {}
+
+void ControlAlgorithm::UpdateZoneTrees(uint32_t id, float value) {
+  for (uint32_t i = zone_slot_offsets_[id]; i < zone_slot_offsets_[id + 1];
+       i++)
+    zones_[zone_slots_[i].zone].max_tree_.Update(zone_slots_[i].slot, value);
+}
+
+void ControlAlgorithm::AssignZoneTrees() {
+  for (Zone& zone : zones_) {
+    if (zone.all_sensors_) continue;
+    zone_values_.resize(zone.sensors_.size());
+    for (size_t slot = 0; slot < zone.sensors_.size(); slot++)
+      zone_values_[slot] = sensor_values_[zone.sensors_[slot]];
+    zone.max_tree_.Assign(zone_values_.data());
+  }
+}
+
+bool ControlAlgorithm::SetSensor(uint32_t id, float value) {
+  if (SameSensorValue(value, sensor_values_[id])) return false;
+  sensor_values_[id] = value;
+  max_tree_.Update(id, value);
+  UpdateZoneTrees(id, value);
+  return true;
+}
+
+uint32_t ControlAlgorithm::SetSensorRange(uint32_t first, uint32_t count,
+                                          const float* values) {
+  uint32_t changed = 0;
+  for (uint32_t i = 0; i < count; i++) {
+    const uint32_t id = first + i;
+    if (!SameSensorValue(values[i], sensor_values_[id])) {
+      sensor_values_[id] = values[i];
+      LOG_DEBUG("Received sensor values %d:%f\n", id, sensor_values_[id]);
+      changed++;
+      // Rebuilding is cheaper once a large part of the sensors changed
+      if (changed * 4 < sensor_count_) {
+        max_tree_.Update(id, values[i]);
+        UpdateZoneTrees(id, values[i]);
+      }
+    }
+  }
+  if (changed * 4 >= sensor_count_ && changed != 0) {
+    max_tree_.Assign(sensor_values_.data());
+    AssignZoneTrees();
+  }
+  return changed;
+}
+
+void ControlAlgorithm::CaptureMaxima() {
+  for (Zone& zone : zones_)
+    zone.input_ = zone.all_sensors_ ? max_tree_.Max() : zone.max_tree_.Max();
+}
+
+float ControlAlgorithm::ComputeTargets(Zone& zone) {
+  // Pure table lookups, the curves were compiled in the constructor
+  if (zone.all_fans_) return fan_curve_.Calculate(zone.max_temp_, target_.data());
+  return fan_curve_.CalculateFans(zone.max_temp_, zone.fans_.data(),
+                                  zone.fans_.size(), target_.data());
+}
+
+bool ControlAlgorithm::AtTarget(const Zone& zone) const {
+  for (uint32_t fan : zone.fans_)
+    if (target_[fan] != registers_[fan]) return false;
+  return true;
+}
+
+bool ControlAlgorithm::IsSmallChange(const Zone& zone) const {
+  for (uint32_t fan : zone.fans_) {
+    if (target_[fan] == max_pwm_values_[fan] &&
+        registers_[fan] != max_pwm_values_[fan])
+      return false;
+    const uint32_t distance = target_[fan] > registers_[fan]
+                                  ? target_[fan] - registers_[fan]
+                                  : registers_[fan] - target_[fan];
+    if (distance * 100.0f >= min_duty_delta_ * max_pwm_values_[fan])
+      return false;
+  }
+  return true;
+}
+
+bool ControlAlgorithm::StepTowardsTarget(Zone& zone, uint64_t now_ns) {
+  // A new ramp gets one interval worth of change, a running one what
+  // accumulated since its last step. Below one count the time keeps
+  // accumulating, so low rates are kept as well.
+  uint64_t max_step = UINT32_MAX;
+  if (slew_rate_ > 0 && !first_publish_) {
+    if (!zone.ramping_)
+      zone.last_step_ns_ =
+          now_ns > RAMP_INTERVAL_NS ? now_ns - RAMP_INTERVAL_NS : 0;
+    max_step = slew_rate_ * (now_ns - zone.last_step_ns_) / 1000000000ull;
+  }
+  bool changed = false, limited = false;
+  for (uint32_t fan : zone.fans_) {
+    const u_int32_t target = target_[fan], current = registers_[fan];
+    if (target == current) continue;
+    u_int32_t next = target;
+    if (target > current && target - current > max_step) {
+      next = current + max_step;
+      limited = true;
+    } else if (target < current && current - target > max_step) {
+      next = current - max_step;
+      limited = true;
+    }
+    if (next != current) changed = true;
+    registers_[fan] = next;
+  }
+  if (limited && changed) zone.stats_.slew_limited++;
+  zone.ramping_ = limited;
+  if (changed) zone.last_step_ns_ = now_ns;
+  return changed;
+}
+
+void ControlAlgorithm::ControlZone(Zone& zone, uint64_t now_ns, bool force) {
+  const float max_temp = zone.input_;
+  bool retarget = max_temp != zone.max_temp_;
+  // Follow rising temperatures right away, falling ones only past the band
+  if (retarget && hysteresis_c_ > 0 && max_temp < zone.max_temp_ &&
+      max_temp > zone.max_temp_ - hysteresis_c_) {
+    if (max_temp != zone.held_input_) zone.stats_.hysteresis_holds++;
+    zone.held_input_ = max_temp;
+    retarget = false;
+  }
+  if (retarget) {
+    zone.max_temp_ = max_temp;
+    zone.held_input_ = max_temp;
+    zone.duty_cycle_ = ComputeTargets(zone);
+    LOG_DEBUG("New Duty cycle percentile:  %f, zone %s\n", zone.duty_cycle_,
+              zone.name_.c_str());
+    zone.stats_.recomputes++;
+  }
+
+  bool changed = false;
+  if (first_publish_) {
+    for (uint32_t fan : zone.fans_) registers_[fan] = target_[fan];
+    changed = true;
+  } else if (retarget || zone.ramping_ || force) {
+    // A running ramp always finishes, a new target has to be worth it
+    if (!zone.ramping_ && min_duty_delta_ > 0 && IsSmallChange(zone)) {
+      if (retarget && !AtTarget(zone)) zone.stats_.small_changes_held++;
+    } else {
+      changed = StepTowardsTarget(zone, now_ns);
+    }
+    if (retarget && !changed && AtTarget(zone)) zone.stats_.unchanged++;
+  }
+  zone.changed_ = changed;
+}
+
+bool ControlAlgorithm::Control(uint64_t now_ns, bool force) {
+  // Zones whose maximum did not move and that do not ramp keep their
+  // registers, only the others are evaluated
+  dirty_zones_.clear();
+  for (uint32_t index = 0; index < zones_.size(); index++) {
+    Zone& zone = zones_[index];
+    zone.changed_ = false;
+    if (first_publish_ || force || zone.ramping_ ||
+        (zone.input_ != zone.max_temp_ && zone.input_ != zone.held_input_))
+      dirty_zones_.push_back(index);
+  }
+  if (pool_ && dirty_zones_.size() > 1) {
+    control_now_ns_ = now_ns;
+    control_force_ = force;
+    pool_->Run(dirty_zones_.size());
+  } else {
+    for (uint32_t index : dirty_zones_)
+      ControlZone(zones_[index], now_ns, force);
+  }
+  bool changed = false;
+  for (uint32_t index : dirty_zones_) changed |= zones_[index].changed_;
+  first_publish_ = false;
+  if (!changed && !force) return false;
+  publishes_++;
+  return true;
+}
+
+bool ControlAlgorithm::Ramping() const {
+  for (const Zone& zone : zones_)
+    if (zone.ramping_) return true;
+  return false;
+}
+
+float ControlAlgorithm::max_temp() const {
+  float max_temp = zones_[0].max_temp_;
+  for (const Zone& zone : zones_)
+    if (zone.max_temp_ > max_temp) max_temp = zone.max_temp_;
+  return max_temp;
+}
+
+ControlStats ControlAlgorithm::stats() const {
+  ControlStats total;
+  for (const Zone& zone : zones_) {
+    total.recomputes += zone.stats_.recomputes;
+    total.hysteresis_holds += zone.stats_.hysteresis_holds;
+    total.small_changes_held += zone.stats_.small_changes_held;
+    total.slew_limited += zone.stats_.slew_limited;
+    total.unchanged += zone.stats_.unchanged;
+  }
+  total.publishes = publishes_;
+  return total;
+}
+
+}  // namespace controller
+}  // namespace fan_controller
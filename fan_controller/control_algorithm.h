@@ -0,0 +1,243 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include "common.h"
+#include "fan_curve.h"
+#include "max_tree.h"
+#include "worker_pool.h"
+
+// The fan control algorithm without any IPC: keeps the latest temperature of
+// every sensor, selects the maximum and turns it into PWM counts through the
+// fan curves. Controller feeds it from shared memory, control_replay from a
+// trace file, so both compute exactly the same register stream.
+//
+// Fans can be split into zones, see InputConfiguration::zones_, each
+// following the maximum of its own sensors through its own curve. A sensor
+// change only touches the max trees of its zones and Control only recomputes
+// the zones whose maximum moved, so the registers of other zones stay as they
+// are.
+//
+// Between the curve and the published registers sit three optional filters
+// against sensor noise, see InputConfiguration: temperature hysteresis, a
+// minimum duty cycle delta and a slew rate limit. Only register sets that
+// differ from the last published one are published at all.
+namespace fan_controller {
+namespace controller {
+
+// Counters of the register filters since start up
+struct ControlStats {
+  // Controlling temperature changes, each computes new target registers
+  uint64_t recomputes = 0;
+  // Register sets handed out for publishing
+  uint64_t publishes = 0;
+  // Falling temperatures ignored inside the hysteresis band, each counted
+  // once however often it is held
+  uint64_t hysteresis_holds = 0;
+  // New targets held back by the minimum duty cycle delta
+  uint64_t small_changes_held = 0;
+  // Publishes cut short by the slew rate limit
+  uint64_t slew_limited = 0;
+  // Recomputes that ended with the registers already published
+  uint64_t unchanged = 0;
+};
+
+class ControlAlgorithm {
+ public:
+  // Pace of the steps while a slew limited ramp is under way
+  static const uint64_t RAMP_INTERVAL_NS = 10000000;
+
+  // Zones are only handed to the worker pool from this many sensors on,
+  // below that waking the workers costs more than the zones take
+  static const uint32_t ZONE_PARALLEL_MIN_SENSORS = 1024;
+
+ private:
+  // Fans following the maximum of a group of sensors. The filters keep their
+  // state per zone, so a zone ramping or holding back never delays another.
+  struct Zone {
+    std::string name_;
+    // Sorted sensor ids, unused if all_sensors_
+    std::vector<uint32_t> sensors_;
+    // Sorted fan indices
+    std::vector<uint32_t> fans_;
+    // Follows max_tree_ of the algorithm instead of a tree of its own
+    bool all_sensors_ = false;
+    // Drives every fan, the targets take the single Calculate path
+    bool all_fans_ = false;
+    // Sensor side, maximum over sensors_, slot i holds sensor sensors_[i]
+    MaxTree max_tree_;
+    // Maximum taken over by CaptureMaxima for the next Control
+    float input_ = TEMP_HUNDRED_PERCENT_CUTOFF;
+    // Temperature the targets were last computed for and the duty cycle of
+    // fans_[0] it gave
+    float max_temp_ = TEMP_HUNDRED_PERCENT_CUTOFF;
+    float duty_cycle_ = 100;
+    // Last input held back by the hysteresis, equal to max_temp_ if none.
+    // Holding it again neither counts nor makes the zone dirty.
+    float held_input_ = TEMP_HUNDRED_PERCENT_CUTOFF;
+    // A slew limited ramp is under way, last step at last_step_ns_
+    bool ramping_ = false;
+    uint64_t last_step_ns_ = 0;
+    // Registers of fans_ changed in the last Control
+    bool changed_ = false;
+    ControlStats stats_;
+    Zone(uint32_t sensor_count)
+        : max_tree_(sensor_count, TEMP_HUNDRED_PERCENT_CUTOFF) {}
+  };
+
+  const uint32_t sensor_count_;
+
+  // Latest temperature per sensor id in degree celcius. Kept as a plain float
+  // block for the bulk max tree rebuild.
+  std::vector<float> sensor_values_;
+
+  // Incremental maximum over sensor_values_, only the slots that changed are
+  // updated
+  MaxTree max_tree_;
+
+  // Precomputed temperature -> PWM tables for every fan, zone curves already
+  // applied
+  FanCurveEngine fan_curve_;
+
+  // Filter settings, see InputConfiguration
+  const float hysteresis_c_;
+  const float min_duty_delta_;
+  const uint32_t slew_rate_;
+  const std::vector<u_int32_t> max_pwm_values_;
+
+  // Configured zones in order, then the one of the fans outside all of them
+  std::vector<Zone> zones_;
+
+  // Zone of every fan
+  std::vector<uint32_t> fan_zone_;
+
+  // Where each sensor sits in the zone max trees: the entries of sensor id
+  // are zone_slots_[zone_slot_offsets_[id] .. zone_slot_offsets_[id + 1]]
+  struct ZoneSlot {
+    uint32_t zone;
+    uint32_t slot;
+  };
+  std::vector<uint32_t> zone_slot_offsets_;
+  std::vector<ZoneSlot> zone_slots_;
+
+  // Scratch for rebuilding the zone max trees
+  std::vector<float> zone_values_;
+
+  // Fan curve output for the max_temp_ of each fan's zone
+  std::vector<u_int32_t> target_;
+
+  // PWM counts per fan last handed out for publishing
+  std::vector<u_int32_t> registers_;
+
+  // Nothing handed out yet, the first register set skips the filters
+  bool first_publish_ = true;
+
+  uint64_t publishes_ = 0;
+
+  // Zones Control evaluates and the arguments it runs them with, shared with
+  // the pool's task
+  std::vector<uint32_t> dirty_zones_;
+  uint64_t control_now_ns_ = 0;
+  bool control_force_ = false;
+
+  // Evaluates the dirty zones in parallel, only created when there is more
+  // than one zone, zone_workers_ is set and there are enough sensors
+  std::unique_ptr<WorkerPool> pool_;
+
+  ControlAlgorithm(const InputConfiguration& config, bool use_zones);
+
+  // config with the curves of the zones expanded into per fan curves
+  static InputConfiguration ZoneCurves(const InputConfiguration& config,
+                                       bool use_zones);
+
+  // Updates the zone max trees holding sensor id
+  void UpdateZoneTrees(uint32_t id, float value);
+
+  // Rebuilds all zone max trees from sensor_values_
+  void AssignZoneTrees();
+
+  // Fan curve output for zone.max_temp_ into target_, returns the duty cycle
+  float ComputeTargets(Zone& zone);
+
+  // Whether every fan of zone sits at its target
+  bool AtTarget(const Zone& zone) const;
+
+  // Whether every fan's distance to its target is below min_duty_delta_ and
+  // no fan has to go to full speed
+  bool IsSmallChange(const Zone& zone) const;
+
+  // Moves the registers of zone towards target_, limited by the slew rate.
+  // Returns whether any register changed.
+  bool StepTowardsTarget(Zone& zone, uint64_t now_ns);
+
+  // Control for one zone, only touches the zone and the entries of its fans,
+  // so zones can be evaluated on different threads
+  void ControlZone(Zone& zone, uint64_t now_ns, bool force);
+
+ public:
+  ControlAlgorithm(const InputConfiguration& config);
+  ~ControlAlgorithm();
+  ControlAlgorithm(ControlAlgorithm const& copy) = delete;
+  ControlAlgorithm& operator=(ControlAlgorithm const& copy) = delete;
+
+  // Parses a zone given as NAME/SENSORS/FANS[/CURVE], where SENSORS and FANS
+  // are comma separated ids or id ranges like 0-31,40 and CURVE is in the
+  // form of FanCurveEngine::ParseCurve
+  static bool ParseZone(const std::string& text, ZoneConfig* zone);
+
+  // Checks the zones of config against its sensor and fan counts and logs
+  // every problem found. Invalid zones are ignored by the constructor.
+  static bool ValidateZones(const InputConfiguration& config);
+
+  // The sensor side, SetSensor*, SensorValue, SensorMax and CaptureMaxima,
+  // and the register side, Control and the getters below, touch disjoint
+  // state. Controller runs them on different threads and only guards the
+  // sensor side.
+
+  // Stores value for sensor id. Returns false if it held that value already.
+  bool SetSensor(uint32_t id, float value);
+
+  // SetSensor for the count sensors starting at first, values[0] belongs to
+  // sensor first. Returns the number of sensors that changed.
+  uint32_t SetSensorRange(uint32_t first, uint32_t count, const float* values);
+
+  float SensorValue(uint32_t id) const { return sensor_values_[id]; }
+
+  // Maximum over the latest temperatures of all sensors
+  float SensorMax() const { return max_tree_.Max(); }
+
+  // Hands the current maximum of every zone over to the next Control
+  void CaptureMaxima();
+
+  // Makes the captured maxima the controlling temperatures at monotonic time
+  // now_ns. Zones whose maximum moved past the hysteresis recompute their
+  // targets, zones with a ramp under way advance it, all others are left
+  // alone. Returns whether registers() changed and needs to be published,
+  // always true with force.
+  bool Control(uint64_t now_ns, bool force = false);
+
+  // Control for the current sensor maxima
+  bool Step(uint64_t now_ns) {
+    CaptureMaxima();
+    return Control(now_ns);
+  }
+
+  // Whether a ramp is under way, Control has to run again
+  // RAMP_INTERVAL_NS after the last call even without sensor changes
+  bool Ramping() const;
+
+  // Hottest temperature any zone was last set for
+  float max_temp() const;
+  // Duty cycle of the first fan
+  float duty_cycle() const { return zones_[fan_zone_[0]].duty_cycle_; }
+  const std::vector<u_int32_t>& registers() const { return registers_; }
+  // Filter counters summed over all zones
+  ControlStats stats() const;
+  uint32_t sensor_count() const { return sensor_count_; }
+  uint32_t zone_count() const { return zones_.size(); }
+};
+
+}  // namespace controller
+}  // namespace fan_controller
@@ -0,0 +1,332 @@
+// Replays a sensor trace through the controller's ControlAlgorithm without
+// shared memory, threads or sleeps and prints the resulting register stream,
+// one line per register set the controller would have published:
+//   sample,max_temp,duty_cycle,register_0 register_1 ...
+// sample counts the trace rows applied so far. With --golden the stream is
+// compared against a file written by an earlier run instead, so curve or
+// algorithm changes can be checked against recorded traces.
+// The trace holds sensor_id,value rows, like sensor_loadgen --trace, taken
+// to arrive at --rate, or the timestamped sensor rows printed by
+// telemetry_reader. Time only matters for the slew rate limit.
+
+#include <getopt.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "../logger/logger.h"
+#include "control_algorithm.h"
+
+using ::fan_controller::controller::ControlAlgorithm;
+using ::fan_controller::controller::ControlStats;
+using ::fan_controller::controller::FanCurveEngine;
+
+namespace {
+
+struct Trace {
+  std::vector<uint32_t> ids;
+  std::vector<float> values;
+  // Arrival time of every row in ns
+  std::vector<uint64_t> times_ns;
+};
+
+void PrintUsage() {
+  LOG_ERROR(
+      "Usage: control_replay [options] TRACE\n"
+      "  --sensors N         sensor count (default highest id in the trace + "
+      "1)\n"
+      "  --fans N            fan count (default 1)\n"
+      "  --max-pwm A,B,..    PWM count at 100%% duty cycle per fan (default "
+      "1000)\n"
+      "  --curve T:D,T:D,..  fan curve, once for all fans or once per fan\n"
+      "  --batch N           trace rows applied per recompute (default 1)\n"
+      "  --rate HZ           arrival rate of untimed trace rows (default "
+      "1000)\n"
+      "  --hysteresis C      follow falling temperatures only past C degrees\n"
+      "  --min-duty-delta P  hold back register changes below P percent\n"
+      "  --slew-rate N       limit register changes to N PWM counts/s\n"
+      "  --zone N/S/F[/C]    zone N of sensors S driving fans F, e.g.\n"
+      "                      cpu/0-31/0,1/30:20,70:100, repeat per zone\n"
+      "  --zone-workers N    threads evaluating zones in parallel (default 0)\n"
+      "  --output FILE       write the register stream to FILE (default "
+      "stdout)\n"
+      "  --golden FILE       compare the register stream with FILE\n"
+      "  --repeat N          extra replays timed without output (default 0)\n");
+}
+
+bool LoadTrace(const std::string& path, double rate_hz, Trace* trace) {
+  std::ifstream in(path);
+  if (!in) {
+    LOG_ERROR("Cannot open trace file %s\n", path.c_str());
+    return false;
+  }
+  std::string line;
+  while (std::getline(in, line)) {
+    if (line.empty() || line[0] == '#') continue;
+    // telemetry_reader output, sensor,seconds,id,value. Other record types
+    // are skipped.
+    if (line.compare(0, 8, "control,") == 0) continue;
+    uint64_t time_ns = trace->ids.size() * 1e9 / rate_hz;
+    if (line.compare(0, 7, "sensor,") == 0) {
+      time_ns = atof(line.c_str() + 7) * 1e9;
+      line = line.substr(line.find(',', 7) + 1);
+    }
+    std::istringstream row(line);
+    uint32_t id;
+    char comma;
+    float value;
+    if (!(row >> id >> comma >> value) || comma != ',') {
+      LOG_ERROR("Invalid trace row: %s\n", line.c_str());
+      return false;
+    }
+    trace->ids.push_back(id);
+    trace->values.push_back(value);
+    trace->times_ns.push_back(time_ns);
+  }
+  if (trace->ids.empty()) {
+    LOG_ERROR("Trace file %s has no samples\n", path.c_str());
+    return false;
+  }
+  return true;
+}
+
+// Appends the current register set of algorithm to out
+void FormatRegisters(uint64_t sample, const ControlAlgorithm& algorithm,
+                     std::string* out) {
+  char text[64];
+  snprintf(text, sizeof(text), "%lu,%.9g,%.9g,", sample, algorithm.max_temp(),
+           algorithm.duty_cycle());
+  out->append(text);
+  const std::vector<u_int32_t>& registers = algorithm.registers();
+  for (size_t fan = 0; fan < registers.size(); fan++) {
+    snprintf(text, sizeof(text), fan == 0 ? "%u" : " %u", registers[fan]);
+    out->append(text);
+  }
+  out->push_back('\n');
+}
+
+// Runs trace through a fresh algorithm, like the event driven controller
+// would: batch rows at a time, then one recompute, and the steps of slew
+// limited ramps in between. Returns the filter counters and appends the
+// published register sets to out unless it is nullptr.
+ControlStats Replay(const InputConfiguration& config, const Trace& trace,
+                    uint32_t batch, std::string* out) {
+  ControlAlgorithm algorithm(config);
+  uint64_t last_control_ns = 0;
+  const size_t rows = trace.ids.size();
+  for (size_t row = 0; row < rows;) {
+    // Ramp steps due before the next batch arrives
+    while (algorithm.Ramping() &&
+           last_control_ns + ControlAlgorithm::RAMP_INTERVAL_NS <=
+               trace.times_ns[row]) {
+      last_control_ns += ControlAlgorithm::RAMP_INTERVAL_NS;
+      if (algorithm.Step(last_control_ns) && out != nullptr)
+        FormatRegisters(row, algorithm, out);
+    }
+    const size_t end = std::min(rows, row + batch);
+    for (; row < end; row++)
+      algorithm.SetSensor(trace.ids[row], trace.values[row]);
+    last_control_ns = trace.times_ns[row - 1];
+    if (algorithm.Step(last_control_ns) && out != nullptr)
+      FormatRegisters(row, algorithm, out);
+  }
+  // Let the last ramp finish
+  while (algorithm.Ramping()) {
+    last_control_ns += ControlAlgorithm::RAMP_INTERVAL_NS;
+    if (algorithm.Step(last_control_ns) && out != nullptr)
+      FormatRegisters(rows, algorithm, out);
+  }
+  return algorithm.stats();
+}
+
+// Reports the first line differing between expected and actual
+bool CompareWithGolden(const std::string& path, const std::string& actual) {
+  std::ifstream in(path);
+  if (!in) {
+    LOG_ERROR("Cannot open golden file %s\n", path.c_str());
+    return false;
+  }
+  std::istringstream produced(actual);
+  std::string expected_line, actual_line;
+  for (uint64_t line = 1;; line++) {
+    const bool has_expected =
+        static_cast<bool>(std::getline(in, expected_line));
+    const bool has_actual =
+        static_cast<bool>(std::getline(produced, actual_line));
+    if (!has_expected && !has_actual) return true;
+    if (has_expected != has_actual || expected_line != actual_line) {
+      LOG_ERROR("Register stream differs from %s at line %lu\n"
+                "  expected: %s\n  actual:   %s\n",
+                path.c_str(), line,
+                has_expected ? expected_line.c_str() : "<end>",
+                has_actual ? actual_line.c_str() : "<end>");
+      return false;
+    }
+  }
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  static const option long_options[] = {
+      {"sensors", required_argument, nullptr, 's'},
+      {"fans", required_argument, nullptr, 'f'},
+      {"max-pwm", required_argument, nullptr, 'p'},
+      {"curve", required_argument, nullptr, 'c'},
+      {"batch", required_argument, nullptr, 'b'},
+      {"rate", required_argument, nullptr, 'R'},
+      {"hysteresis", required_argument, nullptr, 'H'},
+      {"min-duty-delta", required_argument, nullptr, 'D'},
+      {"slew-rate", required_argument, nullptr, 'W'},
+      {"zone", required_argument, nullptr, 'z'},
+      {"zone-workers", required_argument, nullptr, 'k'},
+      {"output", required_argument, nullptr, 'o'},
+      {"golden", required_argument, nullptr, 'g'},
+      {"repeat", required_argument, nullptr, 'r'},
+      {"help", no_argument, nullptr, 'h'},
+      {nullptr, 0, nullptr, 0}};
+
+  uint32_t sensor_count = 0, fan_count = 1, batch = 1, repeat = 0;
+  double rate_hz = 1000;
+  float hysteresis_c = 0, min_duty_delta = 0;
+  uint32_t slew_rate = 0, zone_workers = 0;
+  std::vector<ZoneConfig> zones;
+  std::vector<u_int32_t> max_pwm_values;
+  std::vector<std::vector<CurvePoint>> fan_curves;
+  std::string output_path, golden_path;
+  int option;
+  while ((option = getopt_long(argc, argv, "", long_options, nullptr)) != -1) {
+    switch (option) {
+      case 's': sensor_count = atoi(optarg); break;
+      case 'f': fan_count = atoi(optarg); break;
+      case 'p':
+        if (!ParseMaxPwmList(optarg, &max_pwm_values)) {
+          LOG_ERROR("Invalid max PWM list %s\n", optarg);
+          return -1;
+        }
+        break;
+      case 'c': {
+        std::vector<CurvePoint> curve;
+        if (!FanCurveEngine::ParseCurve(optarg, &curve)) {
+          LOG_ERROR("Invalid fan curve %s\n", optarg);
+          return -1;
+        }
+        fan_curves.push_back(curve);
+        break;
+      }
+      case 'b': batch = atoi(optarg); break;
+      case 'R': rate_hz = atof(optarg); break;
+      case 'H': hysteresis_c = atof(optarg); break;
+      case 'D': min_duty_delta = atof(optarg); break;
+      case 'W': slew_rate = atoi(optarg); break;
+      case 'z': {
+        ZoneConfig zone;
+        if (!ControlAlgorithm::ParseZone(optarg, &zone)) {
+          LOG_ERROR("Invalid zone %s\n", optarg);
+          return -1;
+        }
+        zones.push_back(zone);
+        break;
+      }
+      case 'k': zone_workers = atoi(optarg); break;
+      case 'o': output_path = optarg; break;
+      case 'g': golden_path = optarg; break;
+      case 'r': repeat = atoi(optarg); break;
+      default:
+        PrintUsage();
+        return -1;
+    }
+  }
+  if (optind + 1 != argc) {
+    PrintUsage();
+    return -1;
+  }
+  // Per update logging of the algorithm would dominate the replay
+  ::fan_controller::logger::SetSeverity(
+      ::fan_controller::logger::Severity::WARNING);
+
+  if (rate_hz <= 0 || hysteresis_c < 0 || min_duty_delta < 0) {
+    LOG_ERROR("Invalid rate, hysteresis or minimum duty cycle delta\n");
+    return -1;
+  }
+  Trace trace;
+  if (!LoadTrace(argv[optind], rate_hz, &trace)) return -1;
+  uint32_t highest_id = 0;
+  for (uint32_t id : trace.ids) highest_id = std::max(highest_id, id);
+  if (sensor_count == 0) sensor_count = highest_id + 1;
+  if (highest_id >= sensor_count || sensor_count > MAX_SENSOR_COUNT) {
+    LOG_ERROR("Trace uses sensor %d, sensor count must be above it and at "
+              "most %d\n",
+              highest_id, MAX_SENSOR_COUNT);
+    return -1;
+  }
+  if (fan_count == 0 || fan_count > MAX_FAN_COUNT) {
+    LOG_ERROR("Please enter valid fan count between 1 and %d\n",
+              MAX_FAN_COUNT);
+    return -1;
+  }
+  if (max_pwm_values.empty()) max_pwm_values.assign(fan_count, 1000);
+  if (max_pwm_values.size() != fan_count) {
+    LOG_ERROR("Need exactly one max PWM value per fan\n");
+    return -1;
+  }
+  if (fan_curves.size() > 1 && fan_curves.size() != fan_count) {
+    LOG_ERROR("Need either one fan curve or one per fan\n");
+    return -1;
+  }
+  if (batch == 0) {
+    LOG_ERROR("Batch size must be at least 1\n");
+    return -1;
+  }
+  InputConfiguration config(fan_count, sensor_count);
+  config.max_pwm_values = max_pwm_values;
+  config.fan_curves_ = fan_curves;
+  config.hysteresis_c_ = hysteresis_c;
+  config.min_duty_delta_ = min_duty_delta;
+  config.slew_rate_ = slew_rate;
+  config.zones_ = zones;
+  config.zone_workers_ = zone_workers;
+  if (!ControlAlgorithm::ValidateZones(config)) return -1;
+
+  std::string stream;
+  uint64_t start = MonotonicNowNs();
+  const ControlStats stats = Replay(config, trace, batch, &stream);
+  uint64_t elapsed = MonotonicNowNs() - start;
+  std::fprintf(stderr,
+               "Replayed %lu samples, %lu register sets in %.3f ms "
+               "(%.1f ns/sample with output)\n",
+               trace.ids.size(), stats.publishes, elapsed / 1e6,
+               static_cast<double>(elapsed) / trace.ids.size());
+  std::fprintf(stderr,
+               "%lu recomputes, held back: hysteresis %lu, min duty delta "
+               "%lu, unchanged %lu, slew limited publishes %lu\n",
+               stats.recomputes, stats.hysteresis_holds,
+               stats.small_changes_held, stats.unchanged,
+               stats.slew_limited);
+  if (repeat > 0) {
+    start = MonotonicNowNs();
+    for (uint32_t i = 0; i < repeat; i++) Replay(config, trace, batch, nullptr);
+    elapsed = MonotonicNowNs() - start;
+    std::fprintf(stderr, "Compute only: %.1f ns/sample over %d replays\n",
+                 static_cast<double>(elapsed) / trace.ids.size() / repeat,
+                 repeat);
+  }
+
+  if (!golden_path.empty()) {
+    if (!CompareWithGolden(golden_path, stream)) return -1;
+    std::fprintf(stderr, "Register stream matches %s\n", golden_path.c_str());
+  }
+  if (!output_path.empty()) {
+    std::ofstream out(output_path);
+    if (!(out << stream)) {
+      LOG_ERROR("Cannot write %s\n", output_path.c_str());
+      return -1;
+    }
+  } else if (golden_path.empty()) {
+    std::fwrite(stream.data(), 1, stream.size(), stdout);
+  }
+  return 0;
+}
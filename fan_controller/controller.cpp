@@ -1,163 +1,648 @@
 #include "controller.h"
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include <algorithm>
 #include <boost/interprocess/mapped_region.hpp>
 #include <boost/interprocess/shared_memory_object.hpp>
 #include <boost/thread.hpp>
+#include <cerrno>
+#include <cstring>
 #include "../logger/logger.h"
+#include "shared_segment.h"
 using namespace boost::interprocess;
 
 namespace fan_controller {
 namespace controller {
 
-void Controller::CalculateRegisters() {
-  // First calculate duty cycle factor and duy cycle offset.
-  // All cases above or equl to TEMP_HUNDRED_PERCENT_CUTOFF
-  // corresponds to 100 % PWM value
-  float duty_cycle_base = 100.0f;
-  float duty_cycle_offset = 0;
-  if (TEMP_TWENTY_PERCENT_CUTOFF >= max_temp_)
-    duty_cycle_base = 20.0f;  //  <=  25° corresponds to 20 % duty cycle
-  else if (TEMP_HUNDRED_PERCENT_CUTOFF > max_temp_ &&
-           TEMP_TWENTY_PERCENT_CUTOFF < max_temp_) {
-    // 0% duty cycle change should be linearly interpolated between 25° and 75°
-    // This means in that range every degree increase will correspond to
-    // 80%/(75°-25°) = (80/50) = 1.6 duty cycle/degree change.
-    duty_cycle_base = 20.0f;  // 100 % duty cycle
-    duty_cycle_offset = ((max_temp_ - 25) * 1.6);
-  }
-
-  float duty_cyle_percentile = duty_cycle_base + duty_cycle_offset;
-  LOG_INFO("New Duty cycle percentile:  %f\n", duty_cyle_percentile);
-  {
-    for (uint32_t i = 0; i < config_.fan_count_; i++) {
-      registers_[i] =
-          std::ceil((duty_cyle_percentile / 100) * config_.max_pwm_values[i]);
+bool Controller::ProcessSensors() {
+  // Take over the register memory of a previous controller, so readers that
+  // still map it keep receiving
+  mapped_region region;
+  bool reused;
+  if (!OwnSegment(register_memory_name,
+                  register_shared_memory_buffer::Size(config_.fan_count_),
+                  config_.fan_count_, &region, &reused))
+    return false;
+  register_shared_memory_buffer* data;
+  if (reused) {
+    data = static_cast<register_shared_memory_buffer*>(region.get_address());
+    data->RecoverWriter();
+  } else {
+    data = new (region.get_address())
+        register_shared_memory_buffer(config_.fan_count_);
+  }
+  data->header.MarkReady();
+  if (config_.event_loop_) return ProcessSensorsEventLoop(data);
+  if (config_.control_rate_hz_ > 0) return ProcessSensorsFixedRate(data);
+  while (true) {
+    float new_max_temp = 0;
+    uint64_t updates = 0, first_pending_ns = 0;
+    {
+      boost::mutex::scoped_lock scoped_lock(received_sensor_data_mutex);
+      while (!sensors_changed_ && !receiver_failed_) {
+        // A slew limited ramp takes its next step even without new data
+        if (!algorithm_.Ramping()) {
+          // Wake up once per heartbeat interval to show the loop is alive
+          if (!new_sensor_data_cond_.timed_wait(
+                  scoped_lock, boost::posix_time::microseconds(
+                                   SEGMENT_HEARTBEAT_INTERVAL_NS / 1000))) {
+            const uint64_t now = MonotonicNowNs();
+            data->header.Beat(now);
+            metrics_->header.Beat(now);
+          }
+        } else if (!new_sensor_data_cond_.timed_wait(
+                       scoped_lock,
+                       boost::posix_time::microseconds(
+                           ControlAlgorithm::RAMP_INTERVAL_NS / 1000))) {
+          break;
+        }
+      }
+      if (receiver_failed_) return false;
+      if (sensors_changed_ && config_.coalesce_window_us_ > 0)
+        CoalesceUpdates(scoped_lock);
+      // New data has come lets process it
+      sensors_changed_ = false;
+      updates = pending_updates_;
+      // Stale once the updates it belonged to were processed
+      if (updates != 0) first_pending_ns = first_pending_ns_;
+      pending_updates_ = 0;
+      // The maxima are kept up to date by the receiving side
+      new_max_temp = algorithm_.SensorMax();
+      algorithm_.CaptureMaxima();
     }
+    if (updates != 0) CountRecompute(updates, first_pending_ns);
+    LOG_INFO_THROTTLED(1000, "Old Max: %f, New max: : %f\n",
+                       algorithm_.max_temp(), new_max_temp);
+    // Now that we ave a new max temperature calculate the PWM
+    // values that are needed for each register and send them to shared
+    // memory for GUI
+    RunControl(data, false, first_pending_ns);
   }
 }
 
-void Controller::ProcessSensors() {
-  struct shm_remove {
-    shm_remove() { shared_memory_object::remove(register_memory_name.c_str()); }
-    ~shm_remove() {
-      shared_memory_object::remove(register_memory_name.c_str());
+void Controller::RunControl(register_shared_memory_buffer* data, bool force,
+                            uint64_t first_pending_ns) {
+  const uint64_t now = MonotonicNowNs();
+  data->header.Beat(now);
+  metrics_->header.Beat(now);
+  if (algorithm_.Control(now, force)) {
+    PublishRegisters(data);
+    if (first_pending_ns != 0)
+      metrics_->update_to_publish_ns.Record(
+          metrics_->last_publish_ns.load(std::memory_order_relaxed) -
+          first_pending_ns);
+  } else {
+    // Happens on every sensor change which does not move the registers
+    LOG_INFO_THROTTLED(1000, "No register Update needed\n");
+  }
+  const ControlStats stats = algorithm_.stats();
+  controller_metrics_page::Add(metrics_->control_runs, 1);
+  metrics_->recomputes.store(stats.recomputes, std::memory_order_relaxed);
+  metrics_->publishes.store(stats.publishes, std::memory_order_relaxed);
+  metrics_->hysteresis_holds.store(stats.hysteresis_holds,
+                                   std::memory_order_relaxed);
+  metrics_->small_changes_held.store(stats.small_changes_held,
+                                     std::memory_order_relaxed);
+  metrics_->slew_limited.store(stats.slew_limited, std::memory_order_relaxed);
+  metrics_->unchanged.store(stats.unchanged, std::memory_order_relaxed);
+  if (now - last_control_report_ns_ >= 1000000000ull) ReportControlStats(now);
+}
+
+void Controller::ReportControlStats(uint64_t now) {
+  // Takes the logger's ring list lock, so only once per report
+  metrics_->log_messages_dropped.store(logger::DroppedMessages(),
+                                       std::memory_order_relaxed);
+  const ControlStats stats = algorithm_.stats();
+  const ControlStats& last = reported_control_stats_;
+  if (stats.recomputes != last.recomputes ||
+      stats.hysteresis_holds != last.hysteresis_holds) {
+    LOG_INFO(
+        "Register publishes %lu of %lu recomputes, held back: hysteresis "
+        "%lu, min duty delta %lu, unchanged %lu, slew limited publishes %lu\n",
+        stats.publishes - last.publishes, stats.recomputes - last.recomputes,
+        stats.hysteresis_holds - last.hysteresis_holds,
+        stats.small_changes_held - last.small_changes_held,
+        stats.unchanged - last.unchanged,
+        stats.slew_limited - last.slew_limited);
+  }
+  reported_control_stats_ = stats;
+  last_control_report_ns_ = now;
+}
+
+void Controller::PublishRegisters(register_shared_memory_buffer* data) {
+  const uint64_t start = MonotonicNowNs();
+  const u_int32_t* registers = algorithm_.registers().data();
+  // Fans first, the mailbox only feeds displays
+  if (register_backend_) {
+    if (!register_backend_->Write(registers))
+      LOG_ERROR_THROTTLED(1000, "Writing the fan registers failed\n");
+    // Sets first, so readers never see more stores per fan than sets
+    controller_metrics_page::Add(metrics_->register_sets_written, 1);
+    metrics_->register_writes_skipped.store(
+        register_backend_->SkippedWrites(), std::memory_order_relaxed);
+    std::atomic<uint64_t>* writes = metrics_->register_writes();
+    for (uint32_t fan = 0; fan < config_.fan_count_; fan++)
+      writes[fan].store(register_backend_->WriteCount(fan),
+                        std::memory_order_relaxed);
+    const uint64_t now = MonotonicNowNs();
+    if (now - last_backend_report_ns_ >= 1000000000ull) {
+      LOG_INFO("Register writes %lu, redundant writes skipped %lu\n",
+               register_backend_->TotalWrites(),
+               register_backend_->SkippedWrites());
+      last_backend_report_ns_ = now;
     }
-  } remover;
-  // Create a shared memory object.
-  shared_memory_object shm(open_or_create  // only create
-                           ,
-                           register_memory_name.c_str()  // name
-                           ,
-                           read_write  // read-write mode
-  );
-  shm.truncate(sizeof(register_shared_memory_buffer));
-  // Map the whole shared memory in this process
-  mapped_region region(shm, read_write);
-  // Get the address of the mapped region
-  void* addr = region.get_address();
-  // Construct the shared structure in memory
-  register_shared_memory_buffer* data =
-      new (addr) register_shared_memory_buffer;
+  }
+  data->Publish(registers);
+  const uint64_t end = MonotonicNowNs();
+  metrics_->publish_duration_ns.Record(end - start);
+  metrics_->last_publish_ns.store(end, std::memory_order_relaxed);
+  metrics_->max_temp.store(algorithm_.max_temp(), std::memory_order_relaxed);
+  metrics_->duty_cycle.store(algorithm_.duty_cycle(),
+                             std::memory_order_relaxed);
+  if (telemetry_)
+    telemetry_->RecordControl(MonotonicNowNs(), algorithm_.max_temp(),
+                              algorithm_.duty_cycle(), registers);
+  // One line per second, per fan lines would flood the log at high rates
+  LOG_INFO_THROTTLED(1000, "Sending registers of %d fans, fan 0: %u\n",
+                     config_.fan_count_, registers[0]);
+}
+
+int Controller::OpenControlTimer() {
+  control_period_ns_ = 1000000000ull / config_.control_rate_hz_;
+  int timer = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+  if (timer < 0) {
+    LOG_ERROR("timerfd_create failed: %s\n", strerror(errno));
+    return -1;
+  }
+  // Absolute deadlines, so a late tick does not shift all following ones
+  control_deadline_ns_ = MonotonicNowNs() + control_period_ns_;
+  itimerspec spec = {};
+  spec.it_interval.tv_sec = control_period_ns_ / 1000000000ull;
+  spec.it_interval.tv_nsec = control_period_ns_ % 1000000000ull;
+  spec.it_value.tv_sec = control_deadline_ns_ / 1000000000ull;
+  spec.it_value.tv_nsec = control_deadline_ns_ % 1000000000ull;
+  if (timerfd_settime(timer, TFD_TIMER_ABSTIME, &spec, nullptr) < 0) {
+    LOG_ERROR("timerfd_settime failed: %s\n", strerror(errno));
+    close(timer);
+    return -1;
+  }
+  LOG_INFO("Control loop running at %d Hz\n", config_.control_rate_hz_);
+  return timer;
+}
+
+bool Controller::ReadControlTick(int timer, uint64_t* wake) {
+  uint64_t expirations = 0;
+  if (read(timer, &expirations, sizeof(expirations)) != sizeof(expirations))
+    return false;
+  *wake = MonotonicNowNs();
+  // The latest of the expired ticks is the one being served
+  control_deadline_ns_ += (expirations - 1) * control_period_ns_;
+  missed_ticks_ += expirations - 1;
+  loop_jitter_ns_.Record(
+      *wake > control_deadline_ns_ ? *wake - control_deadline_ns_ : 0);
+  control_deadline_ns_ += control_period_ns_;
+  ticks_since_report_ += expirations;
+  return true;
+}
+
+void Controller::FinishControlTick(uint64_t wake) {
+  loop_execution_ns_.Record(MonotonicNowNs() - wake);
+  if (ticks_since_report_ >= config_.control_rate_hz_) {
+    ReportLoopStats();
+    ticks_since_report_ = 0;
+  }
+}
+
+bool Controller::ProcessSensorsFixedRate(register_shared_memory_buffer* data) {
+  int timer = OpenControlTimer();
+  if (timer < 0) return false;
   while (true) {
-    float new_max_temp = 0;
+    uint64_t wake;
+    if (!ReadControlTick(timer, &wake)) {
+      if (errno == EINTR) continue;
+      LOG_ERROR("timerfd read failed: %s\n", strerror(errno));
+      break;
+    }
+    uint64_t first_pending_ns = 0;
     {
       boost::mutex::scoped_lock scoped_lock(received_sensor_data_mutex);
-      // Find the new max temperature
-      new_max_temp = received_sensor_values_[0].value_;
-      while (!sensors_changed_) new_sensor_data_cond_.wait(scoped_lock);
-      new_max_temp = received_sensor_values_[0].value_;
-      // New data has come lets process it
+      if (receiver_failed_) break;
+      if (pending_updates_ != 0) first_pending_ns = first_pending_ns_;
       sensors_changed_ = false;
-      // Find the maximum temp value among all the sensors
-      for (uint32_t i = 0; i < config_.sensor_count_; i++)
-        new_max_temp =
-            std::max(new_max_temp, received_sensor_values_[i].value_);
-    }
-    if (new_max_temp != max_temp_) {
-      LOG_INFO("Old Max: %f, New max: : %f, update registers..\n", max_temp_,
-               new_max_temp);
-      max_temp_ = new_max_temp;
-
-      // Now that we ave a new max temperature calculate the PWM
-      // values that are needed for each register
-      CalculateRegisters();
-
-      // And Send them to shared memory for GUI
-      data->nempty.wait();
-
-      data->mutex.wait();
-      for (uint32_t i = 0; i < config_.fan_count_; i++) {
-        data->registers[i] = registers_[i];
-        LOG_INFO("Sending Register %d: %d", i, registers_[i]);
-      }
-      data->mutex.post();
-      data->nstored.post();
-    } else {
-      LOG_INFO("No register Update needed\n");
-      LOG_INFO("Old Max: %f, New max: : %f\n", max_temp_, new_max_temp);
+      pending_updates_ = 0;
+      algorithm_.CaptureMaxima();
     }
+    RunControl(data, true, first_pending_ns);
+    FinishControlTick(wake);
+  }
+  close(timer);
+  return false;
+}
+
+void Controller::ReportLoopStats() {
+  LOG_INFO(
+      "Control loop jitter us p50 %.1f p99 %.1f p99.9 %.1f max %.1f, "
+      "execution us p50 %.1f p99 %.1f max %.1f, missed ticks %llu\n",
+      loop_jitter_ns_.ValueAtPercentile(50) / 1e3,
+      loop_jitter_ns_.ValueAtPercentile(99) / 1e3,
+      loop_jitter_ns_.ValueAtPercentile(99.9) / 1e3,
+      loop_jitter_ns_.Max() / 1e3,
+      loop_execution_ns_.ValueAtPercentile(50) / 1e3,
+      loop_execution_ns_.ValueAtPercentile(99) / 1e3,
+      loop_execution_ns_.Max() / 1e3,
+      static_cast<unsigned long long>(missed_ticks_));
+  loop_jitter_ns_.Reset();
+  loop_execution_ns_.Reset();
+  missed_ticks_ = 0;
+}
+
+void Controller::MarkSensorsChanged() {
+  if (!sensors_changed_) first_pending_ns_ = MonotonicNowNs();
+  sensors_changed_ = true;
+  pending_updates_++;
+}
+
+void Controller::CoalesceUpdates(boost::mutex::scoped_lock& lock) {
+  const uint64_t window_ns = config_.coalesce_window_us_ * 1000ull;
+  const uint64_t quiet_ns = window_ns / 4;
+  const uint64_t deadline = first_pending_ns_ + window_ns;
+  while (true) {
+    const uint64_t now = MonotonicNowNs();
+    if (now >= deadline) break;
+    const uint64_t seen = pending_updates_;
+    const uint64_t wait_ns = std::min(deadline - now, quiet_ns);
+    new_sensor_data_cond_.timed_wait(
+        lock, boost::posix_time::microseconds(wait_ns / 1000 + 1));
+    // Burst is over, do not hold the update back any longer
+    if (pending_updates_ == seen) break;
+  }
+}
+
+void Controller::CountRecompute(uint64_t updates, uint64_t first_pending_ns) {
+  const uint64_t now = MonotonicNowNs();
+  coalesce_latency_ns_.Record(now - first_pending_ns);
+  recomputes_++;
+  coalesced_updates_ += updates;
+  if (now - last_coalesce_report_ns_ >= 1000000000ull) {
+    ReportCoalescingStats();
+    last_coalesce_report_ns_ = now;
   }
 }
 
-Controller::Controller(const InputConfiguration config) : config_(config) {
-  registers_.resize(config.fan_count_);
-  received_sensor_values_.resize(config.sensor_count_);
+void Controller::ReportCoalescingStats() {
+  if (recomputes_ == 0) return;
+  LOG_INFO(
+      "Coalesced %llu sensor updates into %llu recomputes (ratio %.2f), added "
+      "latency us p50 %.1f p99 %.1f max %.1f\n",
+      static_cast<unsigned long long>(coalesced_updates_),
+      static_cast<unsigned long long>(recomputes_),
+      static_cast<double>(coalesced_updates_) / recomputes_,
+      coalesce_latency_ns_.ValueAtPercentile(50) / 1e3,
+      coalesce_latency_ns_.ValueAtPercentile(99) / 1e3,
+      coalesce_latency_ns_.Max() / 1e3);
+  coalesce_latency_ns_.Reset();
+  recomputes_ = 0;
+  coalesced_updates_ = 0;
+}
+
+InputConfiguration ControlConfig(const InputConfiguration& config) {
+  InputConfiguration control = config;
+  if (config.shard_count_ > 0) control.sensor_count_ = config.shard_count_;
+  return control;
+}
+
+Controller::Controller(const InputConfiguration config)
+    : config_(config),
+      algorithm_(ControlConfig(config)),
+      telemetry_(CreateTelemetryRecorder(config)) {
+  received_sensor_timestamps_.resize(config.sensor_count_, 0);
+}
+
+bool Controller::OpenRegisterBackend() {
+  return CreateRegisterBackend(config_, &register_backend_);
+}
+
+bool Controller::OpenMetrics() {
+  // Counters start over with every controller, scrapers keep their mapping
+  bool reused;
+  const uint32_t sensor_count = algorithm_.sensor_count();
+  const uint64_t size =
+      controller_metrics_page::Size(sensor_count, config_.fan_count_);
+  if (!OwnSegment(metrics_memory_name, size, sensor_count, &metrics_region_,
+                  &reused))
+    return false;
+  metrics_ = new (metrics_region_.get_address())
+      controller_metrics_page(sensor_count, config_.fan_count_);
+  // Beaten together with the register segment from here on, so a second
+  // controller refuses the page while this one runs
+  metrics_->header.MarkReady();
+  return true;
 }
 
 void Controller::ReceiveSensors() {
-  // Create a shared memory object.
-  shared_memory_object shm(open_only  // only create
-                           ,
-                           sensor_memory_name.c_str()  // name
-                           ,
-                           read_write  // read-write mode
-  );
-  // Map the whole shared memory in this process
-  mapped_region region(shm  // What to map
-                       ,
-                       read_write  // Map it as read-write
-  );
-  // Get the address of the mapped region
-  void* addr = region.get_address();
-
-  // Obtain the shared structure
+  bool received;
+  if (config_.shard_count_ > 0) {
+    received = ReceiveSensorsShards();
+  } else {
+    switch (config_.transport_) {
+      case SensorTransport::SEQLOCK:
+        received = ReceiveSensorsSeqlock();
+        break;
+      case SensorTransport::RING:
+        received = ReceiveSensorsRing();
+        break;
+      case SensorTransport::SLOTS:
+        received = ReceiveSensorsSlots();
+        break;
+      case SensorTransport::SEMAPHORE:
+      default:
+        received = ReceiveSensorsSemaphore();
+        break;
+    }
+  }
+  if (received) return;
+  // Without sensor values the fans would never follow, stop the controller
+  LOG_ERROR("Cannot receive sensor values, stopping the controller\n");
+  boost::mutex::scoped_lock scoped_lock(received_sensor_data_mutex);
+  receiver_failed_ = true;
+  new_sensor_data_cond_.notify_one();
+}
+
+uint32_t Controller::ApplySensors(const float* values) {
+  return ApplySensorRange(0, config_.sensor_count_, values);
+}
+
+uint32_t Controller::ApplySensorRange(uint32_t first, uint32_t count,
+                                      const float* values) {
+  // Snapshots carry no timestamps, all changes get the time they were seen
+  const uint64_t now = MonotonicNowNs();
+  std::atomic<uint64_t>* last_update_ns = metrics_->last_update_ns();
+  for (uint32_t i = 0; i < count; i++) {
+    if (SameSensorValue(values[i], algorithm_.SensorValue(first + i))) continue;
+    last_update_ns[first + i].store(now, std::memory_order_relaxed);
+    if (telemetry_) telemetry_->RecordSensor(now, first + i, values[i]);
+  }
+  const uint32_t changed = algorithm_.SetSensorRange(first, count, values);
+  controller_metrics_page::Add(metrics_->sensor_updates, changed);
+  if (changed != 0) MarkSensorsChanged();
+  return changed;
+}
+
+uint32_t Controller::ApplyDirtySlots(sensor_slot_buffer* buffer,
+                                     uint32_t* slots, float* values) {
+  uint32_t changed = 0;
+  const uint32_t dirty = buffer->TakeDirty(slots);
+  for (uint32_t i = 0; i < dirty; i++) {
+    const sensor_slot* slot = buffer->Slot(slots[i]);
+    buffer->ReadSlot(slots[i], values + slot->first_sensor);
+    changed +=
+        ApplySensorRange(slot->first_sensor, slot->count,
+                         values + slot->first_sensor);
+  }
+  return changed;
+}
+
+void Controller::UpdateSensors(const float* values) {
+  uint32_t changed = 0;
+  {
+    boost::mutex::scoped_lock scoped_lock(received_sensor_data_mutex);
+    changed = ApplySensors(values);
+  }
+  if (changed) {
+    new_sensor_data_cond_.notify_one();
+  }
+}
+
+bool Controller::ReceiveSensorsSemaphore() {
+  // Attach as soon as the GUI created the sensor memory
+  mapped_region region;
+  if (!AttachSegment(sensor_memory_name, config_.sensor_count_,
+                     ATTACH_FOREVER, &region))
+    return false;
   sensor_shared_memory_buffer* data =
-      static_cast<sensor_shared_memory_buffer*>(addr);
+      static_cast<sensor_shared_memory_buffer*>(region.get_address());
+  const float* shared_values = data->values();
 
   // Below loop will be blocked untill we have data from GUI
   // this is ok, since this thread has nothing else to do :-)
+  std::vector<float> values(config_.sensor_count_);
   while (true) {
     // Read the sensor values
     data->nstored.wait();
     data->mutex.wait();
+    std::copy(shared_values, shared_values + config_.sensor_count_,
+              values.begin());
+    data->mutex.post();
+    data->nempty.post();
+    UpdateSensors(values.data());
+  }
+}
+
+bool Controller::ReceiveSensorsSeqlock() {
+  // Attach to the lock free shared memory created by the GUI
+  mapped_region region;
+  if (!AttachSegment(sensor_seqlock_memory_name, config_.sensor_count_,
+                     ATTACH_FOREVER, &region))
+    return false;
+  sensor_seqlock_buffer* data =
+      static_cast<sensor_seqlock_buffer*>(region.get_address());
+
+  // The writer never waits for us, we only ever look at the latest snapshot
+  std::vector<float> values(config_.sensor_count_);
+  uint32_t sequence = data->Read(values.data(), config_.sensor_count_);
+  UpdateSensors(values.data());
+  while (true) {
+    data->WaitForUpdate(sequence);
+    sequence = data->Read(values.data(), config_.sensor_count_);
+    UpdateSensors(values.data());
+  }
+}
+
+bool Controller::ReceiveSensorsSlots() {
+  // Attach to the slots the subsystems publish into
+  mapped_region region;
+  if (!AttachSegment(sensor_slots_memory_name, config_.sensor_count_,
+                     ATTACH_FOREVER, &region))
+    return false;
+  sensor_slot_buffer* data =
+      static_cast<sensor_slot_buffer*>(region.get_address());
+
+  // Only the slots marked dirty are read, the others are not even touched
+  std::vector<float> values(config_.sensor_count_);
+  std::vector<uint32_t> slots(data->slot_count);
+  while (true) {
+    const uint32_t generation =
+        data->generation.load(std::memory_order_acquire);
+    uint32_t changed;
     {
       boost::mutex::scoped_lock scoped_lock(received_sensor_data_mutex);
-      for (uint32_t i = 0; i < config_.sensor_count_; i++) {
-        if (data->sensors[i].value_ != received_sensor_values_[i].value_) {
-          received_sensor_values_[i].value_ = data->sensors[i].value_;
-          LOG_INFO("Received sensor values %d:%f\n", i,
-                   received_sensor_values_[i].value_);
-          sensors_changed_ = true;
+      changed = ApplyDirtySlots(data, slots.data(), values.data());
+    }
+    if (changed) new_sensor_data_cond_.notify_one();
+    data->WaitForUpdate(generation);
+  }
+}
+
+bool Controller::ApplyShardMax(uint32_t shard, float max_temp,
+                               uint64_t update_ns) {
+  metrics_->last_update_ns()[shard].store(update_ns,
+                                          std::memory_order_relaxed);
+  if (telemetry_) telemetry_->RecordSensor(update_ns, shard, max_temp);
+  controller_metrics_page::Add(metrics_->sensor_updates, 1);
+  if (!algorithm_.SetSensor(shard, max_temp)) return false;
+  const bool first = !sensors_changed_;
+  MarkSensorsChanged();
+  // Count from the shard picking up the update, so the hop is included
+  if (first && update_ns != 0) first_pending_ns_ = update_ns;
+  return true;
+}
+
+bool Controller::ReceiveSensorsShards() {
+  // The shards attach once this is ready
+  const uint32_t shard_count = config_.shard_count_;
+  mapped_region region;
+  bool reused;
+  if (!OwnSegment(shard_max_memory_name, shard_max_buffer::Size(shard_count),
+                  shard_count, &region, &reused))
+    return false;
+  shard_max_buffer* data;
+  if (reused) {
+    // Running shards keep publishing into it, the others start over
+    data = static_cast<shard_max_buffer*>(region.get_address());
+    data->ReleaseDeadShards();
+  } else {
+    data = new (region.get_address()) shard_max_buffer(shard_count);
+  }
+  data->header.MarkReady();
+
+  // Version of every entry last applied, whether it is stale
+  std::vector<uint32_t> versions(shard_count, 0);
+  std::vector<bool> stale(shard_count, false);
+  while (true) {
+    const uint32_t generation = data->generation.load(std::memory_order_acquire);
+    const uint64_t now = MonotonicNowNs();
+    data->header.Beat(now);
+    bool changed = false;
+    {
+      boost::mutex::scoped_lock scoped_lock(received_sensor_data_mutex);
+      for (uint32_t shard = 0; shard < shard_count; shard++) {
+        const shard_max_entry* entry = data->Entry(shard);
+        // Shards that never attached keep the start up value
+        const bool alive = entry->heartbeat_ns.load() == 0 ||
+                           data->ShardAlive(shard, now);
+        if (!alive) {
+          if (stale[shard]) continue;
+          LOG_WARNING("Shard %d stopped, treating its sensors as %d degree\n",
+                      shard, DEFAULT_SENSOR_DEGREE);
+          stale[shard] = true;
+          controller_metrics_page::Add(metrics_->stale_shards, 1);
+          changed |= ApplyShardMax(shard, DEFAULT_SENSOR_DEGREE, now);
+          continue;
         }
+        if (!stale[shard] &&
+            entry->version.load(std::memory_order_acquire) == versions[shard])
+          continue;
+        float max_temp;
+        uint64_t update_ns, publish_ns;
+        versions[shard] = data->Read(shard, &max_temp, &update_ns, &publish_ns);
+        if (stale[shard]) {
+          LOG_INFO("Shard %d is back\n", shard);
+          stale[shard] = false;
+        } else if (publish_ns != 0) {
+          metrics_->shard_hop_ns.Record(MonotonicNowNs() - publish_ns);
+        }
+        changed |= ApplyShardMax(shard, max_temp, update_ns);
       }
     }
-    data->mutex.post();
-    data->nempty.post();
-    if (sensors_changed_) {
-      new_sensor_data_cond_.notify_one();
+    if (changed) new_sensor_data_cond_.notify_one();
+    data->WaitForUpdate(generation, SEGMENT_HEARTBEAT_INTERVAL_NS);
+  }
+}
+
+bool Controller::ApplySensorSamples(const SensorSample* samples,
+                                    uint32_t count) {
+  bool changed = false;
+  for (uint32_t i = 0; i < count; i++) {
+    const SensorSample& sample = samples[i];
+    if (sample.sensor_id_ < 0 ||
+        static_cast<uint32_t>(sample.sensor_id_) >= config_.sensor_count_) {
+      LOG_WARNING_THROTTLED(1000, "Dropping sample for unknown sensor %d\n",
+                            sample.sensor_id_);
+      continue;
+    }
+    received_sensor_timestamps_[sample.sensor_id_] = sample.monotonic_ts_;
+    metrics_->last_update_ns()[sample.sensor_id_].store(
+        sample.monotonic_ts_, std::memory_order_relaxed);
+    if (telemetry_)
+      telemetry_->RecordSensor(sample.monotonic_ts_, sample.sensor_id_,
+                               sample.value_);
+    if (algorithm_.SetSensor(sample.sensor_id_, sample.value_))
+      changed = true;
+  }
+  controller_metrics_page::Add(metrics_->sensor_updates, count);
+  if (changed) MarkSensorsChanged();
+  LOG_INFO_THROTTLED(1000, "Received %d sensor samples\n", count);
+  return changed;
+}
+
+void Controller::UpdateSensorSamples(const SensorSample* samples,
+                                     uint32_t count) {
+  bool changed = false;
+  {
+    boost::mutex::scoped_lock scoped_lock(received_sensor_data_mutex);
+    changed = ApplySensorSamples(samples, count);
+  }
+  if (changed) {
+    new_sensor_data_cond_.notify_one();
+  }
+}
+
+bool Controller::ReceiveSensorsRing() {
+  // Attach to the sample stream created by the GUI
+  mapped_region region;
+  if (!AttachSegment(sensor_samples_memory_name, SAMPLE_RING_CAPACITY,
+                     ATTACH_FOREVER, &region))
+    return false;
+  sensor_sample_ring* ring =
+      static_cast<sensor_sample_ring*>(region.get_address());
+
+  // Drain whatever has accumulated in one go, so a burst costs a single
+  // wake up of ProcessSensors
+  const uint32_t batch_size = 1024;
+  std::vector<SensorSample> batch(batch_size);
+  uint64_t reported_drops = 0;
+  while (true) {
+    ring->WaitForSamples();
+    uint32_t count;
+    while ((count = ring->PopBatch(batch.data(), batch_size)) != 0)
+      UpdateSensorSamples(batch.data(), count);
+    uint64_t dropped = ring->dropped.load(std::memory_order_relaxed);
+    if (dropped != reported_drops) {
+      LOG_WARNING("Sample ring overflowed, %lu samples dropped so far\n",
+                  dropped);
+      reported_drops = dropped;
     }
   }
 }
 
 bool StartController(const InputConfiguration config) {
+  if (config.shard_count_ > 0 &&
+      (config.event_loop_ || config.transport_ != SensorTransport::SLOTS)) {
+    LOG_ERROR("Sharded mode needs the slots transport and the threaded core\n");
+    return false;
+  }
   Controller* controller = new Controller(config);
-  // Lets wait a second so GUI gets a chance to create the shared memory
-  sleep(1);
-  // Create input thread which will watch out for Sensor changes
-  boost::thread* sensor_thread =
-      new boost::thread(boost::bind(&Controller::ReceiveSensors, controller));
-  controller->ProcessSensors();
-  sensor_thread->join();
-  return true;
+  // Without the configured registers the fans would not follow
+  if (!controller->OpenRegisterBackend() || !controller->OpenMetrics())
+    return false;
+  // Everything runs on this thread, the event loop included
+  if (config.event_loop_) return controller->ProcessSensors();
+  // Create input thread which will watch out for Sensor changes. It is left
+  // running when ProcessSensors fails, the process exits then.
+  boost::thread sensor_thread(
+      boost::bind(&Controller::ReceiveSensors, controller));
+  sensor_thread.detach();
+  return controller->ProcessSensors();
 }
 
 }  // namespace controller
@@ -1,11 +1,20 @@
 #pragma once
 
+#include <boost/interprocess/mapped_region.hpp>
 #include <boost/thread/condition.hpp>
 #include <boost/thread/mutex.hpp>
 #include <cstdint>
 #include <memory>
 #include <vector>
 #include "common.h"
+#include "control_algorithm.h"
+#include "histogram.h"
+#include "metrics_page.h"
+#include "register_backend.h"
+#include "sample_ring.h"
+#include "sensor_slots.h"
+#include "shard_aggregation.h"
+#include "telemetry_recorder.h"
 // Controller class
 // 1. Receive the sensor values from sensor memory
 // 2. Process them to find the duty cycle
@@ -23,40 +32,201 @@ class Controller {
   // Configuration stays constant once initialized
   const InputConfiguration config_;
 
-  // Latest set temperature values from GUI in degree celcius
-  std::vector<Sensor> received_sensor_values_;
+  // Latest sensor values, their maximum and the resulting registers. The
+  // sensor side is guarded by received_sensor_data_mutex.
+  ControlAlgorithm algorithm_;
+
+  // Monotonic time in ns of the latest sample per sensor, 0 if the transport
+  // carries no timestamps
+  std::vector<uint64_t> received_sensor_timestamps_;
 
   bool sensors_changed_ = false;
 
-  // Mutex for the above two data structures
-  boost::mutex received_sensor_data_mutex;
+  // The receiving thread gave up, ProcessSensors stops the controller
+  bool receiver_failed_ = false;
 
-  // Last set FAN PWM counts from controller
-  std::vector<u_int32_t> registers_;
+  // Sensor updates since ProcessSensors last picked up the values and the
+  // monotonic time in ns of the first of them
+  uint64_t pending_updates_ = 0;
+  uint64_t first_pending_ns_ = 0;
+
+  // Mutex for the above data structures
+  boost::mutex received_sensor_data_mutex;
 
   // PWM corresponding to 100 percent duty cycle for each fan
   const std::vector<u_int32_t> max_pwm_values_;
 
+  // Drives the fan registers, nullptr without a register device
+  std::unique_ptr<RegisterBackend> register_backend_;
+
+  // Records sensor samples and register sets, nullptr without a telemetry
+  // path. Sensor samples are recorded by the ingesting thread, register sets
+  // by the publishing one.
+  std::unique_ptr<TelemetryRecorder> telemetry_;
+
+  // Counters and latencies for monitoring tools in the ControllerMetrics
+  // shared memory, see metrics_page.h. Left in place when the controller
+  // exits, so the last state can still be scraped.
+  boost::interprocess::mapped_region metrics_region_;
+  controller_metrics_page* metrics_ = nullptr;
+
+  // Monotonic time in ns the register write counters were last logged
+  uint64_t last_backend_report_ns_ = 0;
+
+  // Filter counters of algorithm_ at the last report and its time
+  ControlStats reported_control_stats_;
+  uint64_t last_control_report_ns_ = 0;
+
   // To Signal new data processing
   boost::condition_variable new_sensor_data_cond_;
 
-  // Current known max temperature
-  float max_temp_ = TEMP_HUNDRED_PERCENT_CUTOFF;
+  // Fixed rate mode, wake up delay past the tick deadline and time from wake
+  // up to published registers, both in ns. Reset on every report.
+  Histogram loop_jitter_ns_;
+  Histogram loop_execution_ns_;
+
+  // Fixed rate mode, ticks that passed without the loop running
+  uint64_t missed_ticks_ = 0;
+
+  // Fixed rate mode, tick period, deadline of the next tick and ticks since
+  // the last statistics report
+  uint64_t control_period_ns_ = 0;
+  uint64_t control_deadline_ns_ = 0;
+  uint64_t ticks_since_report_ = 0;
+
+  // Creates the CLOCK_MONOTONIC timerfd ticking at control_rate_hz_, returns
+  // -1 on failure
+  int OpenControlTimer();
+
+  // Consumes the expired ticks of timer and records the wake up jitter.
+  // Returns false with errno set if reading failed.
+  bool ReadControlTick(int timer, uint64_t* wake);
+
+  // Records the execution time of the tick woken up at wake
+  void FinishControlTick(uint64_t wake);
+
+  // ProcessSensors implementation for control_rate_hz_ > 0, recomputes and
+  // publishes the registers on every timerfd tick. Only returns on failure.
+  bool ProcessSensorsFixedRate(register_shared_memory_buffer* data);
+
+  // Runs algorithm_.Control for the maxima captured last and publishes the
+  // registers if they changed. first_pending_ns is the monotonic time of the
+  // first sensor update covered, 0 if none. Only called from the thread
+  // publishing the registers.
+  void RunControl(register_shared_memory_buffer* data, bool force,
+                  uint64_t first_pending_ns);
+
+  // Logs what the register filters held back since the last report, at most
+  // once per second
+  void ReportControlStats(uint64_t now);
+
+  // Writes the changed registers to the register backend, then copies them
+  // to the register mailbox as a new generation. Never blocks.
+  void PublishRegisters(register_shared_memory_buffer* data);
+
+  // Logs and resets the fixed rate loop statistics
+  void ReportLoopStats();
+
+  // Event driven mode, time from the first pending update to the recompute in
+  // ns, recomputes and the sensor updates they covered since the last report
+  Histogram coalesce_latency_ns_;
+  uint64_t recomputes_ = 0;
+  uint64_t coalesced_updates_ = 0;
+  uint64_t last_coalesce_report_ns_ = 0;
+
+  // Records a sensor update for ProcessSensors. Caller holds
+  // received_sensor_data_mutex and notifies new_sensor_data_cond_.
+  void MarkSensorsChanged();
+
+  // Keeps waiting for more sensor updates until the coalescing window closes.
+  // Called with received_sensor_data_mutex held through lock.
+  void CoalesceUpdates(boost::mutex::scoped_lock& lock);
+
+  // Records a recompute covering updates sensor updates, the first of which
+  // arrived at first_pending_ns
+  void CountRecompute(uint64_t updates, uint64_t first_pending_ns);
+
+  // Logs and resets the coalescing statistics
+  void ReportCoalescingStats();
+
+  // ReceiveSensors implementations, they only return if the sensor memory
+  // cannot be mapped.
+  // ReceiveSensors implementation for SensorTransport::SEMAPHORE
+  bool ReceiveSensorsSemaphore();
+
+  // ReceiveSensors implementation for SensorTransport::SEQLOCK
+  bool ReceiveSensorsSeqlock();
+
+  // ReceiveSensors implementation for SensorTransport::RING
+  bool ReceiveSensorsRing();
+
+  // ReceiveSensors implementation for SensorTransport::SLOTS
+  bool ReceiveSensorsSlots();
+
+  // ReceiveSensors implementation for the sharded mode, owns the shard
+  // maxima memory and applies every shard's maximum as the value of sensor
+  // id shard. Shards that stopped beating fall back to
+  // DEFAULT_SENSOR_DEGREE until they are back.
+  bool ReceiveSensorsShards();
+
+  // Applies the maximum of shard, which the shard picked up at update_ns.
+  // Caller holds received_sensor_data_mutex. Returns whether it changed.
+  bool ApplyShardMax(uint32_t shard, float max_temp, uint64_t update_ns);
+
+  // Applies a batch of samples in order and wakes up ProcessSensors once if
+  // anything changed. Caller holds no locks.
+  void UpdateSensorSamples(const SensorSample* samples, uint32_t count);
+
+  // Stores the given snapshot in algorithm_ and wakes up
+  // ProcessSensors if anything changed. Caller holds no locks.
+  void UpdateSensors(const float* values);
+
+  // Lock free cores of the two above, the caller either holds
+  // received_sensor_data_mutex or is the only thread touching the sensors.
+  // Return whether anything changed.
+  bool ApplySensorSamples(const SensorSample* samples, uint32_t count);
+  uint32_t ApplySensors(const float* values);
+
+  // ApplySensors for the count sensors starting at first, values[0] belongs
+  // to sensor first
+  uint32_t ApplySensorRange(uint32_t first, uint32_t count,
+                            const float* values);
+
+  // Reads the dirty slots of buffer into values, indexed by sensor id, and
+  // applies them. slots is scratch space for slot_count entries.
+  uint32_t ApplyDirtySlots(sensor_slot_buffer* buffer, uint32_t* slots,
+                           float* values);
+
+  // ProcessSensors implementation for event_loop_, ingests, recomputes and
+  // publishes on the calling thread, see controller_event_loop.cpp. Only
+  // returns on failure.
+  bool ProcessSensorsEventLoop(register_shared_memory_buffer* data);
 
  public:
   Controller(const InputConfiguration config);
 
-  // Runs in a thread and monitor sensor value changes
-  void ReceiveSensors();
+  // Opens the configured register device, fails if it cannot be opened
+  bool OpenRegisterBackend();
 
-  // Calculate new max_temp_, trigger CalculateRegisters,
-  // send the latest register values to shared memory
-  void ProcessSensors();
+  // Creates the metrics page, fails if another controller is running
+  bool OpenMetrics();
 
-  // Updates the PWM values in registers_ based on max_temp_
-  void CalculateRegisters();
+  // Runs in a thread and monitor sensor value changes. If the sensor memory
+  // cannot be mapped it makes ProcessSensors fail.
+  void ReceiveSensors();
+
+  // Pick up the new max temperature, recompute the registers through
+  // algorithm_ and send them to shared memory. Only returns, with false, once
+  // the controller cannot go on.
+  bool ProcessSensors();
 };
+// Runs a controller for config on the calling thread. Returns false if it
+// cannot start or has to stop, otherwise it never returns.
 bool StartController(const InputConfiguration config);
 
+// Configuration the control algorithm runs with, in sharded mode it sees one
+// sensor per shard
+InputConfiguration ControlConfig(const InputConfiguration& config);
+
 }  // namespace controller
 }  // namespace fan_controller
@@ -0,0 +1,213 @@
+#include <sched.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <boost/interprocess/mapped_region.hpp>
+#include <cerrno>
+#include <cstring>
+#include "../logger/logger.h"
+#include "controller.h"
+#include "doorbell.h"
+#include "shared_segment.h"
+using namespace boost::interprocess;
+
+// Single threaded controller core. Sensor ingest, recompute and register
+// publish all run on the thread calling ProcessSensors, woken up by epoll on
+// the producers' doorbell and optionally the control timer. Nothing else
+// touches the sensor state, so no locks are taken and no thread hand over
+// happens per update.
+namespace fan_controller {
+namespace controller {
+
+namespace {
+
+// epoll_event user data, which source became ready
+enum EventSource : uint64_t {
+  DOORBELL = 0,
+  DOORBELL_PRODUCERS,
+  CONTROL_TIMER,
+};
+
+bool AddSource(int epoll_fd, int fd, EventSource source) {
+  epoll_event event = {};
+  event.events = EPOLLIN;
+  event.data.u64 = source;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+    LOG_ERROR("epoll_ctl failed: %s\n", strerror(errno));
+    return false;
+  }
+  return true;
+}
+
+}  // namespace
+
+bool Controller::ProcessSensorsEventLoop(register_shared_memory_buffer* data) {
+  if (config_.event_loop_cpu_ >= 0) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(config_.event_loop_cpu_, &cpus);
+    if (sched_setaffinity(0, sizeof(cpus), &cpus) < 0)
+      LOG_WARNING("Pinning the event loop to CPU %d failed: %s\n",
+                  config_.event_loop_cpu_, strerror(errno));
+  }
+  if (config_.coalesce_window_us_ > 0)
+    LOG_WARNING(
+        "Coalescing window ignored, the event loop folds everything pending "
+        "per wake up\n");
+
+  // Map the sensor memory of the configured transport, created by the GUI
+  sensor_shared_memory_buffer* sensor_buffer = nullptr;
+  sensor_seqlock_buffer* seqlock_buffer = nullptr;
+  sensor_sample_ring* ring = nullptr;
+  sensor_slot_buffer* slot_buffer = nullptr;
+  mapped_region region;
+  const std::string& name =
+      config_.transport_ == SensorTransport::SEQLOCK
+          ? sensor_seqlock_memory_name
+          : config_.transport_ == SensorTransport::RING
+                ? sensor_samples_memory_name
+                : config_.transport_ == SensorTransport::SLOTS
+                      ? sensor_slots_memory_name
+                      : sensor_memory_name;
+  if (!AttachSegment(name,
+                     config_.transport_ == SensorTransport::RING
+                         ? SAMPLE_RING_CAPACITY
+                         : config_.sensor_count_,
+                     ATTACH_FOREVER, &region))
+    return false;
+  switch (config_.transport_) {
+    case SensorTransport::SEQLOCK:
+      seqlock_buffer = static_cast<sensor_seqlock_buffer*>(region.get_address());
+      break;
+    case SensorTransport::RING:
+      ring = static_cast<sensor_sample_ring*>(region.get_address());
+      break;
+    case SensorTransport::SLOTS:
+      slot_buffer = static_cast<sensor_slot_buffer*>(region.get_address());
+      break;
+    case SensorTransport::SEMAPHORE:
+    default:
+      sensor_buffer =
+          static_cast<sensor_shared_memory_buffer*>(region.get_address());
+      break;
+  }
+
+  DoorbellServer doorbell;
+  int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd < 0 || !doorbell.Open() ||
+      !AddSource(epoll_fd, doorbell.event_fd(), DOORBELL) ||
+      !AddSource(epoll_fd, doorbell.producer_fd(), DOORBELL_PRODUCERS)) {
+    if (epoll_fd >= 0) close(epoll_fd);
+    return false;
+  }
+  int timer = -1;
+  if (config_.control_rate_hz_ > 0) {
+    timer = OpenControlTimer();
+    if (timer < 0 || !AddSource(epoll_fd, timer, CONTROL_TIMER)) {
+      if (timer >= 0) close(timer);
+      close(epoll_fd);
+      return false;
+    }
+  }
+  LOG_INFO("Controller event loop running\n");
+
+  std::vector<float> values(config_.sensor_count_);
+  const uint32_t batch_size = 1024;
+  std::vector<SensorSample> batch(batch_size);
+  uint32_t sequence = 0;
+  std::vector<uint32_t> slots(slot_buffer != nullptr ? slot_buffer->slot_count
+                                                     : 0);
+  if (seqlock_buffer != nullptr) {
+    sequence = seqlock_buffer->Read(values.data(), config_.sensor_count_);
+    ApplySensors(values.data());
+  }
+  uint64_t reported_drops = 0;
+  const int max_events = 8;
+  epoll_event events[max_events];
+  // Pick up what was published before the loop started
+  bool first_pass = true;
+  while (true) {
+    // Poll for sensor updates while no producer holds the doorbell, a slew
+    // limited ramp takes its next step even without new data
+    int timeout_ms = doorbell.producers() == 0
+                         ? 10
+                         : SEGMENT_HEARTBEAT_INTERVAL_NS / 1000000;
+    if (timer < 0 && algorithm_.Ramping())
+      timeout_ms = ControlAlgorithm::RAMP_INTERVAL_NS / 1000000;
+    if (first_pass) timeout_ms = 0;
+    first_pass = false;
+    int count = epoll_wait(epoll_fd, events, max_events, timeout_ms);
+    const uint64_t beat_ns = MonotonicNowNs();
+    data->header.Beat(beat_ns);
+    metrics_->header.Beat(beat_ns);
+    if (count < 0) {
+      if (errno == EINTR) continue;
+      LOG_ERROR("epoll_wait failed: %s\n", strerror(errno));
+      break;
+    }
+    bool tick = false;
+    uint64_t wake = 0;
+    for (int i = 0; i < count; i++) {
+      switch (events[i].data.u64) {
+        case DOORBELL:
+          doorbell.Drain();
+          break;
+        case DOORBELL_PRODUCERS:
+          doorbell.ServiceProducers();
+          break;
+        case CONTROL_TIMER:
+          tick = ReadControlTick(timer, &wake);
+          break;
+      }
+    }
+
+    // Ingest everything published so far. The doorbell was reset above, so
+    // anything published from here on rings again.
+    if (sensor_buffer != nullptr) {
+      const float* shared_values = sensor_buffer->values();
+      while (sensor_buffer->nstored.try_wait()) {
+        sensor_buffer->mutex.wait();
+        std::copy(shared_values, shared_values + config_.sensor_count_,
+                  values.begin());
+        sensor_buffer->mutex.post();
+        sensor_buffer->nempty.post();
+        ApplySensors(values.data());
+      }
+    } else if (seqlock_buffer != nullptr) {
+      if (seqlock_buffer->sequence.load(std::memory_order_acquire) !=
+          sequence) {
+        sequence = seqlock_buffer->Read(values.data(), config_.sensor_count_);
+        ApplySensors(values.data());
+      }
+    } else if (slot_buffer != nullptr) {
+      ApplyDirtySlots(slot_buffer, slots.data(), values.data());
+    } else {
+      uint32_t popped;
+      while ((popped = ring->PopBatch(batch.data(), batch_size)) != 0)
+        ApplySensorSamples(batch.data(), popped);
+      uint64_t dropped = ring->dropped.load(std::memory_order_relaxed);
+      if (dropped != reported_drops) {
+        LOG_WARNING("Sample ring overflowed, %lu samples dropped so far\n",
+                    dropped);
+        reported_drops = dropped;
+      }
+    }
+
+    // In fixed rate mode only ticks recompute, otherwise every change and
+    // every ramp step does
+    if (timer >= 0 ? tick : sensors_changed_ || algorithm_.Ramping()) {
+      const uint64_t updates = pending_updates_;
+      sensors_changed_ = false;
+      pending_updates_ = 0;
+      if (timer < 0 && updates != 0) CountRecompute(updates, first_pending_ns_);
+      algorithm_.CaptureMaxima();
+      RunControl(data, tick, updates != 0 ? first_pending_ns_ : 0);
+    }
+    if (tick) FinishControlTick(wake);
+  }
+  if (timer >= 0) close(timer);
+  close(epoll_fd);
+  return false;
+}
+
+}  // namespace controller
+}  // namespace fan_controller
@@ -0,0 +1,277 @@
+#include "controller_options.h"
+#include <getopt.h>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include "control_algorithm.h"
+#include "controller.h"
+#include "fan_curve.h"
+
+namespace fan_controller {
+namespace controller {
+
+namespace {
+
+bool ParseSeverity(const std::string& name, logger::Severity* severity) {
+  if (name == "error")
+    *severity = logger::Severity::ERROR;
+  else if (name == "warning")
+    *severity = logger::Severity::WARNING;
+  else if (name == "info")
+    *severity = logger::Severity::INFO;
+  else if (name == "debug")
+    *severity = logger::Severity::DEBUG;
+  else
+    return false;
+  return true;
+}
+
+// Value of --config in argv, either "--config FILE" or "--config=FILE"
+std::vector<std::string> ConfigFiles(int argc, char* argv[]) {
+  std::vector<std::string> files;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--config") == 0 && i + 1 < argc)
+      files.push_back(argv[++i]);
+    else if (strncmp(argv[i], "--config=", 9) == 0)
+      files.push_back(argv[i] + 9);
+  }
+  return files;
+}
+
+}  // namespace
+
+void PrintControllerUsage(const char* program) {
+  LOG_ERROR(
+      "Usage: %s [options]\n"
+      "  --config FILE       read options from FILE, one \"name value\" per "
+      "line\n"
+      "  --sensors N         sensor count (default 1)\n"
+      "  --fans N            fan count (default 1)\n"
+      "  --max-pwm A,B,..    PWM count at 100%% duty cycle per fan (default "
+      "1000)\n"
+      "  --curve T:D,T:D,..  fan curve as temperature:duty points, give once\n"
+      "                      for all fans or once per fan (default 25:20,75:100)\n"
+      "  --transport T       semaphore, seqlock, ring or slots (default "
+      "semaphore)\n"
+      "  --subsystems N      slots transport, subsystems owning a slot each "
+      "(default 1)\n"
+      "  --shards N          slots transport, split the subsystems between N\n"
+      "                      ingest processes, zones then list shards\n"
+      "  --shard-cpus A,B,.. pin shard i to the i-th CPU\n"
+      "  --control-rate HZ   fixed controller loop rate, 0 = event driven\n"
+      "  --coalesce US       fold sensor updates within US into one recompute\n"
+      "  --hysteresis C      follow falling temperatures only past C degrees\n"
+      "  --min-duty-delta P  hold back register changes below P percent\n"
+      "  --slew-rate N       limit register changes to N PWM counts/s\n"
+      "  --zone N/S/F[/C]    zone N of sensors S driving fans F, repeat per "
+      "zone\n"
+      "  --zone-workers N    threads evaluating zones in parallel (default 0)\n"
+      "  --event-loop        run the single threaded epoll controller core\n"
+      "  --cpu N             pin the event loop to CPU N\n"
+      "  --register-device F fan registers are mmapped from F\n"
+      "  --register-offset B offset of fan 0's register in F (default 0)\n"
+      "  --register-stride B bytes between fan registers (default 4)\n"
+      "  --register-stand-in create or grow the register device as a file\n"
+      "  --telemetry P       record sensor samples and register sets to "
+      "P.<n>.tlm\n"
+      "  --telemetry-mb N    rotate telemetry files at N MiB (default 64)\n"
+      "  --log-level L       error, warning, info or debug (default warning)\n",
+      program);
+}
+
+bool ReadOptionsFile(const std::string& path, std::vector<std::string>* args) {
+  std::ifstream in(path);
+  if (!in) {
+    LOG_ERROR("Cannot read config file %s\n", path.c_str());
+    return false;
+  }
+  std::string line;
+  while (std::getline(in, line)) {
+    line = line.substr(0, line.find('#'));
+    std::istringstream words(line);
+    std::string name, value;
+    if (!(words >> name)) continue;
+    words >> value;
+    if (value == "=") words >> value;
+    args->push_back("--" + name);
+    if (!value.empty()) args->push_back(value);
+  }
+  return true;
+}
+
+bool ParseControllerOptions(int argc, char* argv[],
+                            ControllerOptions* options) {
+  static const option long_options[] = {
+      {"config", required_argument, nullptr, 'F'},
+      {"sensors", required_argument, nullptr, 's'},
+      {"fans", required_argument, nullptr, 'f'},
+      {"max-pwm", required_argument, nullptr, 'p'},
+      {"curve", required_argument, nullptr, 'c'},
+      {"transport", required_argument, nullptr, 't'},
+      {"subsystems", required_argument, nullptr, 'y'},
+      {"shards", required_argument, nullptr, 'x'},
+      {"shard-cpus", required_argument, nullptr, 'X'},
+      {"control-rate", required_argument, nullptr, 'C'},
+      {"coalesce", required_argument, nullptr, 'o'},
+      {"hysteresis", required_argument, nullptr, 'H'},
+      {"min-duty-delta", required_argument, nullptr, 'D'},
+      {"slew-rate", required_argument, nullptr, 'W'},
+      {"zone", required_argument, nullptr, 'z'},
+      {"zone-workers", required_argument, nullptr, 'k'},
+      {"event-loop", no_argument, nullptr, 'E'},
+      {"cpu", required_argument, nullptr, 'u'},
+      {"register-device", required_argument, nullptr, 'R'},
+      {"register-offset", required_argument, nullptr, 'O'},
+      {"register-stride", required_argument, nullptr, 'B'},
+      {"register-stand-in", no_argument, nullptr, 'I'},
+      {"telemetry", required_argument, nullptr, 'L'},
+      {"telemetry-mb", required_argument, nullptr, 'Z'},
+      {"log-level", required_argument, nullptr, 'l'},
+      {"help", no_argument, nullptr, 'h'},
+      {nullptr, 0, nullptr, 0}};
+
+  // Config files first, so the command line wins
+  std::vector<std::string> args = {argv[0]};
+  for (const std::string& file : ConfigFiles(argc, argv))
+    if (!ReadOptionsFile(file, &args)) return false;
+  args.insert(args.end(), argv + 1, argv + argc);
+  std::vector<char*> arg_pointers;
+  for (std::string& arg : args) arg_pointers.push_back(&arg[0]);
+  arg_pointers.push_back(nullptr);
+
+  uint32_t sensor_count = 1, fan_count = 1, subsystem_count = 1;
+  std::vector<u_int32_t> max_pwm_values;
+  std::string transport = "semaphore";
+  InputConfiguration parsed(1, 1);
+  uint64_t telemetry_mb = 64;
+  int option;
+  optind = 1;
+  while ((option = getopt_long(arg_pointers.size() - 1, arg_pointers.data(),
+                               "", long_options, nullptr)) != -1) {
+    switch (option) {
+      case 'F': break;
+      case 's': sensor_count = atoi(optarg); break;
+      case 'f': fan_count = atoi(optarg); break;
+      case 'p':
+        if (!ParseMaxPwmList(optarg, &max_pwm_values)) {
+          LOG_ERROR("Invalid max PWM list %s\n", optarg);
+          return false;
+        }
+        break;
+      case 'c': {
+        std::vector<CurvePoint> curve;
+        if (!FanCurveEngine::ParseCurve(optarg, &curve)) {
+          LOG_ERROR("Invalid fan curve %s\n", optarg);
+          return false;
+        }
+        parsed.fan_curves_.push_back(curve);
+        break;
+      }
+      case 't': transport = optarg; break;
+      case 'y': subsystem_count = atoi(optarg); break;
+      case 'x': parsed.shard_count_ = atoi(optarg); break;
+      case 'X': {
+        std::istringstream cpus(optarg);
+        std::string cpu;
+        while (std::getline(cpus, cpu, ','))
+          parsed.shard_cpus_.push_back(atoi(cpu.c_str()));
+        break;
+      }
+      case 'C': parsed.control_rate_hz_ = atoi(optarg); break;
+      case 'o': parsed.coalesce_window_us_ = atoi(optarg); break;
+      case 'H': parsed.hysteresis_c_ = atof(optarg); break;
+      case 'D': parsed.min_duty_delta_ = atof(optarg); break;
+      case 'W': parsed.slew_rate_ = atoi(optarg); break;
+      case 'z': {
+        ZoneConfig zone;
+        if (!ControlAlgorithm::ParseZone(optarg, &zone)) {
+          LOG_ERROR("Invalid zone %s\n", optarg);
+          return false;
+        }
+        parsed.zones_.push_back(zone);
+        break;
+      }
+      case 'k': parsed.zone_workers_ = atoi(optarg); break;
+      case 'E': parsed.event_loop_ = true; break;
+      case 'u': parsed.event_loop_cpu_ = atoi(optarg); break;
+      case 'R': parsed.register_device_ = optarg; break;
+      case 'O': parsed.register_offset_ = strtoull(optarg, nullptr, 0); break;
+      case 'B': parsed.register_stride_ = atoi(optarg); break;
+      case 'I': parsed.register_stand_in_ = true; break;
+      case 'L': parsed.telemetry_path_ = optarg; break;
+      case 'Z': telemetry_mb = atoi(optarg); break;
+      case 'l':
+        if (!ParseSeverity(optarg, &options->log_severity_)) {
+          LOG_ERROR("Log level must be one of error, warning, info or debug\n");
+          return false;
+        }
+        break;
+      default: PrintControllerUsage(argv[0]); return false;
+    }
+  }
+  if (optind < static_cast<int>(arg_pointers.size()) - 1) {
+    LOG_ERROR("Unexpected argument %s\n", arg_pointers[optind]);
+    return false;
+  }
+
+  if (sensor_count == 0 || sensor_count > MAX_SENSOR_COUNT) {
+    LOG_ERROR("Please enter valid sensor count between 1 and %d\n",
+              MAX_SENSOR_COUNT);
+    return false;
+  }
+  if (fan_count == 0 || fan_count > MAX_FAN_COUNT) {
+    LOG_ERROR("Please enter valid fan count between 1 and %d\n",
+              MAX_FAN_COUNT);
+    return false;
+  }
+  if (max_pwm_values.empty()) max_pwm_values.assign(fan_count, 1000);
+  if (max_pwm_values.size() != fan_count) {
+    LOG_ERROR("Need exactly one max PWM value per fan\n");
+    return false;
+  }
+  if (subsystem_count == 0 || subsystem_count > sensor_count) {
+    LOG_ERROR("Subsystem count must be between 1 and the sensor count\n");
+    return false;
+  }
+  if (parsed.fan_curves_.size() > 1 &&
+      parsed.fan_curves_.size() != fan_count) {
+    LOG_ERROR("Need either one fan curve or one per fan\n");
+    return false;
+  }
+  if (parsed.hysteresis_c_ < 0 || parsed.min_duty_delta_ < 0) {
+    LOG_ERROR("Hysteresis and minimum duty cycle delta must not be negative\n");
+    return false;
+  }
+
+  InputConfiguration& config = options->config_;
+  config = parsed;
+  config.fan_count_ = fan_count;
+  config.sensor_count_ = sensor_count;
+  config.max_pwm_values = max_pwm_values;
+  config.telemetry_file_bytes_ = telemetry_mb << 20;
+  if (transport == "seqlock") {
+    config.transport_ = SensorTransport::SEQLOCK;
+  } else if (transport == "ring") {
+    config.transport_ = SensorTransport::RING;
+  } else if (transport == "slots") {
+    config.transport_ = SensorTransport::SLOTS;
+    config.subsystem_count_ = subsystem_count;
+  } else if (transport != "semaphore") {
+    LOG_ERROR(
+        "Sensor transport must be one of semaphore, seqlock, ring or slots\n");
+    return false;
+  }
+  if (config.shard_count_ > 0 &&
+      (config.transport_ != SensorTransport::SLOTS || config.event_loop_ ||
+       config.shard_count_ > subsystem_count)) {
+    LOG_ERROR(
+        "Shards need the slots transport with at least one subsystem per "
+        "shard and no event loop\n");
+    return false;
+  }
+  return ControlAlgorithm::ValidateZones(ControlConfig(config));
+}
+
+}  // namespace controller
+}  // namespace fan_controller
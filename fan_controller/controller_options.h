@@ -0,0 +1,36 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include "../logger/logger.h"
+#include "common.h"
+
+// Non interactive controller configuration for fan_controllerd and a GUI
+// attaching to it. Options use the same names as sensor_loadgen, e.g.
+// --sensors 16 --fans 4 --max-pwm 1000,2000,1000,500 --transport seqlock.
+// --config FILE reads further options from FILE, one per line as
+// "name value" or "name = value" without the leading dashes, # starts a
+// comment. Options on the command line are applied after the file, so they
+// override single valued ones and add to repeated ones like --zone.
+namespace fan_controller {
+namespace controller {
+
+struct ControllerOptions {
+  InputConfiguration config_ = InputConfiguration(1, 1);
+  // Messages below this severity are neither formatted nor written
+  logger::Severity log_severity_ = logger::Severity::WARNING;
+};
+
+// Parses argv into options, argv[0] is skipped like getopt does. Logs the
+// problem and returns false on invalid options.
+bool ParseControllerOptions(int argc, char* argv[], ControllerOptions* options);
+
+// Appends the options in file path as command line arguments to args.
+// Returns false if the file cannot be read.
+bool ReadOptionsFile(const std::string& path, std::vector<std::string>* args);
+
+// Logs the options ParseControllerOptions understands
+void PrintControllerUsage(const char* program);
+
+}  // namespace controller
+}  // namespace fan_controller
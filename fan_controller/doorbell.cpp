@@ -0,0 +1,240 @@
+#include "doorbell.h"
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include "../logger/logger.h"
+#include "common.h"
+
+namespace fan_controller {
+
+const uint64_t Doorbell::RETRY_INTERVAL_NS;
+const uint64_t Doorbell::CONNECT_TIMEOUT_NS;
+
+namespace {
+
+// Abstract socket address, the leading 0 byte keeps it off the file system
+socklen_t DoorbellAddress(sockaddr_un* address) {
+  memset(address, 0, sizeof(*address));
+  address->sun_family = AF_UNIX;
+  memcpy(address->sun_path + 1, doorbell_socket_name.data(),
+         doorbell_socket_name.size());
+  return offsetof(sockaddr_un, sun_path) + 1 + doorbell_socket_name.size();
+}
+
+}  // namespace
+
+DoorbellServer::~DoorbellServer() {
+  for (int connection : connections_) close(connection);
+  if (producer_fd_ >= 0) close(producer_fd_);
+  if (listen_fd_ >= 0) close(listen_fd_);
+  if (event_fd_ >= 0) close(event_fd_);
+}
+
+bool DoorbellServer::Open() {
+  event_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  listen_fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  producer_fd_ = epoll_create1(EPOLL_CLOEXEC);
+  if (event_fd_ < 0 || listen_fd_ < 0 || producer_fd_ < 0) {
+    LOG_ERROR("Doorbell setup failed: %s\n", strerror(errno));
+    return false;
+  }
+  sockaddr_un address;
+  socklen_t length = DoorbellAddress(&address);
+  if (bind(listen_fd_, reinterpret_cast<sockaddr*>(&address), length) < 0 ||
+      listen(listen_fd_, 16) < 0) {
+    LOG_ERROR("Doorbell socket %s: %s\n", doorbell_socket_name.c_str(),
+              strerror(errno));
+    return false;
+  }
+  epoll_event event = {};
+  event.events = EPOLLIN;
+  event.data.fd = listen_fd_;
+  if (epoll_ctl(producer_fd_, EPOLL_CTL_ADD, listen_fd_, &event) < 0) {
+    LOG_ERROR("Doorbell epoll_ctl failed: %s\n", strerror(errno));
+    return false;
+  }
+  return true;
+}
+
+void DoorbellServer::Accept() {
+  int connection;
+  while ((connection = accept4(listen_fd_, nullptr, nullptr,
+                               SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+    // Our pid as data carrying the eventfd as SCM_RIGHTS
+    int32_t pid = getpid();
+    iovec io = {&pid, sizeof(pid)};
+    char control[CMSG_SPACE(sizeof(int))];
+    memset(control, 0, sizeof(control));
+    msghdr message = {};
+    message.msg_iov = &io;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    cmsghdr* header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(header), &event_fd_, sizeof(int));
+    if (sendmsg(connection, &message, MSG_NOSIGNAL) < 0) {
+      LOG_WARNING("Handing out the doorbell failed: %s\n", strerror(errno));
+      close(connection);
+      continue;
+    }
+    // Kept open, it turns readable once the producer hangs up
+    epoll_event event = {};
+    event.events = EPOLLIN | EPOLLRDHUP;
+    event.data.fd = connection;
+    if (epoll_ctl(producer_fd_, EPOLL_CTL_ADD, connection, &event) < 0) {
+      LOG_WARNING("Watching the doorbell producer failed: %s\n",
+                  strerror(errno));
+      close(connection);
+      continue;
+    }
+    connections_.push_back(connection);
+    LOG_INFO("Sensor producer connected to the doorbell, %zu connected\n",
+             connections_.size());
+  }
+}
+
+void DoorbellServer::HangUp(int connection) {
+  // Closing drops it from producer_fd_ as well
+  close(connection);
+  connections_.erase(
+      std::find(connections_.begin(), connections_.end(), connection));
+  LOG_INFO("Sensor producer left the doorbell, %zu connected\n",
+           connections_.size());
+}
+
+void DoorbellServer::ServiceProducers() {
+  const int max_events = 16;
+  epoll_event events[max_events];
+  int count;
+  do {
+    count = epoll_wait(producer_fd_, events, max_events, 0);
+    for (int i = 0; i < count; i++) {
+      const int fd = events[i].data.fd;
+      if (fd == listen_fd_) {
+        Accept();
+        continue;
+      }
+      // Producers send nothing, whatever arrives is dropped
+      char buffer[64];
+      ssize_t bytes = recv(fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+      if (bytes == 0 ||
+          (bytes < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+        HangUp(fd);
+    }
+  } while (count == max_events);
+}
+
+uint64_t DoorbellServer::Drain() {
+  uint64_t rings = 0;
+  if (read(event_fd_, &rings, sizeof(rings)) != sizeof(rings)) return 0;
+  return rings;
+}
+
+Doorbell::~Doorbell() { Disconnect(); }
+
+void Doorbell::Disconnect() {
+  if (event_fd_ >= 0) close(event_fd_);
+  if (connection_fd_ >= 0) close(connection_fd_);
+  event_fd_ = -1;
+  connection_fd_ = -1;
+  controller_pid_ = 0;
+}
+
+bool Doorbell::StartConnect() {
+  connection_fd_ =
+      socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (connection_fd_ < 0) return false;
+  // Unix sockets connect right away or fail, the eventfd follows once the
+  // controller accepted
+  sockaddr_un address;
+  socklen_t length = DoorbellAddress(&address);
+  if (connect(connection_fd_, reinterpret_cast<sockaddr*>(&address), length) <
+      0) {
+    Disconnect();
+    return false;
+  }
+  return true;
+}
+
+bool Doorbell::ReceiveEventFd() {
+  int32_t pid = 0;
+  iovec io = {&pid, sizeof(pid)};
+  char control[CMSG_SPACE(sizeof(int))];
+  msghdr message = {};
+  message.msg_iov = &io;
+  message.msg_iovlen = 1;
+  message.msg_control = control;
+  message.msg_controllen = sizeof(control);
+  ssize_t bytes = recvmsg(connection_fd_, &message, MSG_CMSG_CLOEXEC);
+  if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return false;
+  if (bytes == sizeof(pid)) {
+    cmsghdr* header = CMSG_FIRSTHDR(&message);
+    if (header != nullptr && header->cmsg_level == SOL_SOCKET &&
+        header->cmsg_type == SCM_RIGHTS) {
+      memcpy(&event_fd_, CMSG_DATA(header), sizeof(int));
+      controller_pid_ = pid;
+      return true;
+    }
+  }
+  // The controller went away before handing over the eventfd
+  Disconnect();
+  return false;
+}
+
+bool Doorbell::Connect(uint64_t timeout_ns) {
+  Disconnect();
+  next_attempt_ns_ = MonotonicNowNs() + RETRY_INTERVAL_NS;
+  if (!StartConnect()) {
+    LOG_INFO("No controller listening on the doorbell yet\n");
+    return false;
+  }
+  pollfd ready = {connection_fd_, POLLIN, 0};
+  if (poll(&ready, 1, timeout_ns / 1000000) > 0 && ReceiveEventFd()) {
+    LOG_INFO("Connected to the doorbell of controller %d\n", controller_pid_);
+    return true;
+  }
+  LOG_INFO("Controller did not hand over the doorbell yet\n");
+  return false;
+}
+
+void Doorbell::Ring() {
+  const uint64_t now = MonotonicNowNs();
+  if (now >= next_attempt_ns_) {
+    next_attempt_ns_ = now + RETRY_INTERVAL_NS;
+    // The controller never writes after the handshake, end of stream means
+    // it is gone and its eventfd wakes up nobody
+    if (event_fd_ >= 0) {
+      char byte;
+      ssize_t bytes = recv(connection_fd_, &byte, 1, MSG_DONTWAIT);
+      if (bytes == 0 ||
+          (bytes < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+        LOG_INFO("Doorbell controller %d is gone, reconnecting\n",
+                 controller_pid_);
+        Disconnect();
+      }
+    }
+    if (connection_fd_ < 0 && !StartConnect()) return;
+    if (event_fd_ < 0 && !ReceiveEventFd()) return;
+  } else if (event_fd_ < 0) {
+    return;
+  }
+  const uint64_t one = 1;
+  // Only fails once the counter is about to overflow, the controller is
+  // woken up anyway then
+  if (write(event_fd_, &one, sizeof(one)) < 0 && errno != EAGAIN)
+    LOG_WARNING_THROTTLED(1000, "Ringing the doorbell failed: %s\n",
+                          strerror(errno));
+}
+
+}  // namespace fan_controller
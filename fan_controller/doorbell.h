@@ -0,0 +1,88 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Doorbell lets sensor producers wake up the single threaded controller core
+// through an eventfd it can epoll on. The controller owns the eventfd and
+// hands a copy to every producer that connects to an abstract unix socket,
+// producers then write to it after each publish. Both sides keep the
+// connection open, so each notices when the other one goes away: the
+// controller stops counting the producer, the producer reconnects.
+// The socket lives in the abstract namespace, so nothing is left behind on
+// the file system when the controller goes away.
+namespace fan_controller {
+
+// Abstract unix socket name the eventfd is handed out on
+const std::string doorbell_socket_name = "FanControllerDoorbell";
+
+// Controller side
+class DoorbellServer {
+  int event_fd_ = -1;
+  int listen_fd_ = -1;
+  // epoll set of listen_fd_ and every producer connection
+  int producer_fd_ = -1;
+  std::vector<int> connections_;
+
+  void Accept();
+  void HangUp(int connection);
+
+ public:
+  DoorbellServer() = default;
+  ~DoorbellServer();
+  DoorbellServer(DoorbellServer const& copy) = delete;
+  DoorbellServer& operator=(DoorbellServer const& copy) = delete;
+
+  // Creates the eventfd and starts listening, returns false on failure
+  bool Open();
+
+  // Becomes readable when a producer rang
+  int event_fd() const { return event_fd_; }
+
+  // Becomes readable when producers connect or hang up
+  int producer_fd() const { return producer_fd_; }
+
+  // Hands the eventfd to every pending producer connection and forgets the
+  // producers that hung up
+  void ServiceProducers();
+
+  // Resets the eventfd and returns the number of rings since the last call
+  uint64_t Drain();
+
+  // Producers currently holding the eventfd
+  uint32_t producers() const { return connections_.size(); }
+};
+
+// Producer side. Connect waits for the controller once, Ring never blocks.
+// Without a controller listening Ring does nothing, it keeps looking for one
+// at most every RETRY_INTERVAL_NS. As often it checks that the controller it
+// connected to still runs, a restarted controller listens with a new eventfd.
+class Doorbell {
+  int connection_fd_ = -1;
+  int event_fd_ = -1;
+  int32_t controller_pid_ = 0;
+  uint64_t next_attempt_ns_ = 0;
+
+  bool StartConnect();
+  bool ReceiveEventFd();
+  void Disconnect();
+
+ public:
+  static const uint64_t RETRY_INTERVAL_NS = 100000000ull;
+  static const uint64_t CONNECT_TIMEOUT_NS = 100000000ull;
+
+  Doorbell() = default;
+  ~Doorbell();
+  Doorbell(Doorbell const& copy) = delete;
+  Doorbell& operator=(Doorbell const& copy) = delete;
+
+  // Connects to the controller, waiting up to timeout_ns for it to hand over
+  // the eventfd. Returns false if none is listening yet, Ring keeps trying.
+  bool Connect(uint64_t timeout_ns = CONNECT_TIMEOUT_NS);
+
+  // Wakes up the controller, call after the new values are visible
+  void Ring();
+};
+
+}  // namespace fan_controller
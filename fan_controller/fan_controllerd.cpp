@@ -0,0 +1,55 @@
+// Headless fan controller: the Controller and its shared memory, nothing
+// else. Configured from the command line or a config file, see
+// controller_options.h, it starts without prompts or sleeps and waits for
+// sensor producers to show up. The GUI is optional and attaches as a
+// separate process, fan_controller --attach with the same options.
+
+#include <signal.h>
+#include <sys/prctl.h>
+#include <unistd.h>
+#include "../logger/logger.h"
+#include "controller.h"
+#include "controller_options.h"
+#include "shard_ingest.h"
+
+using ::fan_controller::controller::ControllerOptions;
+
+namespace {
+
+// Messages each logging thread can queue, small to keep the daemon's
+// resident memory low
+const size_t LOG_RING_CAPACITY = 128;
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  ControllerOptions options;
+  if (!::fan_controller::controller::ParseControllerOptions(argc, argv,
+                                                            &options))
+    return -1;
+  ::fan_controller::logger::SetSeverity(options.log_severity_);
+  // Nobody watches the console, a stuck condition should not flood the log
+  ::fan_controller::logger::SetDuplicateSuppression(true);
+
+  // Shard ingest processes go away together with the daemon
+  for (uint32_t shard = 0; shard < options.config_.shard_count_; shard++) {
+    const pid_t pid = fork();
+    if (pid == 0) {
+      prctl(PR_SET_PDEATHSIG, SIGTERM);
+      ::fan_controller::logger::StartAsync(
+          ::fan_controller::logger::OverflowPolicy::DROP, LOG_RING_CAPACITY);
+      const bool started =
+          ::fan_controller::controller::StartShard(options.config_, shard);
+      ::fan_controller::logger::StopAsync();
+      _exit(started ? 0 : 1);
+    }
+  }
+
+  ::fan_controller::logger::StartAsync(
+      ::fan_controller::logger::OverflowPolicy::DROP, LOG_RING_CAPACITY);
+  const bool started =
+      ::fan_controller::controller::StartController(options.config_);
+  // Writes the messages explaining a failed start
+  ::fan_controller::logger::StopAsync();
+  return started ? 0 : -1;
+}
@@ -0,0 +1,173 @@
+#include "fan_curve.h"
+#include <algorithm>
+#include <cmath>
+#include <sstream>
+#include "../logger/logger.h"
+
+namespace fan_controller {
+namespace controller {
+
+constexpr float FanCurveEngine::TEMPERATURE_STEP;
+const uint32_t FanCurveEngine::DUTY_STEPS;
+const uint32_t FanCurveEngine::MAX_TEMPERATURE_ENTRIES;
+
+namespace {
+
+// Exact duty cycle of a curve at temperature
+double Interpolate(const std::vector<CurvePoint>& points, double temperature) {
+  if (temperature <= points.front().temperature_)
+    return points.front().duty_cycle_;
+  for (size_t i = 1; i < points.size(); i++) {
+    if (temperature <= points[i].temperature_) {
+      const CurvePoint& low = points[i - 1];
+      const CurvePoint& high = points[i];
+      return low.duty_cycle_ + (high.duty_cycle_ - low.duty_cycle_) *
+                                   (temperature - low.temperature_) /
+                                   (high.temperature_ - low.temperature_);
+    }
+  }
+  return points.back().duty_cycle_;
+}
+
+bool SameCurve(const std::vector<CurvePoint>& a,
+               const std::vector<CurvePoint>& b) {
+  if (a.size() != b.size()) return false;
+  for (size_t i = 0; i < a.size(); i++) {
+    if (a[i].temperature_ != b[i].temperature_ ||
+        a[i].duty_cycle_ != b[i].duty_cycle_)
+      return false;
+  }
+  return true;
+}
+
+}  // namespace
+
+std::vector<CurvePoint> FanCurveEngine::DefaultCurve() {
+  return {CurvePoint(TEMP_TWENTY_PERCENT_CUTOFF, 20.0f),
+          CurvePoint(TEMP_HUNDRED_PERCENT_CUTOFF, 100.0f)};
+}
+
+bool FanCurveEngine::IsValidCurve(const std::vector<CurvePoint>& curve) {
+  if (curve.empty()) return false;
+  for (size_t i = 0; i < curve.size(); i++) {
+    if (!std::isfinite(curve[i].temperature_) ||
+        !(curve[i].duty_cycle_ >= 0 && curve[i].duty_cycle_ <= 100))
+      return false;
+    if (i > 0 && !(curve[i].temperature_ > curve[i - 1].temperature_))
+      return false;
+  }
+  return true;
+}
+
+bool FanCurveEngine::ParseCurve(const std::string& text,
+                                std::vector<CurvePoint>* curve) {
+  std::istringstream in(text);
+  std::string item;
+  curve->clear();
+  while (std::getline(in, item, ',')) {
+    std::istringstream point(item);
+    float temperature, duty_cycle;
+    char colon;
+    if (!(point >> temperature >> colon >> duty_cycle) || colon != ':')
+      return false;
+    curve->push_back(CurvePoint(temperature, duty_cycle));
+  }
+  return IsValidCurve(*curve);
+}
+
+FanCurveEngine::CurveTable FanCurveEngine::Compile(
+    const std::vector<CurvePoint>& points) {
+  CurveTable table;
+  table.points_ = points;
+  table.first_temperature_ = points.front().temperature_;
+  const double span = points.back().temperature_ - points.front().temperature_;
+  double step = TEMPERATURE_STEP;
+  if (span / step + 1 > MAX_TEMPERATURE_ENTRIES)
+    step = span / (MAX_TEMPERATURE_ENTRIES - 1);
+  table.inverse_step_ = 1 / step;
+  const uint32_t entries = static_cast<uint32_t>(std::ceil(span / step)) + 1;
+  table.duty_steps_.resize(entries);
+  for (uint32_t i = 0; i < entries; i++) {
+    double duty = Interpolate(points, table.first_temperature_ + i * step);
+    // Round up, the small offset keeps exact values like 20.0 from creeping
+    // into the next step through float noise
+    double duty_step = std::ceil(duty * DUTY_STEPS / 100 - 1e-6);
+    table.duty_steps_[i] = static_cast<uint16_t>(
+        std::min<double>(std::max<double>(duty_step, 0), DUTY_STEPS));
+  }
+  return table;
+}
+
+uint16_t FanCurveEngine::CurveTable::Lookup(float temperature) const {
+  const float position = (temperature - first_temperature_) * inverse_step_;
+  // Also catches NaN, which fails every comparison
+  if (!(position < duty_steps_.size() - 1)) return duty_steps_.back();
+  if (position <= 0) return duty_steps_.front();
+  // Round towards the hotter entry
+  return duty_steps_[static_cast<uint32_t>(std::ceil(position))];
+}
+
+FanCurveEngine::FanCurveEngine(const InputConfiguration& config)
+    : fan_count_(config.fan_count_) {
+  // Deduplicate the curves so fans sharing one share its table
+  fan_curve_.resize(fan_count_);
+  for (uint32_t fan = 0; fan < fan_count_; fan++) {
+    std::vector<CurvePoint> points =
+        config.fan_curves_.empty()
+            ? DefaultCurve()
+            : config.fan_curves_[config.fan_curves_.size() == 1 ? 0 : fan];
+    if (!IsValidCurve(points)) {
+      LOG_ERROR("Invalid fan curve for fan %d, using the default curve\n",
+                fan);
+      points = DefaultCurve();
+    }
+    uint32_t index = 0;
+    while (index < curves_.size() && !SameCurve(curves_[index].points_, points))
+      index++;
+    if (index == curves_.size()) curves_.push_back(Compile(points));
+    fan_curve_[fan] = index;
+  }
+  curve_duty_.resize(curves_.size());
+
+  pwm_table_.resize((DUTY_STEPS + 1) * fan_count_);
+  for (uint32_t duty_step = 0; duty_step <= DUTY_STEPS; duty_step++) {
+    for (uint32_t fan = 0; fan < fan_count_; fan++) {
+      pwm_table_[duty_step * fan_count_ + fan] = static_cast<u_int32_t>(
+          std::ceil(static_cast<double>(duty_step) / DUTY_STEPS *
+                    config.max_pwm_values[fan]));
+    }
+  }
+}
+
+float FanCurveEngine::Calculate(float temperature, u_int32_t* registers) {
+  for (size_t i = 0; i < curves_.size(); i++)
+    curve_duty_[i] = curves_[i].Lookup(temperature);
+
+  if (curves_.size() == 1) {
+    // Every fan on the same curve, the registers are one row of the table
+    const u_int32_t* row = &pwm_table_[curve_duty_[0] * fan_count_];
+    std::copy(row, row + fan_count_, registers);
+  } else {
+    for (uint32_t fan = 0; fan < fan_count_; fan++)
+      registers[fan] =
+          pwm_table_[curve_duty_[fan_curve_[fan]] * fan_count_ + fan];
+  }
+  return curve_duty_[fan_curve_.empty() ? 0 : fan_curve_[0]] * 100.0f /
+         DUTY_STEPS;
+}
+
+float FanCurveEngine::CalculateFans(float temperature, const uint32_t* fans,
+                                    uint32_t count,
+                                    u_int32_t* registers) const {
+  uint16_t first_duty = 0;
+  for (uint32_t i = 0; i < count; i++) {
+    const uint32_t fan = fans[i];
+    const uint16_t duty = curves_[fan_curve_[fan]].Lookup(temperature);
+    if (i == 0) first_duty = duty;
+    registers[fan] = pwm_table_[duty * fan_count_ + fan];
+  }
+  return first_duty * 100.0f / DUTY_STEPS;
+}
+
+}  // namespace controller
+}  // namespace fan_controller
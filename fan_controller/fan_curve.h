@@ -0,0 +1,83 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "common.h"
+
+// FanCurveEngine turns the max temperature into PWM counts for every fan with
+// table lookups only. At start up every distinct fan curve is compiled into a
+// quantized temperature -> duty cycle table and every fan gets a duty cycle
+// -> PWM count table derived from its max_pwm_values entry.
+// The duty -> PWM tables are stored duty major, so when all fans share a
+// curve the registers are a single row copy, otherwise one gather per fan.
+// Quantization always rounds towards the hotter temperature and the higher
+// duty cycle, so a fan never runs slower than the exact curve asks for.
+namespace fan_controller {
+namespace controller {
+
+class FanCurveEngine {
+ public:
+  // Temperature resolution of the temperature -> duty tables in degree
+  static constexpr float TEMPERATURE_STEP = 0.01f;
+
+  // Duty cycle resolution, steps per 100 %
+  static const uint32_t DUTY_STEPS = 1000;
+
+  // Largest temperature table, wider curves get a coarser step
+  static const uint32_t MAX_TEMPERATURE_ENTRIES = 1 << 16;
+
+  FanCurveEngine(const InputConfiguration& config);
+
+  // Writes the PWM counts of every fan for temperature to registers and
+  // returns the duty cycle of fan 0 in percent. NaN temperatures are treated
+  // as hotter than any curve point.
+  float Calculate(float temperature, u_int32_t* registers);
+
+  // Calculate for the count fans listed in fans only, registers is indexed by
+  // fan like above and entries of other fans are left alone. Returns the duty
+  // cycle of fans[0]. Does not touch any state, so several threads may run
+  // it for disjoint fan lists at once.
+  float CalculateFans(float temperature, const uint32_t* fans, uint32_t count,
+                      u_int32_t* registers) const;
+
+  // 20% at or below 25°, 100% at or above 75°, linear in between
+  static std::vector<CurvePoint> DefaultCurve();
+
+  // Parses "temperature:duty,temperature:duty,..." and validates the result
+  static bool ParseCurve(const std::string& text,
+                         std::vector<CurvePoint>* curve);
+
+  // At least one point, strictly increasing temperatures, duty in [0, 100]
+  static bool IsValidCurve(const std::vector<CurvePoint>& curve);
+
+ private:
+  // Compiled form of one distinct curve
+  struct CurveTable {
+    std::vector<CurvePoint> points_;
+    float first_temperature_;
+    float inverse_step_;
+    // Duty cycle in 1 / DUTY_STEPS units per temperature step
+    std::vector<uint16_t> duty_steps_;
+
+    // Duty step for temperature
+    uint16_t Lookup(float temperature) const;
+  };
+
+  static CurveTable Compile(const std::vector<CurvePoint>& points);
+
+  const uint32_t fan_count_;
+
+  // Distinct curves and the curve of each fan
+  std::vector<CurveTable> curves_;
+  std::vector<uint32_t> fan_curve_;
+
+  // PWM counts, pwm_table_[duty_step * fan_count_ + fan]
+  std::vector<u_int32_t> pwm_table_;
+
+  // Scratch, duty step per distinct curve
+  std::vector<uint16_t> curve_duty_;
+};
+
+}  // namespace controller
+}  // namespace fan_controller
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include <atomic>
+#include <climits>
+#include <cstdint>
+
+// Thin wrappers around the linux futex syscall. The futex words live in
+// shared memory between GUI and controller, so the process private flag must
+// not be used here.
+namespace fan_controller {
+
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t),
+              "futex word must be a plain 32 bit integer");
+
+// Blocks while *word == expected. Returns early on a wake, a signal or when
+// timeout (relative, may be nullptr) expires.
+inline void FutexWait(std::atomic<uint32_t>* word, uint32_t expected,
+                      const timespec* timeout = nullptr) {
+  syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAIT, expected,
+          timeout, nullptr, 0);
+}
+
+// Wakes up to count waiters blocked on word
+inline void FutexWake(std::atomic<uint32_t>* word, int count = INT_MAX) {
+  syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAKE, count,
+          nullptr, nullptr, 0);
+}
+
+}  // namespace fan_controller
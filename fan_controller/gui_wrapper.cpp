@@ -19,6 +19,9 @@
 #include "../imgui/backends/imgui_impl_sdl.h"
 #include "../imgui/imgui.h"
 #include "../logger/logger.h"
+#include "sample_ring.h"
+#include "sensor_slots.h"
+#include "shared_segment.h"
 #if defined(IMGUI_IMPL_OPENGL_ES2)
 #include <SDL_opengles2.h>
 #else
@@ -30,7 +33,15 @@ namespace gui {
 
 GUIWrapper::GUIWrapper(const InputConfiguration config) : config_(config) {
   sensor_values_.resize(config.sensor_count_);
-  for (auto i : config_.max_pwm_values) registers_.push_back(i);
+  displayed_sensor_values_.resize(config.sensor_count_,
+                                  TEMP_HUNDRED_PERCENT_CUTOFF);
+  sensor_history_.resize(config.sensor_count_,
+                         ValueHistory(TEMP_HUNDRED_PERCENT_CUTOFF));
+  edited_sensor_ids_.reserve(config.sensor_count_);
+  for (auto i : config_.max_pwm_values) {
+    registers_.push_back(i);
+    register_history_.push_back(ValueHistory(i));
+  }
 }
 
 GUIWrapper &GUIWrapper::GetInstance(const InputConfiguration config) {
@@ -98,6 +109,8 @@ bool GUIWrapper::InitGUI() {
   // Setup Platform/Renderer backends
   ImGui_ImplSDL2_InitForOpenGL(window_, gl_context_);
   ImGui_ImplOpenGL3_Init(glsl_version);
+
+  register_event_type_ = SDL_RegisterEvents(1);
   return true;
 }
 
@@ -114,6 +127,7 @@ void GUIWrapper::StopGui() {
 
 void GUIWrapper::ShowOutputWindow() {
   if (show_output_window_) {
+    ImGui::SetNextWindowSize(ImVec2(400, 400), ImGuiCond_FirstUseEver);
     ImGui::Begin(
         "Output Window",
         &show_output_window_);  // Pass a pointer to our bool variable (the
@@ -121,114 +135,344 @@ void GUIWrapper::ShowOutputWindow() {
                                 // clear the bool when clicked)
     ImGui::Text("Registers");
     ImGui::NewLine();
-    ImGui::NewLine();
     UpdateRegisterValues();
     ImGui::End();
   }
 }
 
 void GUIWrapper::SendSensorValues() {
-  struct shm_remove {
-    shm_remove() { shared_memory_object::remove(sensor_memory_name.c_str()); }
-    ~shm_remove() { shared_memory_object::remove(sensor_memory_name.c_str()); }
-  } remover;
-  // Create a shared memory object.
-  shared_memory_object shm(open_or_create  // only create
-                           ,
-                           sensor_memory_name.c_str()  // name
-                           ,
-                           read_write  // read-write mode
-  );
-  shm.truncate(sizeof(sensor_shared_memory_buffer));
-  // Map the whole shared memory in this process
-  mapped_region region(shm, read_write);
-  // Get the address of the mapped region
-  void *addr = region.get_address();
-  // Construct the shared structure in memory
-  sensor_shared_memory_buffer *data = new (addr) sensor_shared_memory_buffer;
+  // Waits for an event loop controller once here, so sending never does
+  doorbell_.Connect();
+  switch (config_.transport_) {
+    case SensorTransport::SEQLOCK:
+      SendSensorValuesSeqlock();
+      break;
+    case SensorTransport::RING:
+      SendSensorValuesRing();
+      break;
+    case SensorTransport::SLOTS:
+      SendSensorValuesSlots();
+      break;
+    case SensorTransport::SEMAPHORE:
+    default:
+      SendSensorValuesSemaphore();
+      break;
+  }
+}
+
+void GUIWrapper::SendSensorValuesSemaphore() {
+  // Take over the sensor memory of a previous GUI, the controller keeps
+  // reading it. A GUI dying while it held data->mutex is not recovered.
+  mapped_region region;
+  bool reused;
+  if (!OwnSegment(sensor_memory_name,
+                  sensor_shared_memory_buffer::Size(config_.sensor_count_),
+                  config_.sensor_count_, &region, &reused))
+    return;
+  sensor_shared_memory_buffer *data =
+      reused ? static_cast<sensor_shared_memory_buffer *>(region.get_address())
+             : new (region.get_address())
+                   sensor_shared_memory_buffer(config_.sensor_count_);
+  data->header.MarkReady();
+  float *shared_values = data->values();
 
   // Send data to controller if sensor has changed
   while (!done_) {
     {
       boost::mutex::scoped_lock scoped_lock(new_sensor_data_mutex_);
-      while (changed_sensor_ids_.empty())
-        new_sensor_data_cond_.wait(scoped_lock);
+      WaitForSensorEdits(scoped_lock, &data->header);
       data->mutex.wait();
       for (auto id : changed_sensor_ids_) {
-        data->sensors[id].value_ = sensor_values_[id].value_;
+        shared_values[id] = sensor_values_[id].value_;
         LOG_INFO("Sending %d: %f", id, sensor_values_[id].value_);
       }
       data->mutex.post();
       data->nstored.post();
       changed_sensor_ids_.clear();
     }
+    doorbell_.Ring();
   }
 }
 
-void GUIWrapper::CheckSensorUpdates() {
-  {
+void GUIWrapper::SendSensorValuesSeqlock() {
+  mapped_region region;
+  bool reused;
+  if (!OwnSegment(sensor_seqlock_memory_name,
+                  sensor_seqlock_buffer::Size(config_.sensor_count_),
+                  config_.sensor_count_, &region, &reused))
+    return;
+  sensor_seqlock_buffer *data;
+  if (reused) {
+    data = static_cast<sensor_seqlock_buffer *>(region.get_address());
+    data->RecoverWriter();
+  } else {
+    data = new (region.get_address())
+        sensor_seqlock_buffer(config_.sensor_count_);
+  }
+  data->header.MarkReady();
+  float *shared_values = data->values();
+
+  // Publish changes without waiting for the controller to pick them up
+  while (!done_) {
     boost::mutex::scoped_lock scoped_lock(new_sensor_data_mutex_);
-    for (uint32_t i = 0; i < config_.sensor_count_; i++) {
-      std::string sensor_name = "Sensor " + std::to_string(i);
-      float new_temp = sensor_values_[i].value_;
-      // static float new_temp1 = 0.001f;
-      ImGui::InputFloat(sensor_name.c_str(), &new_temp, 0.1f, 2.0f, "%.3f");
+    WaitForSensorEdits(scoped_lock, &data->header);
+    data->BeginWrite();
+    for (auto id : changed_sensor_ids_)
+      shared_values[id] = sensor_values_[id].value_;
+    data->EndWrite();
+    doorbell_.Ring();
+    for (auto id : changed_sensor_ids_)
+      LOG_INFO("Sending %d: %f", id, sensor_values_[id].value_);
+    changed_sensor_ids_.clear();
+  }
+}
+
+void GUIWrapper::SendSensorValuesRing() {
+  // Samples still queued by a previous GUI are delivered
+  mapped_region region;
+  bool reused;
+  if (!OwnSegment(sensor_samples_memory_name, sizeof(sensor_sample_ring),
+                  SAMPLE_RING_CAPACITY, &region, &reused))
+    return;
+  sensor_sample_ring *ring =
+      reused ? static_cast<sensor_sample_ring *>(region.get_address())
+             : new (region.get_address()) sensor_sample_ring;
+  ring->header.MarkReady();
+
+  // Every change becomes a timestamped sample, nothing is overwritten
+  std::vector<SensorSample> batch;
+  while (!done_) {
+    {
+      boost::mutex::scoped_lock scoped_lock(new_sensor_data_mutex_);
+      WaitForSensorEdits(scoped_lock, &ring->header);
+      uint64_t now = MonotonicNowNs();
+      for (auto id : changed_sensor_ids_)
+        batch.push_back(SensorSample(id, sensor_values_[id].value_, now));
+      changed_sensor_ids_.clear();
+    }
+    if (ring->Push(batch.data(), batch.size()) != batch.size())
+      LOG_WARNING_THROTTLED(1000, "Sample ring full, dropped samples\n");
+    doorbell_.Ring();
+    for (auto &sample : batch)
+      LOG_INFO("Sending %d: %f", sample.sensor_id_, sample.value_);
+    batch.clear();
+  }
+}
+
+void GUIWrapper::SendSensorValuesSlots() {
+  mapped_region region;
+  bool reused;
+  if (!OwnSegment(sensor_slots_memory_name,
+                  sensor_slot_buffer::Size(config_.sensor_count_,
+                                           config_.subsystem_count_),
+                  config_.sensor_count_, &region, &reused))
+    return;
+  sensor_slot_buffer *data;
+  if (reused) {
+    data = static_cast<sensor_slot_buffer *>(region.get_address());
+    data->RecoverWriter();
+  } else {
+    data = new (region.get_address())
+        sensor_slot_buffer(config_.sensor_count_, config_.subsystem_count_);
+  }
+  data->header.MarkReady();
 
+  // The GUI stands in for every subsystem, each touched slot is published
+  // on its own
+  std::vector<bool> slot_open(config_.subsystem_count_, false);
+  std::vector<uint32_t> touched_slots;
+  while (!done_) {
+    {
+      boost::mutex::scoped_lock scoped_lock(new_sensor_data_mutex_);
+      WaitForSensorEdits(scoped_lock, &data->header);
+      for (auto id : changed_sensor_ids_) {
+        const uint32_t slot = data->SlotOf(id);
+        if (!slot_open[slot]) {
+          data->BeginWrite(slot);
+          slot_open[slot] = true;
+          touched_slots.push_back(slot);
+        }
+        data->SlotValues(slot)[id - data->Slot(slot)->first_sensor] =
+            sensor_values_[id].value_;
+        LOG_INFO("Sending %d: %f", id, sensor_values_[id].value_);
+      }
+      changed_sensor_ids_.clear();
+    }
+    for (auto slot : touched_slots) {
+      data->EndWrite(slot);
+      slot_open[slot] = false;
+    }
+    touched_slots.clear();
+    doorbell_.Ring();
+  }
+}
+
+void GUIWrapper::WaitForSensorEdits(boost::mutex::scoped_lock &lock,
+                                    shared_segment_header *header) {
+  while (changed_sensor_ids_.empty()) {
+    header->Beat(MonotonicNowNs());
+    new_sensor_data_cond_.timed_wait(
+        lock,
+        boost::posix_time::microseconds(SEGMENT_HEARTBEAT_INTERVAL_NS / 1000));
+  }
+}
+
+void GUIWrapper::CheckSensorUpdates() {
+  // Only the visible rows are laid out, the table scrolls within the window
+  if (!ImGui::BeginTable("Sensors", 3,
+                         ImGuiTableFlags_ScrollY | ImGuiTableFlags_RowBg |
+                             ImGuiTableFlags_BordersOuter))
+    return;
+  ImGui::TableSetupScrollFreeze(0, 1);
+  ImGui::TableSetupColumn("Sensor", ImGuiTableColumnFlags_WidthFixed);
+  ImGui::TableSetupColumn("Temperature", ImGuiTableColumnFlags_WidthFixed,
+                          ImGui::GetFontSize() * 12);
+  ImGui::TableSetupColumn("History", ImGuiTableColumnFlags_WidthStretch);
+  ImGui::TableHeadersRow();
+  ImGuiListClipper clipper;
+  clipper.Begin(config_.sensor_count_);
+  while (clipper.Step()) {
+    for (int i = clipper.DisplayStart; i < clipper.DisplayEnd; i++) {
+      // Widgets are told apart by the ID stack, labels need no formatting
+      ImGui::PushID(i);
+      ImGui::TableNextRow();
+      ImGui::TableNextColumn();
+      ImGui::Text("Sensor %d", i);
+      ImGui::TableNextColumn();
+      float new_temp = displayed_sensor_values_[i];
+      ImGui::SetNextItemWidth(-FLT_MIN);
+      ImGui::InputFloat("##value", &new_temp, 0.1f, 2.0f, "%.3f");
+      ImGui::TableNextColumn();
       if (std::isinf(new_temp)) {
         ImGui::Text("PLEASE ENTER A VALID NUMBER");
-      } else if (new_temp != sensor_values_[i].value_) {
-        Sensor sensor(i, new_temp);
-        sensor_values_[i].value_ = new_temp;
-        changed_sensor_ids_.push_back(i);
+      } else {
+        if (new_temp != displayed_sensor_values_[i]) {
+          displayed_sensor_values_[i] = new_temp;
+          sensor_history_[i].Add(new_temp);
+          edited_sensor_ids_.push_back(i);
+        }
+        const ValueHistory& history = sensor_history_[i];
+        ImGui::PlotLines("##history", history.values, ValueHistory::LENGTH,
+                         history.next, nullptr, FLT_MAX, FLT_MAX,
+                         ImVec2(-FLT_MIN, ImGui::GetFrameHeight()));
       }
+      ImGui::PopID();
+    }
+  }
+  ImGui::EndTable();
+
+  // The sender threads only wait for the edits of this frame
+  if (edited_sensor_ids_.empty()) return;
+  {
+    boost::mutex::scoped_lock scoped_lock(new_sensor_data_mutex_);
+    for (auto id : edited_sensor_ids_) {
+      sensor_values_[id].value_ = displayed_sensor_values_[id];
+      changed_sensor_ids_.push_back(id);
     }
-    if (!changed_sensor_ids_.empty()) new_sensor_data_cond_.notify_one();
   }
+  new_sensor_data_cond_.notify_one();
+  edited_sensor_ids_.clear();
 }
 
 void GUIWrapper::ReceiveRegisterValues() {
-  // We need a small delayto make sre we are opening this shared memory after
-  // controller has created it
-  sleep(1);
-  // Open the shared memory object.
-  shared_memory_object shm(open_only  // only create
-                           ,
-                           register_memory_name.c_str()  // name
-                           ,
-                           read_write  // read-write mode
-  );
-  // Map the whole shared memory in this process
-  mapped_region region(shm  // What to map
-                       ,
-                       read_write  // Map it as read-write
-  );
-  // Get the address of the mapped region
-  void *addr = region.get_address();
-  // Obtain the shared structure
+  // Attach as soon as the controller marked the register memory ready
+  mapped_region region;
+  if (!AttachSegment(register_memory_name, config_.fan_count_, ATTACH_FOREVER,
+                     &region))
+    return;
   register_shared_memory_buffer *data =
-      static_cast<register_shared_memory_buffer *>(addr);
+      static_cast<register_shared_memory_buffer *>(region.get_address());
+  // Latest value mailbox, the controller never waits for us
+  std::vector<u_int32_t> received(config_.fan_count_);
+  uint32_t generation = 0;
+  uint64_t missed_generations = 0;
   while (true) {
-    // Read the register values
-    data->nstored.wait();
-    data->mutex.wait();
+    if (!data->WaitForGeneration(generation, SEGMENT_HEARTBEAT_INTERVAL_NS)) {
+      if (data->header.OwnerAlive()) continue;
+      // A restarted controller usually takes the memory over, otherwise it
+      // creates a new one. Either way wait for it to be ready.
+      LOG_WARNING("Controller stopped, waiting for it to come back\n");
+      if (!AttachSegment(register_memory_name, config_.fan_count_,
+                         ATTACH_FOREVER, &region))
+        return;
+      data = static_cast<register_shared_memory_buffer *>(region.get_address());
+      generation = 0;
+      continue;
+    }
+    const uint32_t latest = data->Read(received.data());
+    // Generations before we attached do not count as missed
+    if (generation != 0 && latest - generation > 1) {
+      missed_generations += latest - generation - 1;
+      LOG_INFO_THROTTLED(1000, "GUI skipped %lu register generations so far\n",
+                         missed_generations);
+    }
+    generation = latest;
     {
       boost::mutex::scoped_lock scoped_lock(received_register_data_mutex_);
       for (uint32_t i = 0; i < config_.fan_count_; i++) {
-        if (data->registers[i] != registers_[i]) {
-          registers_[i] = data->registers[i];
-          LOG_INFO("Received register values %d:%f\n", i, registers_[i]);
+        if (received[i] != registers_[i]) {
+          registers_[i] = received[i];
+          register_history_[i].Add(received[i]);
+          LOG_INFO("Received register values %d:%d\n", i, registers_[i]);
         }
       }
     }
-    data->mutex.post();
-    data->nempty.post();
+    // Wake up an idle GUI, one queued event covers any number of generations
+    if (!register_event_pending_.exchange(true)) {
+      SDL_Event event = {};
+      event.type = register_event_type_;
+      if (SDL_PushEvent(&event) != 1) register_event_pending_ = false;
+    }
   }
 }
 
 void GUIWrapper::UpdateRegisterValues() {
+  if (!ImGui::BeginTable("Registers", 3,
+                         ImGuiTableFlags_ScrollY | ImGuiTableFlags_RowBg |
+                             ImGuiTableFlags_BordersOuter))
+    return;
+  ImGui::TableSetupScrollFreeze(0, 1);
+  ImGui::TableSetupColumn("Register", ImGuiTableColumnFlags_WidthFixed);
+  ImGui::TableSetupColumn("PWM", ImGuiTableColumnFlags_WidthFixed,
+                          ImGui::GetFontSize() * 6);
+  ImGui::TableSetupColumn("History", ImGuiTableColumnFlags_WidthStretch);
+  ImGui::TableHeadersRow();
+  ImGuiListClipper clipper;
+  clipper.Begin(config_.fan_count_);
+  // Held for the visible rows only, the register thread just copies values
   boost::mutex::scoped_lock scoped_lock(received_register_data_mutex_);
-  for (uint32_t i = 0; i < config_.fan_count_; i++) {
-    ImGui::Text("Register %d = %d", i, registers_[i]);
+  while (clipper.Step()) {
+    for (int i = clipper.DisplayStart; i < clipper.DisplayEnd; i++) {
+      ImGui::PushID(i);
+      ImGui::TableNextRow();
+      ImGui::TableNextColumn();
+      ImGui::Text("Register %d", i);
+      ImGui::TableNextColumn();
+      ImGui::Text("%u", registers_[i]);
+      ImGui::TableNextColumn();
+      const ValueHistory& history = register_history_[i];
+      ImGui::PlotLines("##history", history.values, ValueHistory::LENGTH,
+                       history.next, nullptr, 0, config_.max_pwm_values[i],
+                       ImVec2(-FLT_MIN, ImGui::GetTextLineHeight()));
+      ImGui::PopID();
+    }
+  }
+  scoped_lock.unlock();
+  ImGui::EndTable();
+}
+
+void GUIWrapper::ProcessEvent(const SDL_Event &event) {
+  if (event.type == register_event_type_) {
+    register_event_pending_ = false;
+    return;
+  }
+  ImGui_ImplSDL2_ProcessEvent(&event);
+  if (event.type == SDL_QUIT) done_ = true;
+  if (event.type == SDL_WINDOWEVENT &&
+      event.window.event == SDL_WINDOWEVENT_CLOSE &&
+      event.window.windowID == SDL_GetWindowID(window_)) {
+    LOG_INFO("Closing the app.\n");
+    done_ = true;
   }
 }
 
@@ -255,7 +499,19 @@ bool GUIWrapper::StartGui() {
   ImGuiIO &io = ImGui::GetIO();
   (void)io;
 
+  int settle_frames = SETTLE_FRAMES;
   while (!done_) {
+    // Nothing changes on screen without an event, sleep until one arrives.
+    // Register updates come in as register_event_type_ events.
+    SDL_Event event;
+    if (settle_frames == 0) {
+      if (SDL_WaitEventTimeout(&event, IDLE_REDRAW_MS)) {
+        ProcessEvent(event);
+        settle_frames = SETTLE_FRAMES;
+      }
+    } else {
+      settle_frames--;
+    }
     // Poll and handle events (inputs, window resize, etc.)
     // You can read the io.WantCaptureMouse, io.WantCaptureKeyboard flags to
     // tell if dear imgui wants to use your inputs.
@@ -265,16 +521,9 @@ bool GUIWrapper::StartGui() {
     // data to your main application, or clear/overwrite your copy of the
     // keyboard data. Generally you may always pass all inputs to dear imgui,
     // and hide them from your application based on those two flags.
-    SDL_Event event;
     while (SDL_PollEvent(&event)) {
-      ImGui_ImplSDL2_ProcessEvent(&event);
-      if (event.type == SDL_QUIT) done_ = true;
-      if (event.type == SDL_WINDOWEVENT &&
-          event.window.event == SDL_WINDOWEVENT_CLOSE &&
-          event.window.windowID == SDL_GetWindowID(window_)) {
-        LOG_INFO("Closing the app.\n");
-        done_ = true;
-      }
+      ProcessEvent(event);
+      settle_frames = SETTLE_FRAMES;
     }
 
     // Start the Dear ImGui frame
@@ -287,6 +536,7 @@ bool GUIWrapper::StartGui() {
 
     // 2. Show a simple window that we create ourselves. We use a Begin/End pair
     // to created a named window.
+    ImGui::SetNextWindowSize(ImVec2(560, 600), ImGuiCond_FirstUseEver);
     ImGui::Begin("Sensor Inputs");  // Create a window
                                     // and append into it.
 
@@ -297,11 +547,6 @@ bool GUIWrapper::StartGui() {
 
     // Lets Check if sensors have something new to report
     CheckSensorUpdates();
-
-    ImGui::NewLine();
-    ImGui::NewLine();
-    ImGui::NewLine();
-    ImGui::SameLine();
     ImGui::End();
 
     // Show output window.
@@ -315,6 +560,8 @@ bool GUIWrapper::StartGui() {
     glClear(GL_COLOR_BUFFER_BIT);
     ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
     SDL_GL_SwapWindow(window_);
+    // Keep drawing while a widget is held, e.g. a +/- button repeating
+    if (ImGui::IsAnyItemActive()) settle_frames = SETTLE_FRAMES;
   }
   sensor_thread->interrupt();
   register_thread->interrupt();
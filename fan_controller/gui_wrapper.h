@@ -1,12 +1,14 @@
 #pragma once
 
 #include <SDL.h>
+#include <atomic>
 #include <boost/thread/condition.hpp>
 #include <boost/thread/mutex.hpp>
 #include <memory>
 #include <mutex>
 #include <vector>
 #include "common.h"
+#include "doorbell.h"
 
 // GUIWrapper created the GUI screen keeps checking for any updates on Sensor
 // vaues and receves and update register values
@@ -17,6 +19,23 @@
 namespace fan_controller {
 namespace gui {
 
+// Latest values of one sensor or fan for its sparkline, a fixed ring so
+// adding a value never allocates
+struct ValueHistory {
+  static const int LENGTH = 64;
+  float values[LENGTH];
+  // Index of the oldest value
+  int next = 0;
+
+  explicit ValueHistory(float value = 0) {
+    for (int i = 0; i < LENGTH; i++) values[i] = value;
+  }
+  void Add(float value) {
+    values[next] = value;
+    next = (next + 1) % LENGTH;
+  }
+};
+
 class GUIWrapper {
   // Configuration stays constant once initialized
   const InputConfiguration config_;
@@ -24,8 +43,25 @@ class GUIWrapper {
   // Latest set temperature values from GUI in degree celcius
   std::vector<Sensor> sensor_values_;
 
-  // Last received FAN PWM counts from controller
+  // Sensor values as shown and edited on screen. Only the GUI thread touches
+  // them, edits are copied to sensor_values_ under new_sensor_data_mutex_.
+  std::vector<float> displayed_sensor_values_;
+
+  // Sensors edited in the current frame, GUI thread only
+  std::vector<int> edited_sensor_ids_;
+
+  // Values set per sensor, GUI thread only
+  std::vector<ValueHistory> sensor_history_;
+
+  // Last received FAN PWM counts from controller and their history, guarded
+  // by received_register_data_mutex_
   std::vector<u_int32_t> registers_;
+  std::vector<ValueHistory> register_history_;
+
+  // SDL event type pushed when a new register generation arrived, so an
+  // idle GUI redraws. Only one is queued at a time.
+  Uint32 register_event_type_ = 0;
+  std::atomic<bool> register_event_pending_{false};
 
   // Refer to imgui documention to to know more on windows
   SDL_Window* window_;
@@ -49,15 +85,27 @@ class GUIWrapper {
   // Use a conditional variable to signal send to controller
   boost::condition_variable new_sensor_data_cond_;
 
+  // Wakes up the controller when it runs the event loop core
+  Doorbell doorbell_;
+
   // Flag to denote if we need to exit
   bool done_ = false;
 
+  // Without input or new registers the GUI sleeps in SDL_WaitEventTimeout
+  // and only redraws every IDLE_REDRAW_MS. After an event it keeps drawing
+  // for SETTLE_FRAMES frames, ImGui needs a few to finish reacting to input.
+  static const int IDLE_REDRAW_MS = 1000;
+  static const int SETTLE_FRAMES = 3;
+
   // Private Constructor
   GUIWrapper(const InputConfiguration config);
 
   // Set up all SDL for GUI- Return true on success
   bool InitGUI();
 
+  // Hands event to ImGui and handles quitting and register updates
+  void ProcessEvent(const SDL_Event& event);
+
   // Show window with Register outputs
   void ShowOutputWindow();
 
@@ -70,6 +118,23 @@ class GUIWrapper {
   // Display latest received register values on screen
   void UpdateRegisterValues();
 
+  // Waits under lock until sensors were edited, refreshing the heartbeat of
+  // the sensor memory meanwhile
+  void WaitForSensorEdits(boost::mutex::scoped_lock& lock,
+                          shared_segment_header* header);
+
+  // SendSensorValues implementation for SensorTransport::SEMAPHORE
+  void SendSensorValuesSemaphore();
+
+  // SendSensorValues implementation for SensorTransport::SEQLOCK
+  void SendSensorValuesSeqlock();
+
+  // SendSensorValues implementation for SensorTransport::RING
+  void SendSensorValuesRing();
+
+  // SendSensorValues implementation for SensorTransport::SLOTS
+  void SendSensorValuesSlots();
+
  public:
   GUIWrapper(GUIWrapper const& copy) = delete;             // Not Implemented
   GUIWrapper& operator=(GUIWrapper const& copy) = delete;  // Not Implemented
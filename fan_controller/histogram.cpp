@@ -0,0 +1,66 @@
+#include "histogram.h"
+#include <algorithm>
+
+namespace fan_controller {
+
+Histogram::Histogram() : buckets_(BUCKET_COUNT, 0) {}
+
+uint32_t Histogram::BucketIndex(uint64_t value) {
+  // Small values are stored exactly
+  if (value < SUB_BUCKET_COUNT) return value;
+  const uint32_t highest_bit = 63 - __builtin_clzll(value);
+  const uint32_t shift = highest_bit - SUB_BUCKET_BITS;
+  // Drop the highest bit, it is implied by the shift
+  const uint32_t sub_bucket = (value >> shift) - SUB_BUCKET_COUNT;
+  return SUB_BUCKET_COUNT + shift * SUB_BUCKET_COUNT + sub_bucket;
+}
+
+uint64_t Histogram::BucketUpperBound(uint32_t index) {
+  if (index < SUB_BUCKET_COUNT) return index;
+  const uint32_t shift = (index - SUB_BUCKET_COUNT) / SUB_BUCKET_COUNT;
+  const uint64_t sub_bucket = (index - SUB_BUCKET_COUNT) % SUB_BUCKET_COUNT;
+  const uint64_t lower = (SUB_BUCKET_COUNT + sub_bucket) << shift;
+  return lower + ((1ull << shift) - 1);
+}
+
+void Histogram::Record(uint64_t value, uint64_t count) {
+  buckets_[BucketIndex(value)] += count;
+  count_ += count;
+  sum_ += static_cast<double>(value) * count;
+  min_ = std::min(min_, value);
+  max_ = std::max(max_, value);
+}
+
+void Histogram::Merge(const Histogram& other) {
+  for (uint32_t i = 0; i < BUCKET_COUNT; i++) buckets_[i] += other.buckets_[i];
+  count_ += other.count_;
+  sum_ += other.sum_;
+  min_ = std::min(min_, other.min_);
+  max_ = std::max(max_, other.max_);
+}
+
+void Histogram::Reset() {
+  std::fill(buckets_.begin(), buckets_.end(), 0);
+  count_ = 0;
+  min_ = UINT64_MAX;
+  max_ = 0;
+  sum_ = 0;
+}
+
+double Histogram::Mean() const { return count_ == 0 ? 0 : sum_ / count_; }
+
+uint64_t Histogram::ValueAtPercentile(double percentile) const {
+  if (count_ == 0) return 0;
+  percentile = std::min(std::max(percentile, 0.0), 100.0);
+  // Rank of the value we are looking for, at least the first one
+  uint64_t rank = static_cast<uint64_t>(percentile / 100 * count_ + 0.5);
+  rank = std::max<uint64_t>(rank, 1);
+  uint64_t seen = 0;
+  for (uint32_t i = 0; i < BUCKET_COUNT; i++) {
+    seen += buckets_[i];
+    if (seen >= rank) return std::min(BucketUpperBound(i), max_);
+  }
+  return max_;
+}
+
+}  // namespace fan_controller
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+// Log linear histogram in the spirit of HdrHistogram. Values are grouped by
+// their highest set bit and then split into SUB_BUCKET_COUNT linear sub
+// buckets, which keeps the relative error below 1/SUB_BUCKET_COUNT over the
+// whole uint64_t range with a fixed size table.
+// Recording is a couple of shifts and an increment, no allocation.
+// Not thread safe, give every thread its own and Merge them.
+namespace fan_controller {
+
+class Histogram {
+ public:
+  static const uint32_t SUB_BUCKET_BITS = 6;
+  static const uint32_t SUB_BUCKET_COUNT = 1u << SUB_BUCKET_BITS;
+  static const uint32_t BUCKET_COUNT =
+      SUB_BUCKET_COUNT * (64 - SUB_BUCKET_BITS + 1);
+
+  Histogram();
+
+  // Adds count occurrences of value
+  void Record(uint64_t value, uint64_t count = 1);
+
+  // Adds all values recorded in other
+  void Merge(const Histogram& other);
+
+  void Reset();
+
+  uint64_t Count() const { return count_; }
+  uint64_t Min() const { return count_ == 0 ? 0 : min_; }
+  uint64_t Max() const { return max_; }
+  double Mean() const;
+
+  // Smallest recorded value such that percentile % of all values are less or
+  // equal to it, reported as the upper end of its bucket like HdrHistogram
+  uint64_t ValueAtPercentile(double percentile) const;
+
+  // Bucket index of value and the largest value mapping to a bucket index
+  static uint32_t BucketIndex(uint64_t value);
+  static uint64_t BucketUpperBound(uint32_t index);
+
+  // Count recorded in bucket index
+  uint64_t BucketCount(uint32_t index) const { return buckets_[index]; }
+
+ private:
+  std::vector<uint64_t> buckets_;
+  uint64_t count_ = 0;
+  uint64_t min_ = UINT64_MAX;
+  uint64_t max_ = 0;
+  // Sum of all values as double, only used for the mean
+  double sum_ = 0;
+};
+
+}  // namespace fan_controller
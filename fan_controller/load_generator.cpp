@@ -0,0 +1,272 @@
+#include "load_generator.h"
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <boost/interprocess/mapped_region.hpp>
+#include <boost/interprocess/shared_memory_object.hpp>
+#include <boost/thread.hpp>
+#include <cmath>
+#include <fstream>
+#include <sstream>
+#include "../logger/logger.h"
+#include "controller.h"
+#include "metrics_page.h"
+#include "register_subscriber.h"
+#include "shard_ingest.h"
+using namespace boost::interprocess;
+
+namespace fan_controller {
+namespace loadgen {
+
+LoadGenerator::LoadGenerator(const LoadGenOptions& options)
+    : options_(options),
+      values_(options.config_.sensor_count_, options.min_temp_),
+      random_(options.seed_),
+      done_(false),
+      register_updates_(0) {}
+
+bool LoadGenerator::LoadTrace() {
+  std::ifstream in(options_.trace_path_);
+  if (!in) {
+    LOG_ERROR("Cannot open trace file %s\n", options_.trace_path_.c_str());
+    return false;
+  }
+  std::string line;
+  while (std::getline(in, line)) {
+    if (line.empty() || line[0] == '#') continue;
+    std::istringstream row(line);
+    uint32_t id;
+    char comma;
+    float value;
+    if (!(row >> id >> comma >> value) || comma != ',' ||
+        id >= options_.config_.sensor_count_) {
+      LOG_ERROR("Invalid trace row: %s\n", line.c_str());
+      return false;
+    }
+    trace_.push_back(std::make_pair(id, value));
+  }
+  if (trace_.empty()) {
+    LOG_ERROR("Trace file %s has no samples\n", options_.trace_path_.c_str());
+    return false;
+  }
+  return true;
+}
+
+float LoadGenerator::NextValue(uint32_t sensor_id, uint64_t update_index,
+                               double seconds) {
+  const float range = options_.max_temp_ - options_.min_temp_;
+  // Spread the sensors over one period so they do not move in lock step
+  double phase = seconds / options_.period_s_ +
+                 static_cast<double>(sensor_id) / values_.size();
+  phase -= std::floor(phase);
+  switch (options_.pattern_) {
+    case Pattern::SQUARE:
+      return phase < 0.5 ? options_.min_temp_ : options_.max_temp_;
+    case Pattern::RANDOM_WALK: {
+      std::uniform_real_distribution<float> step(-range / 100, range / 100);
+      float value = values_[sensor_id] + step(random_);
+      return std::min(options_.max_temp_, std::max(options_.min_temp_, value));
+    }
+    case Pattern::RAMP:
+    default:
+      return options_.min_temp_ + range * phase;
+  }
+}
+
+uint32_t LoadGenerator::NextBatch(uint32_t count, double seconds,
+                                  uint32_t* ids, float* values) {
+  for (uint32_t i = 0; i < count; i++) {
+    if (options_.pattern_ == Pattern::TRACE) {
+      ids[i] = trace_[trace_position_].first;
+      values[i] = trace_[trace_position_].second;
+      trace_position_ = (trace_position_ + 1) % trace_.size();
+    } else {
+      ids[i] = (sensor_updates_ + i) % values_.size();
+      values[i] = NextValue(ids[i], sensor_updates_ + i, seconds);
+    }
+    values_[ids[i]] = values[i];
+  }
+  return count;
+}
+
+uint32_t LoadGenerator::DueUpdates(double seconds, uint64_t sent) {
+  if (options_.rate_hz_ <= 0) return options_.batch_size_;
+  double due = options_.rate_hz_ * seconds - sent;
+  if (due >= 1) return std::min<double>(due, options_.batch_size_);
+  // Sleep if the next update is far away, spin otherwise so high rates stay
+  // accurate
+  double wait_us = (1 - due) * 1e6 / options_.rate_hz_;
+  if (wait_us > 100) usleep(wait_us - 50);
+  return 0;
+}
+
+void LoadGenerator::Produce(SensorPublisher* publisher) {
+  std::vector<uint32_t> ids(options_.batch_size_);
+  std::vector<float> values(options_.batch_size_);
+  const uint64_t start = MonotonicNowNs();
+  uint64_t last_report = start;
+  uint64_t reported_updates = 0;
+  while (true) {
+    const uint64_t now = MonotonicNowNs();
+    const double seconds = (now - start) / 1e9;
+    if (seconds >= options_.duration_s_) break;
+    uint32_t count = DueUpdates(seconds, sensor_updates_);
+    if (count == 0) continue;
+    NextBatch(count, seconds, ids.data(), values.data());
+    publisher->Publish(ids.data(), values.data(), count);
+    sensor_updates_ += count;
+    if (now - last_report >= 1000000000ull) {
+      LOG_INFO("Sent %lu sensor updates/s, %lu register updates so far\n",
+               (sensor_updates_ - reported_updates) * 1000000000ull /
+                   (now - last_report),
+               register_updates_.load());
+      last_report = now;
+      reported_updates = sensor_updates_;
+    }
+  }
+}
+
+void LoadGenerator::ReceiveRegisterValues() {
+  // The controller creates the register memory, wait until it is there
+  RegisterSubscriber subscriber(options_.config_.fan_count_);
+  while (!done_ && !subscriber.Attach(100)) {
+  }
+  std::vector<u_int32_t> registers(options_.config_.fan_count_, 0);
+  while (!done_) {
+    if (subscriber.Receive(registers.data(), 100)) register_updates_++;
+  }
+  if (subscriber.missed_generations() != 0)
+    LOG_INFO("Register reader missed %lu generations\n",
+             subscriber.missed_generations());
+}
+
+bool LoadGenerator::Run() {
+  if (options_.pattern_ == Pattern::TRACE && !LoadTrace()) return false;
+
+  // Create the sensor memory for the selected transport, like the GUI does
+  SensorPublisher publisher(options_.config_, options_.batch_size_);
+  if (!publisher.Open()) return false;
+
+  pid_t controller_pid = -1;
+  if (options_.spawn_controller_) {
+    // Make sure we do not attach to a register memory left over by an earlier
+    // controller
+    shared_memory_object::remove(register_memory_name.c_str());
+    controller_pid = fork();
+    if (controller_pid == 0) {
+      // Per update logging of the controller would dominate the run
+      logger::SetSeverity(logger::Severity::WARNING);
+      logger::StartAsync();
+      const bool started =
+          ::fan_controller::controller::StartController(options_.config_);
+      logger::StopAsync();
+      _exit(started ? 0 : 1);
+    }
+  }
+  std::vector<pid_t> shard_pids;
+  for (uint32_t shard = 0;
+       options_.spawn_controller_ && shard < options_.config_.shard_count_;
+       shard++) {
+    const pid_t pid = fork();
+    if (pid == 0) {
+      logger::SetSeverity(logger::Severity::WARNING);
+      logger::StartAsync();
+      const bool started =
+          ::fan_controller::controller::StartShard(options_.config_, shard);
+      logger::StopAsync();
+      _exit(started ? 0 : 1);
+    }
+    shard_pids.push_back(pid);
+  }
+
+  boost::thread register_thread(
+      boost::bind(&LoadGenerator::ReceiveRegisterValues, this));
+  const uint64_t start = MonotonicNowNs();
+  Produce(&publisher);
+  const double seconds = (MonotonicNowNs() - start) / 1e9;
+  LOG_INFO("Done: %lu sensor updates in %.3f s (%.0f/s), %lu register "
+           "updates\n",
+           sensor_updates_, seconds, sensor_updates_ / seconds,
+           register_updates_.load());
+  if (publisher.DroppedSamples() != 0)
+    LOG_WARNING("%lu samples dropped, ring was full\n",
+                publisher.DroppedSamples());
+
+  done_ = true;
+  bool ok = true;
+  for (pid_t pid : shard_pids) {
+    kill(pid, SIGTERM);
+    waitpid(pid, nullptr, 0);
+  }
+  if (controller_pid > 0) {
+    kill(controller_pid, SIGTERM);
+    waitpid(controller_pid, nullptr, 0);
+    if (!options_.config_.register_device_.empty())
+      ok = VerifyRegisterDevice();
+    shared_memory_object::remove(register_memory_name.c_str());
+  }
+  register_thread.join();
+  return ok;
+}
+
+bool LoadGenerator::VerifyRegisterDevice() {
+  const InputConfiguration& config = options_.config_;
+  RegisterSubscriber subscriber(config.fan_count_);
+  std::vector<u_int32_t> expected(config.fan_count_);
+  // Nothing published, nothing to compare
+  // The controller is stopped by now, take what it left behind
+  if (!subscriber.Attach(0, false) || !subscriber.Receive(expected.data(), 0))
+    return true;
+  std::ifstream device(config.register_device_, std::ios::binary);
+  for (uint32_t fan = 0; fan < config.fan_count_; fan++) {
+    u_int32_t value = 0;
+    device.seekg(config.register_offset_ +
+                 static_cast<uint64_t>(fan) * config.register_stride_);
+    if (!device.read(reinterpret_cast<char*>(&value), sizeof(value)) ||
+        value != expected[fan]) {
+      LOG_ERROR("Register device fan %d holds %u, expected %u\n", fan, value,
+                expected[fan]);
+      return false;
+    }
+  }
+  LOG_INFO("Register device %s matches the published registers\n",
+           config.register_device_.c_str());
+
+  // Only registers whose value changed get a store, so no fan sees more
+  // stores than there were register sets. The page outlives the controller.
+  mapped_region region;
+  try {
+    shared_memory_object shm(open_only, metrics_memory_name.c_str(),
+                             read_only);
+    mapped_region(shm, read_only).swap(region);
+  } catch (const interprocess_exception& e) {
+    LOG_ERROR("Cannot open the controller metrics: %s\n", e.what());
+    return false;
+  }
+  const controller_metrics_page* page =
+      static_cast<const controller_metrics_page*>(region.get_address());
+  if (region.get_size() < sizeof(controller_metrics_page) ||
+      !page->header.Ready() || region.get_size() < page->header.size ||
+      page->fan_count != config.fan_count_) {
+    LOG_ERROR("The controller metrics do not match the configuration\n");
+    return false;
+  }
+  const uint64_t sets = page->register_sets_written.load();
+  const std::atomic<uint64_t>* writes = page->register_writes();
+  for (uint32_t fan = 0; fan < config.fan_count_; fan++) {
+    const uint64_t fan_writes = writes[fan].load();
+    if (fan_writes > sets) {
+      LOG_ERROR("Fan %d register written %lu times for %lu register sets\n",
+                fan, fan_writes, sets);
+      return false;
+    }
+    LOG_INFO("Fan %d register written %lu times for %lu register sets\n", fan,
+             fan_writes, sets);
+  }
+  LOG_INFO("%lu redundant register writes skipped\n",
+           page->register_writes_skipped.load());
+  return true;
+}
+
+}  // namespace loadgen
+}  // namespace fan_controller
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+#include "common.h"
+#include "sensor_publisher.h"
+
+// LoadGenerator is a headless replacement for the GUI as sensor producer.
+// It attaches to the sensor shared memory the same way
+// GUIWrapper::SendSensorValues does, drives sensor_count sensors with a
+// synthetic pattern at a target update rate and consumes the register shared
+// memory like GUIWrapper::ReceiveRegisterValues.
+// Optionally it forks the controller as a child, the same way main forks the
+// GUI, so a complete pipeline can run on machines without a display. In
+// sharded mode the shard ingest processes are forked next to it.
+namespace fan_controller {
+namespace loadgen {
+
+// Shape of the generated sensor values
+enum class Pattern {
+  // Saw tooth from min to max over one period
+  RAMP,
+  // Alternates between min and max every half period
+  SQUARE,
+  // Bounded random walk between min and max
+  RANDOM_WALK,
+  // Replays sensor_id,value rows from a file
+  TRACE
+};
+
+struct LoadGenOptions {
+  InputConfiguration config_ = InputConfiguration(1, 1);
+  Pattern pattern_ = Pattern::RAMP;
+  // Sensor updates per second over all sensors, 0 means as fast as possible
+  double rate_hz_ = 1000;
+  double duration_s_ = 10;
+  float min_temp_ = 20.0f;
+  float max_temp_ = 80.0f;
+  // Period of ramp and square patterns in seconds
+  double period_s_ = 1;
+  // Largest number of updates published at once
+  uint32_t batch_size_ = 64;
+  // File for Pattern::TRACE
+  std::string trace_path_;
+  uint32_t seed_ = 1;
+  // Fork and run the controller as a child process
+  bool spawn_controller_ = true;
+};
+
+class LoadGenerator {
+  const LoadGenOptions options_;
+
+  // Rows of the trace file, sensor id and value
+  std::vector<std::pair<uint32_t, float>> trace_;
+  size_t trace_position_ = 0;
+
+  // Current value of each sensor, also the state of the random walk
+  std::vector<float> values_;
+
+  std::mt19937 random_;
+
+  // Set once the run is over, stops the register thread
+  std::atomic<bool> done_;
+
+  // Statistics
+  std::atomic<uint64_t> register_updates_;
+  uint64_t sensor_updates_ = 0;
+
+  // Load trace_ from options_.trace_path_, returns false on errors
+  bool LoadTrace();
+
+  // Value for the update number update_index, which goes to sensor_id
+  float NextValue(uint32_t sensor_id, uint64_t update_index, double seconds);
+
+  // Generate and publish updates for options_.duration_s_ seconds
+  void Produce(SensorPublisher* publisher);
+
+  // Fill ids and values with count updates due at seconds. Returns count.
+  uint32_t NextBatch(uint32_t count, double seconds, uint32_t* ids,
+                     float* values);
+
+  // Number of updates that should be sent now, given seconds since start and
+  // the updates sent so far. Waits if none are due yet.
+  uint32_t DueUpdates(double seconds, uint64_t sent);
+
+  // Receive register values from register shared memory
+  void ReceiveRegisterValues();
+
+  // Compares the register device stand-in with the latest registers in the
+  // register shared memory and checks the per fan write counts of the
+  // metrics page, returns false on a mismatch
+  bool VerifyRegisterDevice();
+
+ public:
+  LoadGenerator(const LoadGenOptions& options);
+
+  // Runs the load for the configured duration. Returns false on set up errors
+  bool Run();
+};
+
+}  // namespace loadgen
+}  // namespace fan_controller
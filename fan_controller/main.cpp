@@ -10,13 +10,28 @@
 #include <thread>
 #include "../logger/logger.h"
 #include "controller.h"
+#include "controller_options.h"
 #include "gui_wrapper.h"
 // Check if the fan and sensor count entered is a valid one
 // Input is valid onlt if there is a vaid fan count and sensor count
 // MAX values defined in common.h
 bool IsValidInput(int argc, char *argv[]) {
-  if (argc != 3) {
-    LOG_ERROR("Usage: fan_controller sensor_count fan_count \n");
+  if (argc < 3 || argc > 5) {
+    LOG_ERROR(
+        "Usage: fan_controller sensor_count fan_count "
+        "[semaphore|seqlock|ring|slots] [control_rate_hz]\n"
+        "       fan_controller --attach [fan_controllerd options]\n");
+    return false;
+  }
+  if (argc >= 4 && std::string(argv[3]) != "semaphore" &&
+      std::string(argv[3]) != "seqlock" && std::string(argv[3]) != "ring" &&
+      std::string(argv[3]) != "slots") {
+    LOG_ERROR(
+        "Sensor transport must be one of semaphore, seqlock, ring or slots\n");
+    return false;
+  }
+  if (argc == 5 && !isdigit(*argv[4])) {
+    LOG_ERROR("Control rate must be a number of Hz, 0 for event driven\n");
     return false;
   }
   if (*argv[1] == '-') {
@@ -44,6 +59,19 @@ bool isNumeric(std::string const &str) {
 }
 
 int main(int argc, char *argv[]) {
+  // GUI only, attaching to a running fan_controllerd configured with the
+  // same options
+  if (argc >= 2 && std::string(argv[1]) == "--attach") {
+    ::fan_controller::controller::ControllerOptions options;
+    if (!::fan_controller::controller::ParseControllerOptions(
+            argc - 1, argv + 1, &options))
+      exit(-1);
+    ::fan_controller::logger::SetSeverity(options.log_severity_);
+    if (!::fan_controller::gui::GUIWrapper::GetInstance(options.config_)
+             .StartGui())
+      exit(-1);
+    return 0;
+  }
   // Check fan count and sensor count validity
   if (!IsValidInput(argc, argv)) {
     exit(-1);
@@ -51,6 +79,16 @@ int main(int argc, char *argv[]) {
   uint32_t sensor_count = atoi(argv[1]);
   uint32_t fan_count = atoi(argv[2]);
   InputConfiguration configuration(fan_count, sensor_count);
+  if (argc >= 4 && std::string(argv[3]) == "seqlock")
+    configuration.transport_ = SensorTransport::SEQLOCK;
+  else if (argc >= 4 && std::string(argv[3]) == "ring")
+    configuration.transport_ = SensorTransport::RING;
+  else if (argc >= 4 && std::string(argv[3]) == "slots") {
+    // The GUI has no notion of subsystems, every sensor gets its own slot
+    configuration.transport_ = SensorTransport::SLOTS;
+    configuration.subsystem_count_ = sensor_count;
+  }
+  if (argc == 5) configuration.control_rate_hz_ = atoi(argv[4]);
 
   // Get maximum PWM values from user
   for (uint32_t i = 1; i <= fan_count; i++) {
@@ -92,8 +130,13 @@ int main(int argc, char *argv[]) {
     // proc.
     kill(ppid, SIGINT);
   } else {
-    // Controller runs in the parent process
-    ::fan_controller::controller::StartController(configuration);
+    // Controller runs in the parent process. It logs on every sensor change,
+    // so keep formatting and I/O off its threads
+    ::fan_controller::logger::StartAsync();
+    const bool started =
+        ::fan_controller::controller::StartController(configuration);
+    ::fan_controller::logger::StopAsync();
+    if (!started) exit(-1);
   }
   return 1;
 }
@@ -0,0 +1,94 @@
+#include "max_reduce.h"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+namespace fan_controller {
+
+float MaxReduceScalar(const float* values, uint32_t count) {
+  float max = values[0];
+  for (uint32_t i = 1; i < count; i++) max = std::max(max, values[i]);
+  return max;
+}
+
+#if defined(__x86_64__)
+
+namespace {
+
+// Note on argument order: maxps returns its second operand if either one is
+// NaN, so the accumulator always goes second to skip NaN sensor values. The
+// accumulators start at -infinity rather than at the first values, a NaN
+// seed would pin its lane. Only values[0] being NaN makes the result NaN,
+// like in MaxReduceScalar.
+
+// SSE is part of the x86_64 base line, no check needed
+float MaxReduceSse(const float* values, uint32_t count) {
+  if (count < 16) return MaxReduceScalar(values, count);
+  // Four independent accumulators hide the latency of maxps
+  __m128 max0 = _mm_set1_ps(-std::numeric_limits<float>::infinity());
+  __m128 max1 = max0, max2 = max0, max3 = max0;
+  uint32_t i = 0;
+  for (; i + 16 <= count; i += 16) {
+    max0 = _mm_max_ps(_mm_loadu_ps(values + i), max0);
+    max1 = _mm_max_ps(_mm_loadu_ps(values + i + 4), max1);
+    max2 = _mm_max_ps(_mm_loadu_ps(values + i + 8), max2);
+    max3 = _mm_max_ps(_mm_loadu_ps(values + i + 12), max3);
+  }
+  max0 = _mm_max_ps(max1, max0);
+  max2 = _mm_max_ps(max3, max2);
+  max0 = _mm_max_ps(max2, max0);
+  float lanes[4];
+  _mm_storeu_ps(lanes, max0);
+  float max = MaxReduceScalar(lanes, 4);
+  for (; i < count; i++) max = std::max(max, values[i]);
+  return std::isnan(values[0]) ? values[0] : max;
+}
+
+__attribute__((target("avx2"))) float MaxReduceAvx2(const float* values,
+                                                     uint32_t count) {
+  if (count < 32) return MaxReduceSse(values, count);
+  __m256 max0 = _mm256_set1_ps(-std::numeric_limits<float>::infinity());
+  __m256 max1 = max0, max2 = max0, max3 = max0;
+  uint32_t i = 0;
+  for (; i + 32 <= count; i += 32) {
+    max0 = _mm256_max_ps(_mm256_loadu_ps(values + i), max0);
+    max1 = _mm256_max_ps(_mm256_loadu_ps(values + i + 8), max1);
+    max2 = _mm256_max_ps(_mm256_loadu_ps(values + i + 16), max2);
+    max3 = _mm256_max_ps(_mm256_loadu_ps(values + i + 24), max3);
+  }
+  max0 = _mm256_max_ps(max1, max0);
+  max2 = _mm256_max_ps(max3, max2);
+  max0 = _mm256_max_ps(max2, max0);
+  float lanes[8];
+  _mm256_storeu_ps(lanes, max0);
+  float max = MaxReduceScalar(lanes, 8);
+  for (; i < count; i++) max = std::max(max, values[i]);
+  return std::isnan(values[0]) ? values[0] : max;
+}
+
+typedef float (*MaxReduceFunction)(const float*, uint32_t);
+
+MaxReduceFunction SelectMaxReduce() {
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2") ? MaxReduceAvx2 : MaxReduceSse;
+}
+
+}  // namespace
+
+float MaxReduce(const float* values, uint32_t count) {
+  static const MaxReduceFunction function = SelectMaxReduce();
+  return function(values, count);
+}
+
+#else
+
+float MaxReduce(const float* values, uint32_t count) {
+  return MaxReduceScalar(values, count);
+}
+
+#endif
+
+}  // namespace fan_controller
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <cstdint>
+
+namespace fan_controller {
+
+// Bulk maximum scan. The controller keeps its maxima in MaxTree, which needs
+// every inner node rather than just the maximum, so only bench_micro calls
+// this, as the rescan baseline MaxTree is measured against.
+//
+// Returns the largest of the count values, count must be at least 1.
+// NaN entries are skipped unless values[0] is NaN, which matches the
+// std::max based loop this replaces.
+// Uses AVX2 when the CPU supports it, SSE otherwise on x86_64 and plain C++
+// everywhere else.
+float MaxReduce(const float* values, uint32_t count);
+
+// Portable reference implementation, also used for the tails of the vector
+// kernels
+float MaxReduceScalar(const float* values, uint32_t count);
+
+}  // namespace fan_controller
@@ -0,0 +1,49 @@
+#include "max_tree.h"
+#include <cmath>
+#include <limits>
+
+namespace fan_controller {
+
+namespace {
+
+// NaN values are stored as +infinity so a faulty sensor wins every match and
+// drives the fans to full speed
+inline float Sanitize(float value) {
+  return std::isnan(value) ? std::numeric_limits<float>::infinity() : value;
+}
+
+inline float Winner(float left, float right) {
+  return right > left ? right : left;
+}
+
+}  // namespace
+
+MaxTree::MaxTree(uint32_t count, float initial_value) : count_(count) {
+  leaf_count_ = 1;
+  while (leaf_count_ < count_) leaf_count_ <<= 1;
+  nodes_.assign(2 * leaf_count_, -std::numeric_limits<float>::infinity());
+  for (uint32_t i = 0; i < count_; i++)
+    nodes_[leaf_count_ + i] = Sanitize(initial_value);
+  for (uint32_t i = leaf_count_ - 1; i > 0; i--)
+    nodes_[i] = Winner(nodes_[2 * i], nodes_[2 * i + 1]);
+}
+
+void MaxTree::Update(uint32_t index, float value) {
+  uint32_t node = leaf_count_ + index;
+  nodes_[node] = Sanitize(value);
+  // Walk up until a node's winner does not change
+  for (node >>= 1; node > 0; node >>= 1) {
+    float winner = Winner(nodes_[2 * node], nodes_[2 * node + 1]);
+    if (winner == nodes_[node]) break;
+    nodes_[node] = winner;
+  }
+}
+
+void MaxTree::Assign(const float* values) {
+  for (uint32_t i = 0; i < count_; i++)
+    nodes_[leaf_count_ + i] = Sanitize(values[i]);
+  for (uint32_t i = leaf_count_ - 1; i > 0; i--)
+    nodes_[i] = Winner(nodes_[2 * i], nodes_[2 * i + 1]);
+}
+
+}  // namespace fan_controller
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+namespace fan_controller {
+
+// Tournament tree over sensor slots which keeps the overall maximum up to
+// date while single values change. Update costs O(log n), Max is O(1), so the
+// controller no longer rescans every sensor when one of them reports.
+// A NaN value counts as +infinity, hotter than any curve point, so a faulty
+// sensor runs the fans at full speed like DEFAULT_SENSOR_DEGREE does.
+// Not thread safe, the controller guards it with its sensor data mutex.
+class MaxTree {
+  // Number of real slots
+  uint32_t count_;
+
+  // Number of leaves, count_ rounded up to a power of two
+  uint32_t leaf_count_;
+
+  // Heap layout: node i has children 2i and 2i+1, the root is node 1 and
+  // leaves start at leaf_count_. Unused leaves hold -infinity.
+  std::vector<float> nodes_;
+
+ public:
+  // count slots, all starting at initial_value
+  MaxTree(uint32_t count, float initial_value);
+
+  // Sets slot index to value and fixes up the path to the root
+  void Update(uint32_t index, float value);
+
+  // Replaces all count_ values at once in O(n), cheaper than count_ single
+  // updates when most of the slots changed
+  void Assign(const float* values);
+
+  // Largest value over all slots
+  float Max() const { return nodes_[1]; }
+
+  // Current value of slot index
+  float Value(uint32_t index) const { return nodes_[leaf_count_ + index]; }
+
+  uint32_t Count() const { return count_; }
+};
+
+}  // namespace fan_controller
@@ -0,0 +1,63 @@
+#include "metrics_page.h"
+#include <algorithm>
+
+void metrics_histogram::Record(uint64_t value) {
+  controller_metrics_page::Add(buckets[BucketIndex(value)], 1);
+  controller_metrics_page::Add(count, 1);
+  controller_metrics_page::Add(sum, value);
+  if (value > max.load(std::memory_order_relaxed))
+    max.store(value, std::memory_order_relaxed);
+}
+
+uint64_t metrics_histogram::ValueAtPercentile(double percentile) const {
+  const uint64_t total = count.load(std::memory_order_relaxed);
+  if (total == 0) return 0;
+  const uint64_t wanted =
+      std::max<uint64_t>(1, total * percentile / 100.0 + 0.5);
+  uint64_t seen = 0;
+  for (uint32_t i = 0; i < BUCKET_COUNT; i++) {
+    seen += buckets[i].load(std::memory_order_relaxed);
+    if (seen >= wanted)
+      return std::min(BucketUpperBound(i),
+                      max.load(std::memory_order_relaxed));
+  }
+  return max.load(std::memory_order_relaxed);
+}
+
+controller_metrics_page::controller_metrics_page(uint32_t sensor_count,
+                                                 uint32_t fan_count)
+    : header(Size(sensor_count, fan_count), sensor_count,
+             SharedBufferSize<controller_metrics_page, char>(0)),
+      fan_count(fan_count),
+      reserved(0),
+      start_ns(MonotonicNowNs()),
+      sensor_updates(0),
+      control_runs(0),
+      recomputes(0),
+      publishes(0),
+      hysteresis_holds(0),
+      small_changes_held(0),
+      slew_limited(0),
+      unchanged(0),
+      max_temp(0),
+      duty_cycle(0),
+      last_publish_ns(0),
+      register_sets_written(0),
+      register_writes_skipped(0),
+      log_messages_dropped(0),
+      stale_shards(0) {
+  for (metrics_histogram* histogram :
+       {&update_to_publish_ns, &publish_duration_ns, &shard_hop_ns}) {
+    for (uint32_t i = 0; i < metrics_histogram::BUCKET_COUNT; i++)
+      histogram->buckets[i].store(0, std::memory_order_relaxed);
+    histogram->count.store(0, std::memory_order_relaxed);
+    histogram->sum.store(0, std::memory_order_relaxed);
+    histogram->max.store(0, std::memory_order_relaxed);
+  }
+  std::atomic<uint64_t>* updates = last_update_ns();
+  for (uint32_t i = 0; i < sensor_count; i++)
+    updates[i].store(0, std::memory_order_relaxed);
+  std::atomic<uint64_t>* writes = register_writes();
+  for (uint32_t i = 0; i < fan_count; i++)
+    writes[i].store(0, std::memory_order_relaxed);
+}
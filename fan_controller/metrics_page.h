@@ -0,0 +1,123 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include "common.h"
+
+// Name for the controller metrics shared memory
+const std::string metrics_memory_name = "ControllerMetrics";
+
+// Power of two histogram living in shared memory. Bucket i counts the values
+// in [2^(i-1), 2^i), bucket 0 the zeros, which maps directly onto Prometheus
+// "le" buckets. Single writer, readers may see a bucket and count that are
+// one record apart.
+struct metrics_histogram {
+  static const uint32_t BUCKET_COUNT = 64;
+  std::atomic<uint64_t> buckets[BUCKET_COUNT];
+  std::atomic<uint64_t> count;
+  std::atomic<uint64_t> sum;
+  std::atomic<uint64_t> max;
+
+  static uint32_t BucketIndex(uint64_t value) {
+    if (value == 0) return 0;
+    const uint32_t index = 64 - __builtin_clzll(value);
+    return index < BUCKET_COUNT ? index : BUCKET_COUNT - 1;
+  }
+
+  // Largest value counted in bucket index
+  static uint64_t BucketUpperBound(uint32_t index) {
+    return index + 1 >= BUCKET_COUNT ? UINT64_MAX : (1ull << index) - 1;
+  }
+
+  void Record(uint64_t value);
+
+  // Upper bound of the bucket holding the percentile % value
+  uint64_t ValueAtPercentile(double percentile) const;
+};
+
+// Controller state for monitoring tools, see metrics_scraper. Every counter
+// has a single writing thread and is updated with relaxed loads and stores,
+// so the controller takes no locks and makes no syscalls for it. Readers get
+// each value atomically but no consistent snapshot across values.
+//
+// Layout: this struct followed by one monotonic ns timestamp per sensor,
+// header.count is the sensor count, and one register write counter per fan.
+// In sharded mode the controller sees one sensor per shard, so there is one
+// timestamp per shard.
+struct controller_metrics_page {
+  shared_segment_header header;
+  uint32_t fan_count;
+  uint32_t reserved;
+  // CLOCK_MONOTONIC time the controller started in ns
+  uint64_t start_ns;
+
+  // Written by the thread ingesting sensor values
+  alignas(CACHE_LINE_SIZE) std::atomic<uint64_t> sensor_updates;
+
+  // Written by the thread publishing the registers, see ControlStats
+  alignas(CACHE_LINE_SIZE) std::atomic<uint64_t> control_runs;
+  std::atomic<uint64_t> recomputes;
+  std::atomic<uint64_t> publishes;
+  std::atomic<uint64_t> hysteresis_holds;
+  std::atomic<uint64_t> small_changes_held;
+  std::atomic<uint64_t> slew_limited;
+  std::atomic<uint64_t> unchanged;
+  std::atomic<float> max_temp;
+  std::atomic<float> duty_cycle;
+  // Monotonic time of the last register publish in ns, 0 before the first
+  std::atomic<uint64_t> last_publish_ns;
+  // Register sets handed to the register backend and fan registers left out
+  // because they held the value already. Per fan stores are counted by
+  // register_writes. All stay 0 without a register device.
+  std::atomic<uint64_t> register_sets_written;
+  std::atomic<uint64_t> register_writes_skipped;
+  // Log messages dropped because an asynchronous log ring was full, see
+  // logger::DroppedMessages. Refreshed about once per second.
+  std::atomic<uint64_t> log_messages_dropped;
+
+  // Time from the first sensor update folded into a recompute to its
+  // registers being published and time spent publishing, both in ns
+  metrics_histogram update_to_publish_ns;
+  metrics_histogram publish_duration_ns;
+
+  // Sharded mode, written by the thread ingesting the shard maxima: time
+  // from a shard publishing its maximum to the controller picking it up in
+  // ns and shards found without a heartbeat
+  metrics_histogram shard_hop_ns;
+  std::atomic<uint64_t> stale_shards;
+
+  controller_metrics_page(uint32_t sensor_count, uint32_t fan_count);
+
+  // Monotonic time in ns of the latest update per sensor, 0 if it never
+  // reported
+  std::atomic<uint64_t>* last_update_ns() {
+    return reinterpret_cast<std::atomic<uint64_t>*>(
+        reinterpret_cast<char*>(this) + header.data_offset);
+  }
+  const std::atomic<uint64_t>* last_update_ns() const {
+    return reinterpret_cast<const std::atomic<uint64_t>*>(
+        reinterpret_cast<const char*>(this) + header.data_offset);
+  }
+
+  // Stores issued to the register of each fan, fan_count entries. Never
+  // more than register_sets_written, which is updated first.
+  std::atomic<uint64_t>* register_writes() {
+    return last_update_ns() + header.count;
+  }
+  const std::atomic<uint64_t>* register_writes() const {
+    return last_update_ns() + header.count;
+  }
+
+  // Bytes to allocate for sensor_count sensors and fan_count fans
+  static uint64_t Size(uint32_t sensor_count, uint32_t fan_count) {
+    return SharedBufferSize<controller_metrics_page, std::atomic<uint64_t>>(
+        sensor_count + fan_count);
+  }
+
+  // Single writer increment, no locked instruction needed
+  static void Add(std::atomic<uint64_t>& counter, uint64_t value) {
+    counter.store(counter.load(std::memory_order_relaxed) + value,
+                  std::memory_order_relaxed);
+  }
+};
@@ -0,0 +1,267 @@
+// Prints the metrics page a running controller keeps in shared memory, as a
+// short summary or in the Prometheus text format. Only reads the page, the
+// controller is never slowed down or blocked by scraping.
+
+#include <getopt.h>
+#include <unistd.h>
+#include <algorithm>
+#include <boost/interprocess/mapped_region.hpp>
+#include <boost/interprocess/shared_memory_object.hpp>
+#include <cstdio>
+#include <cstdlib>
+#include "../logger/logger.h"
+#include "metrics_page.h"
+
+using namespace boost::interprocess;
+
+namespace {
+
+void PrintUsage() {
+  LOG_ERROR(
+      "Usage: metrics_scraper [options]\n"
+      "  --prometheus  print in the Prometheus text format\n"
+      "  --sensors     include the time since the last update per sensor and\n"
+      "                the register writes per fan\n"
+      "  --watch S     print again every S seconds\n");
+}
+
+double Seconds(uint64_t ns) { return ns / 1e9; }
+
+// Age in seconds of a monotonic timestamp, -1 if it was never set
+double Age(uint64_t now_ns, uint64_t ns) {
+  if (ns == 0) return -1;
+  return now_ns > ns ? Seconds(now_ns - ns) : 0;
+}
+
+void PrintSummary(const controller_metrics_page& page, bool sensors) {
+  const uint64_t now = MonotonicNowNs();
+  std::printf("uptime %.3fs, %u sensors, %u fans\n",
+              Seconds(now - page.start_ns), page.header.count, page.fan_count);
+  std::printf("max temp %f, duty cycle %f, last publish %.3fs ago\n",
+              page.max_temp.load(std::memory_order_relaxed),
+              page.duty_cycle.load(std::memory_order_relaxed),
+              Age(now, page.last_publish_ns.load(std::memory_order_relaxed)));
+  std::printf(
+      "sensor updates %llu, control runs %llu, recomputes %llu, publishes "
+      "%llu\n",
+      static_cast<unsigned long long>(page.sensor_updates.load()),
+      static_cast<unsigned long long>(page.control_runs.load()),
+      static_cast<unsigned long long>(page.recomputes.load()),
+      static_cast<unsigned long long>(page.publishes.load()));
+  std::printf(
+      "hysteresis holds %llu, small changes held %llu, slew limited %llu, "
+      "unchanged %llu\n",
+      static_cast<unsigned long long>(page.hysteresis_holds.load()),
+      static_cast<unsigned long long>(page.small_changes_held.load()),
+      static_cast<unsigned long long>(page.slew_limited.load()),
+      static_cast<unsigned long long>(page.unchanged.load()));
+  std::printf("register sets written %llu, register writes skipped %llu\n",
+              static_cast<unsigned long long>(page.register_sets_written.load()),
+              static_cast<unsigned long long>(
+                  page.register_writes_skipped.load()));
+  std::printf("log messages dropped %llu\n",
+              static_cast<unsigned long long>(page.log_messages_dropped.load()));
+  const struct {
+    const char* name;
+    const metrics_histogram& histogram;
+  } histograms[] = {{"update to publish", page.update_to_publish_ns},
+                    {"publish duration", page.publish_duration_ns},
+                    {"shard hop", page.shard_hop_ns}};
+  for (const auto& entry : histograms) {
+    std::printf("%s: count %llu p50 <= %lluns p99 <= %lluns max %lluns\n",
+                entry.name,
+                static_cast<unsigned long long>(entry.histogram.count.load()),
+                static_cast<unsigned long long>(
+                    entry.histogram.ValueAtPercentile(50)),
+                static_cast<unsigned long long>(
+                    entry.histogram.ValueAtPercentile(99)),
+                static_cast<unsigned long long>(entry.histogram.max.load()));
+  }
+  if (!sensors) return;
+  const std::atomic<uint64_t>* updates = page.last_update_ns();
+  for (uint32_t id = 0; id < page.header.count; id++)
+    std::printf("sensor %u last update %.3fs ago\n", id,
+                Age(now, updates[id].load(std::memory_order_relaxed)));
+  const std::atomic<uint64_t>* writes = page.register_writes();
+  for (uint32_t fan = 0; fan < page.fan_count; fan++)
+    std::printf("fan %u register writes %llu\n", fan,
+                static_cast<unsigned long long>(
+                    writes[fan].load(std::memory_order_relaxed)));
+}
+
+void PrintCounter(const char* name, const char* help,
+                  const std::atomic<uint64_t>& value) {
+  std::printf("# HELP fan_controller_%s %s\n", name, help);
+  std::printf("# TYPE fan_controller_%s counter\n", name);
+  std::printf("fan_controller_%s %llu\n", name,
+              static_cast<unsigned long long>(
+                  value.load(std::memory_order_relaxed)));
+}
+
+void PrintGauge(const char* name, const char* help, double value) {
+  std::printf("# HELP fan_controller_%s %s\n", name, help);
+  std::printf("# TYPE fan_controller_%s gauge\n", name);
+  std::printf("fan_controller_%s %.9g\n", name, value);
+}
+
+// Histogram in seconds with one cumulative bucket per used power of two
+void PrintHistogram(const char* name, const char* help,
+                    const metrics_histogram& histogram) {
+  std::printf("# HELP fan_controller_%s %s\n", name, help);
+  std::printf("# TYPE fan_controller_%s histogram\n", name);
+  uint32_t last = 0;
+  for (uint32_t i = 0; i < metrics_histogram::BUCKET_COUNT; i++)
+    if (histogram.buckets[i].load(std::memory_order_relaxed) != 0) last = i;
+  uint64_t cumulative = 0;
+  for (uint32_t i = 0; i <= last && i + 1 < metrics_histogram::BUCKET_COUNT;
+       i++) {
+    cumulative += histogram.buckets[i].load(std::memory_order_relaxed);
+    std::printf("fan_controller_%s_bucket{le=\"%.9g\"} %llu\n", name,
+                Seconds(metrics_histogram::BucketUpperBound(i)),
+                static_cast<unsigned long long>(cumulative));
+  }
+  // Read the count last, so it is never below the buckets printed
+  const uint64_t count = histogram.count.load(std::memory_order_relaxed);
+  std::printf("fan_controller_%s_bucket{le=\"+Inf\"} %llu\n", name,
+              static_cast<unsigned long long>(std::max(count, cumulative)));
+  std::printf("fan_controller_%s_sum %.9g\n", name,
+              Seconds(histogram.sum.load(std::memory_order_relaxed)));
+  std::printf("fan_controller_%s_count %llu\n", name,
+              static_cast<unsigned long long>(std::max(count, cumulative)));
+}
+
+void PrintPrometheus(const controller_metrics_page& page, bool sensors) {
+  const uint64_t now = MonotonicNowNs();
+  PrintGauge("uptime_seconds", "Time since the controller started",
+             Seconds(now - page.start_ns));
+  PrintGauge("sensors", "Configured sensor count", page.header.count);
+  PrintGauge("fans", "Configured fan count", page.fan_count);
+  PrintGauge("max_temperature_celsius", "Controlling temperature",
+             page.max_temp.load(std::memory_order_relaxed));
+  PrintGauge("duty_cycle_percent", "Duty cycle of the first fan",
+             page.duty_cycle.load(std::memory_order_relaxed));
+  PrintGauge("last_publish_age_seconds",
+             "Time since the registers were last published, -1 if never",
+             Age(now, page.last_publish_ns.load(std::memory_order_relaxed)));
+  PrintCounter("sensor_updates_total", "Sensor values received",
+               page.sensor_updates);
+  PrintCounter("control_runs_total", "Runs of the control algorithm",
+               page.control_runs);
+  PrintCounter("recomputes_total", "Target register recomputes",
+               page.recomputes);
+  PrintCounter("publishes_total", "Register sets published", page.publishes);
+  PrintCounter("hysteresis_holds_total",
+               "Falling temperatures ignored inside the hysteresis band",
+               page.hysteresis_holds);
+  PrintCounter("small_changes_held_total",
+               "Targets held back by the minimum duty cycle delta",
+               page.small_changes_held);
+  PrintCounter("slew_limited_total", "Publishes cut short by the slew rate",
+               page.slew_limited);
+  PrintCounter("unchanged_total",
+               "Recomputes ending with the registers already published",
+               page.unchanged);
+  PrintCounter("register_sets_written_total",
+               "Register sets handed to the register device",
+               page.register_sets_written);
+  PrintCounter("register_writes_skipped_total",
+               "Fan registers left out because they held the value already",
+               page.register_writes_skipped);
+  PrintCounter("log_messages_dropped_total",
+               "Log messages dropped because a log ring was full",
+               page.log_messages_dropped);
+  PrintHistogram("update_to_publish_seconds",
+                 "Time from a sensor update to its registers being published",
+                 page.update_to_publish_ns);
+  PrintHistogram("publish_duration_seconds", "Time spent publishing",
+                 page.publish_duration_ns);
+  PrintHistogram("shard_hop_seconds",
+                 "Time from a shard publishing its maximum to the controller "
+                 "picking it up",
+                 page.shard_hop_ns);
+  PrintCounter("stale_shards_total", "Shards found without a heartbeat",
+               page.stale_shards);
+  if (!sensors) return;
+  std::printf(
+      "# HELP fan_controller_sensor_update_age_seconds Time since the last "
+      "update of a sensor, -1 if never\n");
+  std::printf("# TYPE fan_controller_sensor_update_age_seconds gauge\n");
+  const std::atomic<uint64_t>* updates = page.last_update_ns();
+  for (uint32_t id = 0; id < page.header.count; id++)
+    std::printf("fan_controller_sensor_update_age_seconds{sensor=\"%u\"} "
+                "%.9g\n",
+                id, Age(now, updates[id].load(std::memory_order_relaxed)));
+  std::printf(
+      "# HELP fan_controller_register_writes_total Stores issued to the "
+      "register of a fan\n");
+  std::printf("# TYPE fan_controller_register_writes_total counter\n");
+  const std::atomic<uint64_t>* writes = page.register_writes();
+  for (uint32_t fan = 0; fan < page.fan_count; fan++)
+    std::printf("fan_controller_register_writes_total{fan=\"%u\"} %llu\n", fan,
+                static_cast<unsigned long long>(
+                    writes[fan].load(std::memory_order_relaxed)));
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  static const option long_options[] = {
+      {"prometheus", no_argument, nullptr, 'p'},
+      {"sensors", no_argument, nullptr, 's'},
+      {"watch", required_argument, nullptr, 'w'},
+      {"help", no_argument, nullptr, 'h'},
+      {nullptr, 0, nullptr, 0}};
+
+  bool prometheus = false, sensors = false;
+  double watch_s = 0;
+  int option;
+  while ((option = getopt_long(argc, argv, "", long_options, nullptr)) != -1) {
+    switch (option) {
+      case 'p':
+        prometheus = true;
+        break;
+      case 's':
+        sensors = true;
+        break;
+      case 'w':
+        watch_s = atof(optarg);
+        break;
+      default:
+        PrintUsage();
+        return option == 'h' ? 0 : 1;
+    }
+  }
+  if (optind != argc) {
+    PrintUsage();
+    return 1;
+  }
+
+  mapped_region region;
+  try {
+    shared_memory_object shm(open_only, metrics_memory_name.c_str(),
+                             read_only);
+    mapped_region(shm, read_only).swap(region);
+  } catch (const interprocess_exception& e) {
+    LOG_ERROR("Cannot open the metrics of the controller: %s\n", e.what());
+    return 1;
+  }
+  const controller_metrics_page* page =
+      static_cast<const controller_metrics_page*>(region.get_address());
+  // The page of a stopped controller is still worth a look
+  if (region.get_size() < sizeof(controller_metrics_page) ||
+      !page->header.Ready() || region.get_size() < page->header.size) {
+    LOG_ERROR("The metrics memory is not ready\n");
+    return 1;
+  }
+
+  while (true) {
+    if (prometheus)
+      PrintPrometheus(*page, sensors);
+    else
+      PrintSummary(*page, sensors);
+    std::fflush(stdout);
+    if (watch_s <= 0) return 0;
+    usleep(static_cast<useconds_t>(watch_s * 1e6));
+    if (!prometheus) std::printf("\n");
+  }
+}
@@ -0,0 +1,113 @@
+#include "register_backend.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include "../logger/logger.h"
+
+namespace fan_controller {
+namespace controller {
+
+MmapRegisterBackend::MmapRegisterBackend(uint32_t fan_count, uint64_t offset,
+                                         uint32_t stride)
+    : fan_count_(fan_count),
+      offset_(offset),
+      stride_(stride),
+      shadow_(fan_count, 0),
+      write_counts_(fan_count, 0) {}
+
+MmapRegisterBackend::~MmapRegisterBackend() {
+  if (mapping_ != nullptr) munmap(mapping_, mapping_size_);
+}
+
+bool MmapRegisterBackend::Open(const std::string& path, bool create_stand_in) {
+  if (offset_ % sizeof(u_int32_t) != 0 || stride_ % sizeof(u_int32_t) != 0 ||
+      stride_ == 0) {
+    LOG_ERROR("Register offset and stride must be multiples of 4\n");
+    return false;
+  }
+  // Only stand-ins are created, a missing device is a configuration error
+  const int flags = O_RDWR | O_SYNC | O_CLOEXEC | (create_stand_in ? O_CREAT : 0);
+  int fd = open(path.c_str(), flags, 0644);
+  if (fd < 0) {
+    LOG_ERROR("Cannot open register device %s: %s\n", path.c_str(),
+              strerror(errno));
+    return false;
+  }
+  // mmap wants a page aligned offset, map from the page holding the first
+  // register
+  const uint64_t page_size = sysconf(_SC_PAGESIZE);
+  const uint64_t map_offset = offset_ / page_size * page_size;
+  const uint64_t block_end =
+      offset_ + static_cast<uint64_t>(fan_count_ - 1) * stride_ +
+      sizeof(u_int32_t);
+  mapping_size_ = block_end - map_offset;
+
+  // Mapping past the end of a regular file faults on the first store
+  struct stat info;
+  if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) &&
+      static_cast<uint64_t>(info.st_size) < block_end) {
+    if (!create_stand_in) {
+      LOG_ERROR("Register device %s is smaller than the register block\n",
+                path.c_str());
+      close(fd);
+      return false;
+    }
+    if (ftruncate(fd, block_end) < 0) {
+      LOG_ERROR("Cannot grow register stand-in %s: %s\n", path.c_str(),
+                strerror(errno));
+      close(fd);
+      return false;
+    }
+  }
+  void* mapping = mmap(nullptr, mapping_size_, PROT_READ | PROT_WRITE,
+                       MAP_SHARED, fd, map_offset);
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    LOG_ERROR("Cannot map register device %s: %s\n", path.c_str(),
+              strerror(errno));
+    return false;
+  }
+  mapping_ = mapping;
+  registers_ = reinterpret_cast<volatile u_int32_t*>(
+      static_cast<char*>(mapping_) + (offset_ - map_offset));
+  LOG_INFO("Driving %d fan registers through %s\n", fan_count_, path.c_str());
+  return true;
+}
+
+bool MmapRegisterBackend::Write(const u_int32_t* registers) {
+  if (registers_ == nullptr) return false;
+  const uint32_t stride_words = stride_ / sizeof(u_int32_t);
+  for (uint32_t fan = 0; fan < fan_count_; fan++) {
+    if (shadow_valid_ && shadow_[fan] == registers[fan]) {
+      skipped_writes_++;
+      continue;
+    }
+    // Exactly one 32 bit store per changed register
+    registers_[fan * stride_words] = registers[fan];
+    shadow_[fan] = registers[fan];
+    write_counts_[fan]++;
+    total_writes_++;
+  }
+  shadow_valid_ = true;
+  return true;
+}
+
+bool CreateRegisterBackend(const InputConfiguration& config,
+                           std::unique_ptr<RegisterBackend>* backend) {
+  backend->reset();
+  if (config.register_device_.empty()) return true;
+  MmapRegisterBackend* mmap_backend =
+      new MmapRegisterBackend(config.fan_count_, config.register_offset_,
+                              config.register_stride_);
+  std::unique_ptr<RegisterBackend> owner(mmap_backend);
+  if (!mmap_backend->Open(config.register_device_, config.register_stand_in_))
+    return false;
+  *backend = std::move(owner);
+  return true;
+}
+
+}  // namespace controller
+}  // namespace fan_controller
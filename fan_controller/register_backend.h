@@ -0,0 +1,81 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include "common.h"
+
+// Register backends carry the PWM counts to the fans. RegisterShared only
+// feeds the GUI and other readers, a backend is what drives the hardware.
+namespace fan_controller {
+namespace controller {
+
+class RegisterBackend {
+ public:
+  virtual ~RegisterBackend() {}
+
+  // Brings every fan register to registers[fan]. Returns false on failure.
+  virtual bool Write(const u_int32_t* registers) = 0;
+
+  // Stores issued to the register of fan and in total
+  virtual uint64_t WriteCount(uint32_t fan) const = 0;
+  virtual uint64_t TotalWrites() const = 0;
+
+  // Stores left out because the register already held the value
+  virtual uint64_t SkippedWrites() const = 0;
+};
+
+// Register block reached through mmap of a device or file, one 32 bit
+// register per fan at offset + fan * stride. Works against /dev/mem or a
+// UIO device on the boards and against a regular file or /dev/shm stand-in
+// for testing. Bus writes are expensive, so only registers whose value
+// changed get a volatile store; a shadow copy of the last written values
+// avoids reading the registers back.
+class MmapRegisterBackend : public RegisterBackend {
+  const uint32_t fan_count_;
+  const uint64_t offset_;
+  const uint32_t stride_;
+
+  void* mapping_ = nullptr;
+  size_t mapping_size_ = 0;
+
+  // First fan register inside mapping_
+  volatile u_int32_t* registers_ = nullptr;
+
+  // Last written value per fan, invalid until the first Write
+  std::vector<u_int32_t> shadow_;
+  bool shadow_valid_ = false;
+
+  std::vector<uint64_t> write_counts_;
+  uint64_t total_writes_ = 0;
+  uint64_t skipped_writes_ = 0;
+
+ public:
+  // offset and stride in bytes, both multiples of 4
+  MmapRegisterBackend(uint32_t fan_count, uint64_t offset, uint32_t stride);
+  ~MmapRegisterBackend();
+  MmapRegisterBackend(MmapRegisterBackend const& copy) = delete;
+  MmapRegisterBackend& operator=(MmapRegisterBackend const& copy) = delete;
+
+  // Maps the register block of path. With create_stand_in a missing file is
+  // created and a regular file is grown to fit, so a stand-in can be created
+  // on the fly. Returns false on failure.
+  bool Open(const std::string& path, bool create_stand_in);
+
+  bool Write(const u_int32_t* registers) override;
+
+  uint64_t WriteCount(uint32_t fan) const override {
+    return write_counts_[fan];
+  }
+  uint64_t TotalWrites() const override { return total_writes_; }
+  uint64_t SkippedWrites() const override { return skipped_writes_; }
+};
+
+// Sets backend to the one selected by config, nullptr if no register device
+// is configured. Returns false if the configured device cannot be opened.
+bool CreateRegisterBackend(const InputConfiguration& config,
+                           std::unique_ptr<RegisterBackend>* backend);
+
+}  // namespace controller
+}  // namespace fan_controller
@@ -0,0 +1,31 @@
+#include "register_subscriber.h"
+#include "shared_segment.h"
+using namespace boost::interprocess;
+
+namespace fan_controller {
+namespace loadgen {
+
+RegisterSubscriber::RegisterSubscriber(uint32_t fan_count)
+    : fan_count_(fan_count) {}
+
+bool RegisterSubscriber::Attach(uint32_t timeout_ms, bool live_owner) {
+  if (!AttachSegment(register_memory_name, fan_count_,
+                     timeout_ms * 1000000ull, &region_, live_owner))
+    return false;
+  data_ = static_cast<register_shared_memory_buffer*>(region_.get_address());
+  return true;
+}
+
+bool RegisterSubscriber::Receive(u_int32_t* registers, uint32_t timeout_ms) {
+  if (!data_->WaitForGeneration(generation_, timeout_ms * 1000000ull))
+    return false;
+  const uint32_t generation = data_->Read(registers);
+  // The controller never waits for readers, count what was overwritten since
+  // the previous receive
+  if (generation_ != 0) missed_generations_ += generation - generation_ - 1;
+  generation_ = generation;
+  return true;
+}
+
+}  // namespace loadgen
+}  // namespace fan_controller
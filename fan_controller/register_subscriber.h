@@ -0,0 +1,44 @@
+#pragma once
+
+#include <boost/interprocess/mapped_region.hpp>
+#include <cstdint>
+#include "common.h"
+
+// RegisterSubscriber is one reader of the register mailbox, the same protocol
+// GUIWrapper::ReceiveRegisterValues follows. Any number of them can attach
+// next to the GUI. Used by the headless tools.
+namespace fan_controller {
+namespace loadgen {
+
+class RegisterSubscriber {
+  const uint32_t fan_count_;
+
+  boost::interprocess::mapped_region region_;
+
+  register_shared_memory_buffer* data_ = nullptr;
+
+  // Generation of the last received registers, 0 before the first one
+  uint32_t generation_ = 0;
+
+  // Generations published but overwritten before this reader saw them
+  uint64_t missed_generations_ = 0;
+
+ public:
+  RegisterSubscriber(uint32_t fan_count);
+
+  // Waits up to timeout_ms for the controller to mark the register memory
+  // ready and maps it, see AttachSegment for live_owner. Returns false on
+  // timeout or if the memory was created for a different fan count.
+  bool Attach(uint32_t timeout_ms, bool live_owner = true);
+
+  // Waits up to timeout_ms for a register generation newer than the last
+  // received one and copies the fan_count values to registers. Returns false
+  // on timeout.
+  bool Receive(u_int32_t* registers, uint32_t timeout_ms);
+
+  uint32_t generation() const { return generation_; }
+  uint64_t missed_generations() const { return missed_generations_; }
+};
+
+}  // namespace loadgen
+}  // namespace fan_controller
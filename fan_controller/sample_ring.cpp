@@ -0,0 +1,58 @@
+#include "sample_ring.h"
+#include <algorithm>
+#include <cstddef>
+#include "futex.h"
+
+static_assert((SAMPLE_RING_CAPACITY & (SAMPLE_RING_CAPACITY - 1)) == 0,
+              "SAMPLE_RING_CAPACITY must be a power of two");
+
+sensor_sample_ring::sensor_sample_ring()
+    : header(sizeof(sensor_sample_ring), SAMPLE_RING_CAPACITY,
+             offsetof(sensor_sample_ring, samples)),
+      head(0),
+      cached_tail(0),
+      dropped(0),
+      tail(0),
+      waiters(0) {}
+
+uint32_t sensor_sample_ring::Push(const SensorSample* in, uint32_t count) {
+  const uint32_t mask = SAMPLE_RING_CAPACITY - 1;
+  uint32_t current_head = head.load(std::memory_order_relaxed);
+  uint32_t free_slots = SAMPLE_RING_CAPACITY - (current_head - cached_tail);
+  if (free_slots < count) {
+    cached_tail = tail.load(std::memory_order_acquire);
+    free_slots = SAMPLE_RING_CAPACITY - (current_head - cached_tail);
+  }
+  uint32_t pushed = std::min(free_slots, count);
+  for (uint32_t i = 0; i < pushed; i++)
+    samples[(current_head + i) & mask] = in[i];
+  if (pushed < count)
+    dropped.fetch_add(count - pushed, std::memory_order_relaxed);
+  if (pushed == 0) return 0;
+
+  // seq_cst store pairs with the waiters increment in WaitForSamples
+  head.store(current_head + pushed);
+  if (waiters.load() != 0) ::fan_controller::FutexWake(&head);
+  return pushed;
+}
+
+uint32_t sensor_sample_ring::PopBatch(SensorSample* out, uint32_t max_count) {
+  const uint32_t mask = SAMPLE_RING_CAPACITY - 1;
+  uint32_t current_tail = tail.load(std::memory_order_relaxed);
+  uint32_t available = head.load(std::memory_order_acquire) - current_tail;
+  uint32_t count = std::min(available, max_count);
+  for (uint32_t i = 0; i < count; i++)
+    out[i] = samples[(current_tail + i) & mask];
+  tail.store(current_tail + count, std::memory_order_release);
+  return count;
+}
+
+void sensor_sample_ring::WaitForSamples() {
+  const uint32_t current_tail = tail.load(std::memory_order_relaxed);
+  while (head.load(std::memory_order_acquire) == current_tail) {
+    waiters.fetch_add(1);
+    if (head.load() == current_tail)
+      ::fan_controller::FutexWait(&head, current_tail);
+    waiters.fetch_sub(1);
+  }
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include "common.h"
+
+// Number of samples the ring can hold, must be a power of two
+const uint32_t SAMPLE_RING_CAPACITY = 1 << 16;
+
+// Name for the sensor sample stream shared memory
+const std::string sensor_samples_memory_name = "SensorSamplesShared";
+
+// One timestamped sensor reading
+struct SensorSample {
+  int32_t sensor_id_ = -1;
+  float value_ = TEMP_HUNDRED_PERCENT_CUTOFF;
+  // CLOCK_MONOTONIC time the reading was taken, in nanoseconds
+  uint64_t monotonic_ts_ = 0;
+  SensorSample(int32_t id = -1, float value = TEMP_HUNDRED_PERCENT_CUTOFF,
+               uint64_t monotonic_ts = 0)
+      : sensor_id_(id), value_(value), monotonic_ts_(monotonic_ts) {}
+};
+
+// Single producer / single consumer ring of sensor samples living in shared
+// memory next to the sensor buffer. Unlike the other sensor transports every
+// reading is kept, so bursts do not overwrite each other.
+// head and tail are free running counters, the slot is counter & mask.
+// Producer and consumer fields live on separate cache lines.
+struct sensor_sample_ring {
+  // header.count is SAMPLE_RING_CAPACITY
+  shared_segment_header header;
+  sensor_sample_ring();
+
+  // Producer side. head is also the futex word an idle consumer sleeps on
+  alignas(CACHE_LINE_SIZE) std::atomic<uint32_t> head;
+  // Producer's last known tail, saves touching the consumer line on each push
+  uint32_t cached_tail;
+  // Samples that did not fit into the ring
+  std::atomic<uint64_t> dropped;
+
+  // Consumer side
+  alignas(CACHE_LINE_SIZE) std::atomic<uint32_t> tail;
+  // Number of consumers sleeping on head
+  std::atomic<uint32_t> waiters;
+
+  alignas(CACHE_LINE_SIZE) SensorSample samples[SAMPLE_RING_CAPACITY];
+
+  // Appends as many of the count samples as fit, publishes them at once and
+  // returns the number appended. Never blocks.
+  uint32_t Push(const SensorSample* in, uint32_t count);
+
+  // Moves up to max_count samples into out and returns the number moved
+  uint32_t PopBatch(SensorSample* out, uint32_t max_count);
+
+  // Blocks while the ring is empty
+  void WaitForSamples();
+};
@@ -0,0 +1,276 @@
+#include <getopt.h>
+#include <cstdlib>
+#include <sstream>
+#include <string>
+#include "../logger/logger.h"
+#include "control_algorithm.h"
+#include "controller.h"
+#include "fan_curve.h"
+#include "load_generator.h"
+
+using ::fan_controller::loadgen::LoadGenOptions;
+using ::fan_controller::loadgen::LoadGenerator;
+using ::fan_controller::loadgen::Pattern;
+using ::fan_controller::controller::ControlAlgorithm;
+using ::fan_controller::controller::ControlConfig;
+using ::fan_controller::controller::FanCurveEngine;
+
+void PrintUsage() {
+  LOG_ERROR(
+      "Usage: sensor_loadgen [options]\n"
+      "  --sensors N         sensor count (default 1)\n"
+      "  --fans N            fan count (default 1)\n"
+      "  --max-pwm A,B,..    PWM count at 100%% duty cycle per fan (default "
+      "1000)\n"
+      "  --curve T:D,T:D,..  fan curve as temperature:duty points, give once\n"
+      "                      for all fans or once per fan (default 25:20,75:100)\n"
+      "  --control-rate HZ   fixed controller loop rate, 0 = event driven\n"
+      "  --coalesce US       fold sensor updates within US into one recompute\n"
+      "  --hysteresis C      follow falling temperatures only past C degrees\n"
+      "  --min-duty-delta P  hold back register changes below P percent\n"
+      "  --slew-rate N       limit register changes to N PWM counts/s\n"
+      "  --zone N/S/F[/C]    zone N of sensors S driving fans F, e.g.\n"
+      "                      cpu/0-31/0,1/30:20,70:100, repeat per zone\n"
+      "  --zone-workers N    threads evaluating zones in parallel (default 0)\n"
+      "  --event-loop        run the single threaded epoll controller core\n"
+      "  --cpu N             pin the event loop to CPU N\n"
+      "  --register-device F fan registers are mmapped from F, e.g. a\n"
+      "                      /dev/shm stand-in, checked after the run\n"
+      "  --register-stride B bytes between fan registers (default 4)\n"
+      "  --register-stand-in create or grow the register device as a file\n"
+      "  --telemetry P       record sensor samples and register sets to\n"
+      "                      P.<n>.tlm, read them with telemetry_reader\n"
+      "  --telemetry-mb N    rotate telemetry files at N MiB (default 64)\n"
+      "  --transport T       semaphore, seqlock, ring or slots (default "
+      "semaphore)\n"
+      "  --subsystems N      slots transport, subsystems owning a slot each "
+      "(default 1)\n"
+      "  --shards N          slots transport, split the subsystems between N\n"
+      "                      ingest processes feeding the controller their\n"
+      "                      maxima, zones then list shards\n"
+      "  --shard-cpus A,B,.. pin shard i to the i-th CPU\n"
+      "  --pattern P         ramp, square, random or trace (default ramp)\n"
+      "  --trace FILE        sensor_id,value rows for the trace pattern\n"
+      "  --rate HZ           sensor updates per second, 0 = unlimited\n"
+      "  --duration S        run time in seconds (default 10)\n"
+      "  --min C / --max C   temperature range (default 20 / 80)\n"
+      "  --period S          ramp and square period in seconds (default 1)\n"
+      "  --batch N           max updates published at once (default 64)\n"
+      "  --seed N            random walk seed\n"
+      "  --no-controller     attach to an already running controller\n");
+}
+
+int main(int argc, char* argv[]) {
+  static const option long_options[] = {
+      {"sensors", required_argument, nullptr, 's'},
+      {"fans", required_argument, nullptr, 'f'},
+      {"max-pwm", required_argument, nullptr, 'p'},
+      {"curve", required_argument, nullptr, 'c'},
+      {"control-rate", required_argument, nullptr, 'C'},
+      {"coalesce", required_argument, nullptr, 'o'},
+      {"hysteresis", required_argument, nullptr, 'H'},
+      {"min-duty-delta", required_argument, nullptr, 'D'},
+      {"slew-rate", required_argument, nullptr, 'W'},
+      {"zone", required_argument, nullptr, 'z'},
+      {"zone-workers", required_argument, nullptr, 'k'},
+      {"event-loop", no_argument, nullptr, 'E'},
+      {"cpu", required_argument, nullptr, 'u'},
+      {"register-device", required_argument, nullptr, 'R'},
+      {"register-stride", required_argument, nullptr, 'B'},
+      {"register-stand-in", no_argument, nullptr, 'I'},
+      {"telemetry", required_argument, nullptr, 'L'},
+      {"telemetry-mb", required_argument, nullptr, 'Z'},
+      {"transport", required_argument, nullptr, 't'},
+      {"subsystems", required_argument, nullptr, 'y'},
+      {"shards", required_argument, nullptr, 'x'},
+      {"shard-cpus", required_argument, nullptr, 'X'},
+      {"pattern", required_argument, nullptr, 'P'},
+      {"trace", required_argument, nullptr, 'T'},
+      {"rate", required_argument, nullptr, 'r'},
+      {"duration", required_argument, nullptr, 'd'},
+      {"min", required_argument, nullptr, 'm'},
+      {"max", required_argument, nullptr, 'M'},
+      {"period", required_argument, nullptr, 'e'},
+      {"batch", required_argument, nullptr, 'b'},
+      {"seed", required_argument, nullptr, 'S'},
+      {"no-controller", no_argument, nullptr, 'n'},
+      {"help", no_argument, nullptr, 'h'},
+      {nullptr, 0, nullptr, 0}};
+
+  LoadGenOptions options;
+  uint32_t sensor_count = 1, fan_count = 1, subsystem_count = 1;
+  uint32_t shard_count = 0;
+  std::vector<int32_t> shard_cpus;
+  std::vector<u_int32_t> max_pwm_values;
+  std::vector<std::vector<CurvePoint>> fan_curves;
+  uint32_t control_rate_hz = 0, coalesce_window_us = 0, slew_rate = 0;
+  float hysteresis_c = 0, min_duty_delta = 0;
+  std::vector<ZoneConfig> zones;
+  uint32_t zone_workers = 0;
+  bool event_loop = false;
+  int32_t event_loop_cpu = -1;
+  std::string transport = "semaphore", pattern = "ramp", register_device;
+  uint32_t register_stride = 4;
+  bool register_stand_in = false;
+  std::string telemetry_path;
+  uint64_t telemetry_mb = 64;
+  int option;
+  while ((option = getopt_long(argc, argv, "", long_options, nullptr)) != -1) {
+    switch (option) {
+      case 's': sensor_count = atoi(optarg); break;
+      case 'f': fan_count = atoi(optarg); break;
+      case 'p':
+        if (!ParseMaxPwmList(optarg, &max_pwm_values)) {
+          LOG_ERROR("Invalid max PWM list %s\n", optarg);
+          return -1;
+        }
+        break;
+      case 'c': {
+        std::vector<CurvePoint> curve;
+        if (!FanCurveEngine::ParseCurve(optarg, &curve)) {
+          LOG_ERROR("Invalid fan curve %s\n", optarg);
+          return -1;
+        }
+        fan_curves.push_back(curve);
+        break;
+      }
+      case 'C': control_rate_hz = atoi(optarg); break;
+      case 'o': coalesce_window_us = atoi(optarg); break;
+      case 'H': hysteresis_c = atof(optarg); break;
+      case 'D': min_duty_delta = atof(optarg); break;
+      case 'W': slew_rate = atoi(optarg); break;
+      case 'z': {
+        ZoneConfig zone;
+        if (!ControlAlgorithm::ParseZone(optarg, &zone)) {
+          LOG_ERROR("Invalid zone %s\n", optarg);
+          return -1;
+        }
+        zones.push_back(zone);
+        break;
+      }
+      case 'k': zone_workers = atoi(optarg); break;
+      case 'E': event_loop = true; break;
+      case 'u': event_loop_cpu = atoi(optarg); break;
+      case 'R': register_device = optarg; break;
+      case 'B': register_stride = atoi(optarg); break;
+      case 'I': register_stand_in = true; break;
+      case 'L': telemetry_path = optarg; break;
+      case 'Z': telemetry_mb = atoi(optarg); break;
+      case 't': transport = optarg; break;
+      case 'y': subsystem_count = atoi(optarg); break;
+      case 'x': shard_count = atoi(optarg); break;
+      case 'X': {
+        std::istringstream cpus(optarg);
+        std::string cpu;
+        while (std::getline(cpus, cpu, ','))
+          shard_cpus.push_back(atoi(cpu.c_str()));
+        break;
+      }
+      case 'P': pattern = optarg; break;
+      case 'T': options.trace_path_ = optarg; break;
+      case 'r': options.rate_hz_ = atof(optarg); break;
+      case 'd': options.duration_s_ = atof(optarg); break;
+      case 'm': options.min_temp_ = atof(optarg); break;
+      case 'M': options.max_temp_ = atof(optarg); break;
+      case 'e': options.period_s_ = atof(optarg); break;
+      case 'b': options.batch_size_ = atoi(optarg); break;
+      case 'S': options.seed_ = atoi(optarg); break;
+      case 'n': options.spawn_controller_ = false; break;
+      default:
+        PrintUsage();
+        return -1;
+    }
+  }
+
+  if (sensor_count == 0 || sensor_count > MAX_SENSOR_COUNT) {
+    LOG_ERROR("Please enter valid sensor count between 1 and %d\n",
+              MAX_SENSOR_COUNT);
+    return -1;
+  }
+  if (fan_count == 0 || fan_count > MAX_FAN_COUNT) {
+    LOG_ERROR("Please enter valid fan count between 1 and %d\n",
+              MAX_FAN_COUNT);
+    return -1;
+  }
+  if (max_pwm_values.empty()) max_pwm_values.assign(fan_count, 1000);
+  if (max_pwm_values.size() != fan_count) {
+    LOG_ERROR("Need exactly one max PWM value per fan\n");
+    return -1;
+  }
+  if (subsystem_count == 0 || subsystem_count > sensor_count) {
+    LOG_ERROR("Subsystem count must be between 1 and the sensor count\n");
+    return -1;
+  }
+  if (fan_curves.size() > 1 && fan_curves.size() != fan_count) {
+    LOG_ERROR("Need either one fan curve or one per fan\n");
+    return -1;
+  }
+  if (hysteresis_c < 0 || min_duty_delta < 0) {
+    LOG_ERROR("Hysteresis and minimum duty cycle delta must not be negative\n");
+    return -1;
+  }
+  if (options.batch_size_ == 0 || options.period_s_ <= 0 ||
+      options.min_temp_ > options.max_temp_) {
+    LOG_ERROR("Invalid batch size, period or temperature range\n");
+    return -1;
+  }
+
+  options.config_ = InputConfiguration(fan_count, sensor_count);
+  options.config_.max_pwm_values = max_pwm_values;
+  options.config_.fan_curves_ = fan_curves;
+  options.config_.control_rate_hz_ = control_rate_hz;
+  options.config_.coalesce_window_us_ = coalesce_window_us;
+  options.config_.hysteresis_c_ = hysteresis_c;
+  options.config_.min_duty_delta_ = min_duty_delta;
+  options.config_.slew_rate_ = slew_rate;
+  options.config_.zones_ = zones;
+  options.config_.zone_workers_ = zone_workers;
+  options.config_.shard_count_ = shard_count;
+  options.config_.shard_cpus_ = shard_cpus;
+  if (!ControlAlgorithm::ValidateZones(ControlConfig(options.config_)))
+    return -1;
+  options.config_.event_loop_ = event_loop;
+  options.config_.event_loop_cpu_ = event_loop_cpu;
+  options.config_.register_device_ = register_device;
+  options.config_.register_stride_ = register_stride;
+  options.config_.register_stand_in_ = register_stand_in;
+  options.config_.telemetry_path_ = telemetry_path;
+  options.config_.telemetry_file_bytes_ = telemetry_mb << 20;
+  if (transport == "seqlock") {
+    options.config_.transport_ = SensorTransport::SEQLOCK;
+  } else if (transport == "ring") {
+    options.config_.transport_ = SensorTransport::RING;
+  } else if (transport == "slots") {
+    options.config_.transport_ = SensorTransport::SLOTS;
+    options.config_.subsystem_count_ = subsystem_count;
+  } else if (transport != "semaphore") {
+    LOG_ERROR(
+        "Sensor transport must be one of semaphore, seqlock, ring or slots\n");
+    return -1;
+  }
+  if (shard_count > 0 &&
+      (options.config_.transport_ != SensorTransport::SLOTS || event_loop ||
+       shard_count > subsystem_count)) {
+    LOG_ERROR(
+        "Shards need the slots transport with at least one subsystem per "
+        "shard and no event loop\n");
+    return -1;
+  }
+  if (pattern == "square") {
+    options.pattern_ = Pattern::SQUARE;
+  } else if (pattern == "random") {
+    options.pattern_ = Pattern::RANDOM_WALK;
+  } else if (pattern == "trace") {
+    options.pattern_ = Pattern::TRACE;
+    if (options.trace_path_.empty()) {
+      LOG_ERROR("The trace pattern needs --trace FILE\n");
+      return -1;
+    }
+  } else if (pattern != "ramp") {
+    LOG_ERROR("Pattern must be one of ramp, square, random or trace\n");
+    return -1;
+  }
+
+  LoadGenerator generator(options);
+  return generator.Run() ? 0 : -1;
+}
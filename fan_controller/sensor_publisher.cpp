@@ -0,0 +1,140 @@
+#include "sensor_publisher.h"
+#include <boost/interprocess/shared_memory_object.hpp>
+#include "shared_segment.h"
+using namespace boost::interprocess;
+
+namespace fan_controller {
+namespace loadgen {
+
+namespace {
+
+const std::string& MemoryName(SensorTransport transport) {
+  switch (transport) {
+    case SensorTransport::SEQLOCK:
+      return sensor_seqlock_memory_name;
+    case SensorTransport::RING:
+      return sensor_samples_memory_name;
+    case SensorTransport::SLOTS:
+      return sensor_slots_memory_name;
+    case SensorTransport::SEMAPHORE:
+    default:
+      return sensor_memory_name;
+  }
+}
+
+}  // namespace
+
+SensorPublisher::SensorPublisher(const InputConfiguration& config,
+                                 uint32_t max_batch)
+    : config_(config),
+      memory_name_(MemoryName(config.transport_)),
+      samples_(max_batch) {}
+
+bool SensorPublisher::Open() {
+  // Every run starts from fresh memory, unlike the GUI nothing is taken over
+  bool reused;
+  switch (config_.transport_) {
+    case SensorTransport::SEQLOCK:
+      if (!OwnSegment(memory_name_,
+                      sensor_seqlock_buffer::Size(config_.sensor_count_),
+                      config_.sensor_count_, &region_, &reused))
+        return false;
+      seqlock_buffer_ = new (region_.get_address())
+          sensor_seqlock_buffer(config_.sensor_count_);
+      values_ = seqlock_buffer_->values();
+      header_ = &seqlock_buffer_->header;
+      break;
+    case SensorTransport::RING:
+      if (!OwnSegment(memory_name_, sizeof(sensor_sample_ring),
+                      SAMPLE_RING_CAPACITY, &region_, &reused))
+        return false;
+      sample_ring_ = new (region_.get_address()) sensor_sample_ring;
+      header_ = &sample_ring_->header;
+      break;
+    case SensorTransport::SLOTS:
+      if (!OwnSegment(memory_name_,
+                      sensor_slot_buffer::Size(config_.sensor_count_,
+                                               config_.subsystem_count_),
+                      config_.sensor_count_, &region_, &reused))
+        return false;
+      slot_buffer_ = new (region_.get_address()) sensor_slot_buffer(
+          config_.sensor_count_, config_.subsystem_count_);
+      slot_open_.resize(config_.subsystem_count_, false);
+      touched_slots_.reserve(config_.subsystem_count_);
+      header_ = &slot_buffer_->header;
+      break;
+    case SensorTransport::SEMAPHORE:
+    default:
+      if (!OwnSegment(memory_name_,
+                      sensor_shared_memory_buffer::Size(config_.sensor_count_),
+                      config_.sensor_count_, &region_, &reused))
+        return false;
+      sensor_buffer_ = new (region_.get_address())
+          sensor_shared_memory_buffer(config_.sensor_count_);
+      values_ = sensor_buffer_->values();
+      header_ = &sensor_buffer_->header;
+      break;
+  }
+  header_->MarkReady();
+  // Waits for an event loop controller once here, so Publish never does
+  doorbell_.Connect();
+  return true;
+}
+
+SensorPublisher::~SensorPublisher() {
+  // Only the segment we created, not one of another producer
+  if (header_ != nullptr) shared_memory_object::remove(memory_name_.c_str());
+}
+
+void SensorPublisher::Publish(const uint32_t* ids, const float* values,
+                              uint32_t count) {
+  const uint64_t now = MonotonicNowNs();
+  header_->Beat(now);
+  switch (config_.transport_) {
+    case SensorTransport::SEQLOCK:
+      seqlock_buffer_->BeginWrite();
+      for (uint32_t i = 0; i < count; i++)
+        values_[ids[i]] = values[i];
+      seqlock_buffer_->EndWrite();
+      break;
+    case SensorTransport::RING: {
+      for (uint32_t i = 0; i < count; i++)
+        samples_[i] = SensorSample(ids[i], values[i], now);
+      sample_ring_->Push(samples_.data(), count);
+      break;
+    }
+    case SensorTransport::SLOTS:
+      for (uint32_t i = 0; i < count; i++) {
+        const uint32_t slot = slot_buffer_->SlotOf(ids[i]);
+        if (!slot_open_[slot]) {
+          slot_buffer_->BeginWrite(slot);
+          slot_open_[slot] = true;
+          touched_slots_.push_back(slot);
+        }
+        slot_buffer_->SlotValues(slot)[ids[i] - slot_buffer_->Slot(slot)
+                                                    ->first_sensor] = values[i];
+      }
+      for (uint32_t slot : touched_slots_) {
+        slot_buffer_->EndWrite(slot);
+        slot_open_[slot] = false;
+      }
+      touched_slots_.clear();
+      break;
+    case SensorTransport::SEMAPHORE:
+    default:
+      sensor_buffer_->mutex.wait();
+      for (uint32_t i = 0; i < count; i++)
+        values_[ids[i]] = values[i];
+      sensor_buffer_->mutex.post();
+      sensor_buffer_->nstored.post();
+      break;
+  }
+  doorbell_.Ring();
+}
+
+uint64_t SensorPublisher::DroppedSamples() const {
+  return sample_ring_ == nullptr ? 0 : sample_ring_->dropped.load();
+}
+
+}  // namespace loadgen
+}  // namespace fan_controller
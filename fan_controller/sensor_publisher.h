@@ -0,0 +1,71 @@
+#pragma once
+
+#include <boost/interprocess/mapped_region.hpp>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "common.h"
+#include "doorbell.h"
+#include "sample_ring.h"
+#include "sensor_slots.h"
+
+// SensorPublisher is the producer side of the sensor shared memory for the
+// configured transport. It creates the segment the same way
+// GUIWrapper::SendSensorValues does, but always from scratch, and removes it
+// again when destroyed. A segment owned by a running producer is left alone.
+// Used by the headless tools which stand in for the GUI.
+namespace fan_controller {
+namespace loadgen {
+
+class SensorPublisher {
+  const InputConfiguration config_;
+
+  // Name of the shared memory matching config_.transport_
+  const std::string memory_name_;
+
+  boost::interprocess::mapped_region region_;
+
+  // Mapped sensor shared memory, only the one matching the transport is set
+  sensor_shared_memory_buffer* sensor_buffer_ = nullptr;
+  sensor_seqlock_buffer* seqlock_buffer_ = nullptr;
+  sensor_sample_ring* sample_ring_ = nullptr;
+  sensor_slot_buffer* slot_buffer_ = nullptr;
+
+  // Header of the mapped buffer, beats on every publish
+  shared_segment_header* header_ = nullptr;
+
+  // Sensor value block of sensor_buffer_ or seqlock_buffer_
+  float* values_ = nullptr;
+
+  // Scratch space for building ring samples
+  std::vector<SensorSample> samples_;
+
+  // Scratch space for the slots a batch touches and whether they are open
+  std::vector<uint32_t> touched_slots_;
+  std::vector<bool> slot_open_;
+
+  // Wakes up the controller when it runs the event loop core
+  Doorbell doorbell_;
+
+ public:
+  // max_batch is the largest count ever passed to Publish
+  SensorPublisher(const InputConfiguration& config, uint32_t max_batch);
+  ~SensorPublisher();
+  SensorPublisher(SensorPublisher const& copy) = delete;
+  SensorPublisher& operator=(SensorPublisher const& copy) = delete;
+
+  // Creates the sensor segment, logs the problem and returns false if it
+  // cannot. Call once before Publish.
+  bool Open();
+
+  // Write count updates, values[i] goes to sensor ids[i]. With the SLOTS
+  // transport every touched slot is written once, as if each subsystem
+  // published its own part of the batch.
+  void Publish(const uint32_t* ids, const float* values, uint32_t count);
+
+  // Samples lost because the ring was full, always 0 for other transports
+  uint64_t DroppedSamples() const;
+};
+
+}  // namespace loadgen
+}  // namespace fan_controller
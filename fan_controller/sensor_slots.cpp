@@ -0,0 +1,147 @@
+#include "sensor_slots.h"
+#include <algorithm>
+#include <new>
+#include "futex.h"
+
+namespace {
+
+uint64_t RoundUpToCacheLine(uint64_t bytes) {
+  return (bytes + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE;
+}
+
+uint32_t SensorsPerSlot(uint32_t sensor_count, uint32_t slot_count) {
+  return (sensor_count + slot_count - 1) / slot_count;
+}
+
+uint32_t SlotStride(uint32_t sensors_per_slot) {
+  return RoundUpToCacheLine(sizeof(sensor_slot) +
+                            sensors_per_slot * sizeof(float));
+}
+
+uint32_t DirtyOffset() { return RoundUpToCacheLine(sizeof(sensor_slot_buffer)); }
+
+uint32_t SlotsOffset(uint32_t slot_count) {
+  return DirtyOffset() +
+         RoundUpToCacheLine((slot_count + 63) / 64 * sizeof(uint64_t));
+}
+
+}  // namespace
+
+uint64_t sensor_slot_buffer::Size(uint32_t sensor_count, uint32_t slot_count) {
+  return SlotsOffset(slot_count) +
+         static_cast<uint64_t>(slot_count) *
+             SlotStride(SensorsPerSlot(sensor_count, slot_count));
+}
+
+sensor_slot_buffer::sensor_slot_buffer(uint32_t sensor_count,
+                                       uint32_t slot_count)
+    : header(Size(sensor_count, slot_count), sensor_count,
+             SlotsOffset(slot_count)),
+      slot_count(slot_count),
+      sensors_per_slot(SensorsPerSlot(sensor_count, slot_count)),
+      slot_stride(SlotStride(sensors_per_slot)),
+      dirty_offset(DirtyOffset()),
+      generation(0),
+      waiters(0) {
+  for (uint32_t word = 0; word < DirtyWordCount(); word++)
+    new (&DirtyWords()[word]) std::atomic<uint64_t>(0);
+  for (uint32_t slot = 0; slot < slot_count; slot++) {
+    sensor_slot* s = new (Slot(slot)) sensor_slot;
+    s->version.store(0, std::memory_order_relaxed);
+    s->first_sensor = std::min(slot * sensors_per_slot, sensor_count);
+    s->count = std::min(sensors_per_slot, sensor_count - s->first_sensor);
+    s->reserved = 0;
+    std::fill(SlotValues(slot), SlotValues(slot) + s->count,
+              TEMP_HUNDRED_PERCENT_CUTOFF);
+  }
+}
+
+void sensor_slot_buffer::BeginWrite(uint32_t slot) {
+  std::atomic<uint32_t>& version = Slot(slot)->version;
+  version.store(version.load(std::memory_order_relaxed) + 1,
+                std::memory_order_relaxed);
+  // Make sure the odd version is visible before any of the values
+  std::atomic_thread_fence(std::memory_order_release);
+}
+
+void sensor_slot_buffer::EndWrite(uint32_t slot) {
+  std::atomic<uint32_t>& version = Slot(slot)->version;
+  version.store(version.load(std::memory_order_relaxed) + 1,
+                std::memory_order_release);
+  DirtyWords()[slot / 64].fetch_or(1ull << (slot % 64),
+                                   std::memory_order_release);
+  // seq_cst increment pairs with the waiters increment in WaitForUpdate
+  generation.fetch_add(1);
+  if (waiters.load() != 0) ::fan_controller::FutexWake(&generation);
+}
+
+uint32_t sensor_slot_buffer::TakeDirty(uint32_t* slots, uint32_t first_slot,
+                                       uint32_t end_slot) {
+  uint32_t count = 0;
+  std::atomic<uint64_t>* words = DirtyWords();
+  for (uint32_t word = first_slot / 64; word * 64 < end_slot; word++) {
+    // Cheap check first, clearing the bits needs the line exclusively
+    const uint64_t pending = words[word].load(std::memory_order_relaxed);
+    uint64_t mask = ~0ull;
+    if (word * 64 < first_slot) mask &= ~0ull << (first_slot % 64);
+    if (word * 64 + 64 > end_slot) mask &= ~(~0ull << (end_slot % 64));
+    if ((pending & mask) == 0) continue;
+    // Whole words are taken at once, shared ones only lose our bits
+    uint64_t bits =
+        mask == ~0ull
+            ? words[word].exchange(0, std::memory_order_acquire)
+            : words[word].fetch_and(~mask, std::memory_order_acquire) & mask;
+    while (bits != 0) {
+      slots[count++] = word * 64 + __builtin_ctzll(bits);
+      bits &= bits - 1;
+    }
+  }
+  return count;
+}
+
+void sensor_slot_buffer::ReadSlot(uint32_t slot, float* out) {
+  sensor_slot* s = Slot(slot);
+  const float* shared_values = SlotValues(slot);
+  uint32_t before, after;
+  do {
+    before = s->version.load(std::memory_order_acquire);
+    if (before & 1) continue;
+    for (uint32_t i = 0; i < s->count; i++) out[i] = shared_values[i];
+    std::atomic_thread_fence(std::memory_order_acquire);
+    after = s->version.load(std::memory_order_relaxed);
+    if (before == after) break;
+  } while (true);
+}
+
+void sensor_slot_buffer::RecoverWriter() {
+  for (uint32_t slot = 0; slot < slot_count; slot++) {
+    std::atomic<uint32_t>& version = Slot(slot)->version;
+    if (version.load() & 1) version.fetch_add(1);
+  }
+}
+
+void sensor_slot_buffer::WaitForUpdate(uint32_t last_generation) {
+  while (generation.load(std::memory_order_acquire) == last_generation) {
+    waiters.fetch_add(1);
+    if (generation.load() == last_generation)
+      ::fan_controller::FutexWait(&generation, last_generation);
+    waiters.fetch_sub(1);
+  }
+}
+
+bool sensor_slot_buffer::WaitForUpdate(uint32_t last_generation,
+                                       uint64_t timeout_ns) {
+  const uint64_t deadline = MonotonicNowNs() + timeout_ns;
+  while (generation.load(std::memory_order_acquire) == last_generation) {
+    const uint64_t now = MonotonicNowNs();
+    if (now >= deadline) return false;
+    timespec timeout;
+    timeout.tv_sec = (deadline - now) / 1000000000ull;
+    timeout.tv_nsec = (deadline - now) % 1000000000ull;
+    waiters.fetch_add(1);
+    if (generation.load() == last_generation)
+      ::fan_controller::FutexWait(&generation, last_generation, &timeout);
+    waiters.fetch_sub(1);
+  }
+  return true;
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include "common.h"
+
+// Name for the per subsystem sensor slots shared memory
+const std::string sensor_slots_memory_name = "SensorSlotsShared";
+
+// Header of one subsystem's slot, its float values follow directly
+struct sensor_slot {
+  // Seqlock counter of this slot alone, odd while the owner writes
+  std::atomic<uint32_t> version;
+  // Sensor ids first_sensor .. first_sensor + count - 1 live in this slot
+  uint32_t first_sensor;
+  uint32_t count;
+  uint32_t reserved;
+};
+
+// Sensor memory for many producer processes. The sensors are split into
+// consecutive ranges, one per subsystem, and every subsystem owns a slot
+// padded to whole cache lines with its own version counter, so subsystems
+// publish without a shared lock and without false sharing.
+// After writing its slot a producer sets the slot's bit in the dirty bitmap
+// and bumps generation, the controller takes the bitmap words and only reads
+// the slots marked dirty. An idle controller sleeps on generation.
+//
+// Layout: this struct, the dirty bitmap and the slots, each starting on a
+// cache line. header.count is the sensor count, header.data_offset the
+// offset of the first slot.
+struct sensor_slot_buffer {
+  shared_segment_header header;
+  uint32_t slot_count;
+  uint32_t sensors_per_slot;
+  // Bytes from one slot to the next, a multiple of CACHE_LINE_SIZE
+  uint32_t slot_stride;
+  uint32_t dirty_offset;
+
+  // Bumped on every publish, futex word for the sleeping controller
+  alignas(CACHE_LINE_SIZE) std::atomic<uint32_t> generation;
+  // Number of consumers sleeping on generation
+  std::atomic<uint32_t> waiters;
+
+  sensor_slot_buffer(uint32_t sensor_count, uint32_t slot_count);
+
+  // Bytes to allocate for sensor_count sensors split into slot_count slots
+  static uint64_t Size(uint32_t sensor_count, uint32_t slot_count);
+
+  sensor_slot* Slot(uint32_t slot) {
+    return reinterpret_cast<sensor_slot*>(reinterpret_cast<char*>(this) +
+                                          header.data_offset +
+                                          static_cast<uint64_t>(slot) *
+                                              slot_stride);
+  }
+  float* SlotValues(uint32_t slot) {
+    return reinterpret_cast<float*>(Slot(slot) + 1);
+  }
+  std::atomic<uint64_t>* DirtyWords() {
+    return reinterpret_cast<std::atomic<uint64_t>*>(
+        reinterpret_cast<char*>(this) + dirty_offset);
+  }
+  uint32_t DirtyWordCount() const { return (slot_count + 63) / 64; }
+
+  // Slot holding sensor_id
+  uint32_t SlotOf(uint32_t sensor_id) const {
+    return sensor_id / sensors_per_slot;
+  }
+
+  // Producer side, the values of slot may only be changed between these two
+  // calls and only by its owner. EndWrite marks the slot dirty and wakes up
+  // the controller.
+  void BeginWrite(uint32_t slot);
+  void EndWrite(uint32_t slot);
+
+  // Consumer side. Clears the dirty bitmap, writes the indices of the slots
+  // that were marked to slots and returns their number. slots needs room for
+  // slot_count entries.
+  uint32_t TakeDirty(uint32_t* slots) {
+    return TakeDirty(slots, 0, slot_count);
+  }
+
+  // TakeDirty for the slots first_slot .. end_slot - 1 only, the bits of
+  // other slots are left for their own consumers
+  uint32_t TakeDirty(uint32_t* slots, uint32_t first_slot, uint32_t end_slot);
+
+  // Copies a consistent snapshot of slot into out, out[0] is the slot's
+  // first sensor
+  void ReadSlot(uint32_t slot, float* out);
+
+  // Blocks until generation differs from last_generation
+  void WaitForUpdate(uint32_t last_generation);
+
+  // WaitForUpdate giving up after timeout_ns, returns false on timeout
+  bool WaitForUpdate(uint32_t last_generation, uint64_t timeout_ns);
+
+  // Completes slot writes the previous owner died in, see shared_segment.h
+  void RecoverWriter();
+};
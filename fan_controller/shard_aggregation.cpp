@@ -0,0 +1,105 @@
+#include "shard_aggregation.h"
+#include <signal.h>
+#include <unistd.h>
+#include <cerrno>
+#include <new>
+#include "futex.h"
+
+shard_max_buffer::shard_max_buffer(uint32_t shard_count)
+    : header(Size(shard_count), shard_count,
+             SharedBufferSize<shard_max_buffer, char>(0)),
+      generation(0),
+      waiters(0) {
+  for (uint32_t shard = 0; shard < shard_count; shard++) {
+    shard_max_entry* entry = new (Entry(shard)) shard_max_entry;
+    entry->version.store(0, std::memory_order_relaxed);
+    entry->pid.store(0, std::memory_order_relaxed);
+    entry->max_temp = TEMP_HUNDRED_PERCENT_CUTOFF;
+    entry->reserved = 0;
+    entry->update_ns = 0;
+    entry->publish_ns = 0;
+    entry->heartbeat_ns.store(0, std::memory_order_relaxed);
+  }
+}
+
+void shard_max_buffer::Write(uint32_t shard, float max_temp,
+                             uint64_t update_ns, uint64_t publish_ns) {
+  shard_max_entry* entry = Entry(shard);
+  entry->version.store(entry->version.load(std::memory_order_relaxed) + 1,
+                       std::memory_order_relaxed);
+  // Make sure the odd version is visible before any of the values
+  std::atomic_thread_fence(std::memory_order_release);
+  entry->max_temp = max_temp;
+  entry->update_ns = update_ns;
+  entry->publish_ns = publish_ns;
+  entry->version.store(entry->version.load(std::memory_order_relaxed) + 1,
+                       std::memory_order_release);
+}
+
+void shard_max_buffer::Publish(uint32_t shard, float max_temp,
+                               uint64_t update_ns) {
+  Write(shard, max_temp, update_ns, MonotonicNowNs());
+  // seq_cst increment pairs with the waiters increment in WaitForUpdate
+  generation.fetch_add(1);
+  if (waiters.load() != 0) ::fan_controller::FutexWake(&generation);
+}
+
+void shard_max_buffer::Claim(uint32_t shard) {
+  shard_max_entry* entry = Entry(shard);
+  if (entry->version.load() & 1) entry->version.fetch_add(1);
+  entry->pid.store(getpid());
+  Beat(shard, MonotonicNowNs());
+}
+
+uint32_t shard_max_buffer::Read(uint32_t shard, float* max_temp,
+                                uint64_t* update_ns, uint64_t* publish_ns) {
+  const shard_max_entry* entry = Entry(shard);
+  uint32_t before, after;
+  do {
+    before = entry->version.load(std::memory_order_acquire);
+    if (before & 1) continue;
+    *max_temp = entry->max_temp;
+    *update_ns = entry->update_ns;
+    *publish_ns = entry->publish_ns;
+    std::atomic_thread_fence(std::memory_order_acquire);
+    after = entry->version.load(std::memory_order_relaxed);
+    if (before == after) break;
+  } while (true);
+  return before;
+}
+
+bool shard_max_buffer::ShardAlive(uint32_t shard, uint64_t now_ns) {
+  const uint64_t beat =
+      Entry(shard)->heartbeat_ns.load(std::memory_order_relaxed);
+  return beat >= now_ns || now_ns - beat < SEGMENT_OWNER_TIMEOUT_NS;
+}
+
+void shard_max_buffer::ReleaseDeadShards() {
+  for (uint32_t shard = 0; shard < header.count; shard++) {
+    shard_max_entry* entry = Entry(shard);
+    const int32_t pid = entry->pid.load();
+    if (pid > 0 && kill(pid, 0) == 0) continue;
+    if (pid > 0 && errno == EPERM) continue;
+    if (entry->version.load() & 1) entry->version.fetch_add(1);
+    Write(shard, TEMP_HUNDRED_PERCENT_CUTOFF, 0, 0);
+    entry->pid.store(0);
+    entry->heartbeat_ns.store(0);
+  }
+}
+
+bool shard_max_buffer::WaitForUpdate(uint32_t last_generation,
+                                     uint64_t timeout_ns) {
+  const uint64_t deadline = MonotonicNowNs() + timeout_ns;
+  while (generation.load(std::memory_order_acquire) == last_generation) {
+    const uint64_t now = MonotonicNowNs();
+    if (now >= deadline) return false;
+    timespec timeout;
+    timeout.tv_sec = (deadline - now) / 1000000000ull;
+    timeout.tv_nsec = (deadline - now) % 1000000000ull;
+    waiters.fetch_add(1);
+    if (generation.load() == last_generation)
+      ::fan_controller::FutexWait(&generation, last_generation, &timeout);
+    waiters.fetch_sub(1);
+  }
+  return true;
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include "common.h"
+
+// Name for the shard maxima shared memory
+const std::string shard_max_memory_name = "ShardMaxShared";
+
+// Latest local maximum of one shard, each on a cache line of its own so
+// shards never write the same line
+struct alignas(CACHE_LINE_SIZE) shard_max_entry {
+  // Seqlock counter of this entry, odd while the shard writes
+  std::atomic<uint32_t> version;
+  // Ingest process owning the shard, 0 before it attached
+  std::atomic<int32_t> pid;
+  // Maximum over the shard's sensors in degree celcius
+  float max_temp;
+  uint32_t reserved;
+  // CLOCK_MONOTONIC time in ns the shard picked up the first sensor update
+  // behind max_temp and the time it published max_temp
+  uint64_t update_ns;
+  uint64_t publish_ns;
+  // Refreshed by the shard at least every SEGMENT_HEARTBEAT_INTERVAL_NS, 0
+  // before it attached
+  std::atomic<uint64_t> heartbeat_ns;
+};
+
+// Aggregation memory of the sharded mode, see shard_ingest.h. Owned by the
+// controller, every shard process writes its own entry only, so publishing
+// takes no lock. After writing its entry a shard bumps generation, the
+// controller sleeps on it and reads the entries whose version moved.
+//
+// Layout: this struct followed by header.count entries.
+struct shard_max_buffer {
+  shared_segment_header header;
+  shard_max_buffer(uint32_t shard_count);
+
+  // Bumped on every publish, futex word for the sleeping controller
+  alignas(CACHE_LINE_SIZE) std::atomic<uint32_t> generation;
+  // Number of consumers sleeping on generation
+  std::atomic<uint32_t> waiters;
+
+  // Seqlock protected write of entry shard
+  void Write(uint32_t shard, float max_temp, uint64_t update_ns,
+             uint64_t publish_ns);
+
+  shard_max_entry* Entry(uint32_t shard) {
+    return reinterpret_cast<shard_max_entry*>(reinterpret_cast<char*>(this) +
+                                              header.data_offset) +
+           shard;
+  }
+
+  // Shard side, stores max_temp as the maximum of shard and wakes up the
+  // controller. Only called by the shard's owner.
+  void Publish(uint32_t shard, float max_temp, uint64_t update_ns);
+
+  // Shard side, marks the calling process alive at now_ns
+  void Beat(uint32_t shard, uint64_t now_ns) {
+    Entry(shard)->heartbeat_ns.store(now_ns, std::memory_order_relaxed);
+  }
+
+  // Shard side, makes the calling process the owner of shard and completes a
+  // publish its previous owner died in
+  void Claim(uint32_t shard);
+
+  // Copies a consistent snapshot of entry shard and returns the version it
+  // belongs to
+  uint32_t Read(uint32_t shard, float* max_temp, uint64_t* update_ns,
+                uint64_t* publish_ns);
+
+  // Whether the owner of shard beat within SEGMENT_OWNER_TIMEOUT_NS of now_ns
+  bool ShardAlive(uint32_t shard, uint64_t now_ns);
+
+  // Controller side after taking the memory over, shards whose process is
+  // gone count as never attached again and hold the start up value
+  void ReleaseDeadShards();
+
+  // Blocks until generation differs from last_generation or timeout_ns
+  // passed. Returns false on timeout.
+  bool WaitForUpdate(uint32_t last_generation, uint64_t timeout_ns);
+
+  // Bytes to allocate for shard_count shards
+  static uint64_t Size(uint32_t shard_count) {
+    return SharedBufferSize<shard_max_buffer, shard_max_entry>(shard_count);
+  }
+};
@@ -0,0 +1,113 @@
+#include "shard_ingest.h"
+#include <sched.h>
+#include <string.h>
+#include "../logger/logger.h"
+#include "shared_segment.h"
+using namespace boost::interprocess;
+
+namespace fan_controller {
+namespace controller {
+
+ShardIngest::ShardIngest(const InputConfiguration& config, uint32_t shard)
+    : config_(config), shard_(shard), max_tree_(0, 0) {}
+
+bool ShardIngest::Attach() {
+  if (!AttachSegment(sensor_slots_memory_name, config_.sensor_count_,
+                     ATTACH_FOREVER, &slots_region_) ||
+      !AttachSegment(shard_max_memory_name, config_.shard_count_,
+                     ATTACH_FOREVER, &shards_region_))
+    return false;
+  slots_ = static_cast<sensor_slot_buffer*>(slots_region_.get_address());
+  shards_ = static_cast<shard_max_buffer*>(shards_region_.get_address());
+  if (slots_->slot_count < config_.shard_count_) {
+    LOG_ERROR("%d shards need at least as many subsystems, there are %d\n",
+              config_.shard_count_, slots_->slot_count);
+    return false;
+  }
+  first_slot_ = static_cast<uint64_t>(shard_) * slots_->slot_count /
+                config_.shard_count_;
+  end_slot_ = static_cast<uint64_t>(shard_ + 1) * slots_->slot_count /
+              config_.shard_count_;
+  first_sensor_ = slots_->Slot(first_slot_)->first_sensor;
+  const sensor_slot* last = slots_->Slot(end_slot_ - 1);
+  sensor_count_ = last->first_sensor + last->count - first_sensor_;
+  max_tree_ = MaxTree(sensor_count_, TEMP_HUNDRED_PERCENT_CUTOFF);
+  shards_->Claim(shard_);
+  LOG_INFO("Shard %d ingests slots %d to %d, sensors %d to %d\n", shard_,
+           first_slot_, end_slot_ - 1, first_sensor_,
+           first_sensor_ + sensor_count_ - 1);
+  return true;
+}
+
+void ShardIngest::ApplySlot(uint32_t slot, float* values) {
+  const sensor_slot* s = slots_->Slot(slot);
+  slots_->ReadSlot(slot, values);
+  const uint32_t offset = s->first_sensor - first_sensor_;
+  for (uint32_t i = 0; i < s->count; i++) {
+    if (values[i] != max_tree_.Value(offset + i))
+      max_tree_.Update(offset + i, values[i]);
+  }
+}
+
+void ShardIngest::Report(uint64_t now) {
+  if (publishes_ != 0) {
+    LOG_INFO(
+        "Shard %d published %lu maxima, pick up to publish us p50 %.1f p99 "
+        "%.1f max %.1f\n",
+        shard_, publishes_, ingest_ns_.ValueAtPercentile(50) / 1e3,
+        ingest_ns_.ValueAtPercentile(99) / 1e3, ingest_ns_.Max() / 1e3);
+  }
+  ingest_ns_.Reset();
+  publishes_ = 0;
+  last_report_ns_ = now;
+}
+
+void ShardIngest::Run() {
+  std::vector<uint32_t> dirty(end_slot_ - first_slot_);
+  std::vector<float> values(slots_->sensors_per_slot);
+  // Start from everything the slots hold, later only from the dirty ones
+  slots_->TakeDirty(dirty.data(), first_slot_, end_slot_);
+  for (uint32_t slot = first_slot_; slot < end_slot_; slot++)
+    ApplySlot(slot, values.data());
+  bool published = false;
+  float published_max = 0;
+  while (true) {
+    const uint32_t generation =
+        slots_->generation.load(std::memory_order_acquire);
+    const uint64_t now = MonotonicNowNs();
+    shards_->Beat(shard_, now);
+    const uint32_t count =
+        slots_->TakeDirty(dirty.data(), first_slot_, end_slot_);
+    for (uint32_t i = 0; i < count; i++) ApplySlot(dirty[i], values.data());
+    // Only moves of the maximum cross over to the controller
+    const float max_temp = max_tree_.Max();
+    if (!published || max_temp != published_max) {
+      shards_->Publish(shard_, max_temp, now);
+      ingest_ns_.Record(MonotonicNowNs() - now);
+      publishes_++;
+      published = true;
+      published_max = max_temp;
+    }
+    if (now - last_report_ns_ >= 1000000000ull) Report(now);
+    // Wake up once per heartbeat interval to show the shard is alive
+    slots_->WaitForUpdate(generation, SEGMENT_HEARTBEAT_INTERVAL_NS);
+  }
+}
+
+bool StartShard(const InputConfiguration config, uint32_t shard) {
+  if (shard < config.shard_cpus_.size() && config.shard_cpus_[shard] >= 0) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(config.shard_cpus_[shard], &cpus);
+    if (sched_setaffinity(0, sizeof(cpus), &cpus) < 0)
+      LOG_WARNING("Pinning shard %d to CPU %d failed: %s\n", shard,
+                  config.shard_cpus_[shard], strerror(errno));
+  }
+  ShardIngest ingest(config, shard);
+  if (!ingest.Attach()) return false;
+  ingest.Run();
+  return true;
+}
+
+}  // namespace controller
+}  // namespace fan_controller
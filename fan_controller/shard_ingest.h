@@ -0,0 +1,70 @@
+#pragma once
+
+#include <boost/interprocess/mapped_region.hpp>
+#include <cstdint>
+#include <vector>
+#include "common.h"
+#include "histogram.h"
+#include "max_tree.h"
+#include "sensor_slots.h"
+#include "shard_aggregation.h"
+
+// Ingest process of the sharded mode, InputConfiguration::shard_count_ > 0.
+// Sensors arrive through the SLOTS transport and its subsystem slots are
+// split into shard_count_ consecutive ranges, one per ingest process. A shard
+// only takes the dirty bits of its own slots, keeps the maximum over their
+// sensors in a MaxTree and publishes it into the controller's
+// shard_max_buffer whenever it moved. The controller then controls on one
+// value per shard, see Controller::ReceiveSensorsShards.
+namespace fan_controller {
+namespace controller {
+
+class ShardIngest {
+  const InputConfiguration config_;
+  const uint32_t shard_;
+
+  boost::interprocess::mapped_region slots_region_, shards_region_;
+  sensor_slot_buffer* slots_ = nullptr;
+  shard_max_buffer* shards_ = nullptr;
+
+  // The shard's slots are first_slot_ .. end_slot_ - 1, holding
+  // sensor_count_ sensors from first_sensor_ on
+  uint32_t first_slot_ = 0;
+  uint32_t end_slot_ = 0;
+  uint32_t first_sensor_ = 0;
+  uint32_t sensor_count_ = 0;
+
+  // Maximum over the shard's sensors, slot 0 is first_sensor_
+  MaxTree max_tree_;
+
+  // Time from picking up sensor updates to their maximum being published in
+  // ns and publishes since the last report
+  Histogram ingest_ns_;
+  uint64_t publishes_ = 0;
+  uint64_t last_report_ns_ = 0;
+
+  // Reads slot and applies its sensors to max_tree_, values is scratch
+  // space for sensors_per_slot values
+  void ApplySlot(uint32_t slot, float* values);
+
+  // Logs and resets the ingest statistics
+  void Report(uint64_t now);
+
+ public:
+  ShardIngest(const InputConfiguration& config, uint32_t shard);
+
+  // Waits for the sensor slots and the controller's shard maxima and claims
+  // the shard's entry. Returns false if the layouts do not fit the
+  // configuration.
+  bool Attach();
+
+  // Publishes the shard maximum on every change, never returns
+  void Run();
+};
+
+// Runs ingest process shard, pinned to its entry of shard_cpus_ if given.
+// Returns false if it could not start.
+bool StartShard(const InputConfiguration config, uint32_t shard);
+
+}  // namespace controller
+}  // namespace fan_controller
@@ -0,0 +1,92 @@
+#include "shared_segment.h"
+#include <unistd.h>
+#include <boost/interprocess/shared_memory_object.hpp>
+#include "../logger/logger.h"
+using namespace boost::interprocess;
+
+namespace fan_controller {
+
+namespace {
+
+// How often AttachSegment looks for the segment
+const useconds_t ATTACH_POLL_US = 1000;
+
+// Maps segment name if it holds at least a header, returns false otherwise
+bool MapExisting(const std::string& name, mapped_region* region) {
+  try {
+    shared_memory_object shm(open_only, name.c_str(), read_write);
+    offset_t size = 0;
+    if (!shm.get_size(size) ||
+        size < static_cast<offset_t>(sizeof(shared_segment_header)))
+      return false;
+    mapped_region(shm, read_write).swap(*region);
+    return true;
+  } catch (interprocess_exception&) {
+    return false;
+  }
+}
+
+}  // namespace
+
+bool OwnSegment(const std::string& name, uint64_t size, uint32_t count,
+                mapped_region* region, bool* reused) {
+  *reused = false;
+  mapped_region existing;
+  if (MapExisting(name, &existing)) {
+    shared_segment_header* header =
+        static_cast<shared_segment_header*>(existing.get_address());
+    if (header->Ready() && header->OwnerAlive() &&
+        header->owner_pid.load() != getpid()) {
+      LOG_ERROR("%s is owned by the running process %d\n", name.c_str(),
+                header->owner_pid.load());
+      return false;
+    }
+    if (header->Ready() && header->size == size && header->count == count &&
+        existing.get_size() >= size) {
+      LOG_INFO("Taking over %s from process %d\n", name.c_str(),
+               header->owner_pid.load());
+      existing.swap(*region);
+      *reused = true;
+      return true;
+    }
+  }
+  try {
+    shared_memory_object::remove(name.c_str());
+    shared_memory_object shm(create_only, name.c_str(), read_write);
+    shm.truncate(size);
+    mapped_region(shm, read_write).swap(*region);
+  } catch (interprocess_exception& e) {
+    LOG_ERROR("Creating %s failed: %s\n", name.c_str(), e.what());
+    return false;
+  }
+  return true;
+}
+
+bool AttachSegment(const std::string& name, uint32_t count,
+                   uint64_t timeout_ns, mapped_region* region,
+                   bool live_owner) {
+  const uint64_t start = MonotonicNowNs();
+  while (true) {
+    mapped_region candidate;
+    if (MapExisting(name, &candidate)) {
+      const shared_segment_header* header =
+          static_cast<const shared_segment_header*>(candidate.get_address());
+      if (header->Ready() && (!live_owner || header->OwnerAlive()) &&
+          candidate.get_size() >= header->size) {
+        if (header->count != count) {
+          LOG_ERROR("%s holds %d elements, expected %d\n", name.c_str(),
+                    header->count, count);
+          return false;
+        }
+        candidate.swap(*region);
+        return true;
+      }
+    }
+    const uint64_t waited = MonotonicNowNs() - start;
+    if (timeout_ns != ATTACH_FOREVER && waited >= timeout_ns) return false;
+    LOG_INFO_THROTTLED(1000, "Waiting for %s to become ready\n", name.c_str());
+    usleep(ATTACH_POLL_US);
+  }
+}
+
+}  // namespace fan_controller
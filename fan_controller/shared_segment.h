@@ -0,0 +1,36 @@
+#pragma once
+
+#include <boost/interprocess/mapped_region.hpp>
+#include <cstdint>
+#include <string>
+#include "common.h"
+
+// Creating and attaching shared segments with the readiness handshake of
+// shared_segment_header. Owners never remove their segments: a restarted
+// owner takes over the segment it left behind, so peers that still map it
+// carry on without noticing more than a gap in the updates.
+namespace fan_controller {
+
+// Waits forever in AttachSegment
+const uint64_t ATTACH_FOREVER = UINT64_MAX;
+
+// Maps segment name of size bytes holding count elements for the calling
+// process to own. A ready segment of the same layout whose owner is gone is
+// kept as is and *reused is set: the caller skips constructing the buffer and
+// only repairs what a dying writer may have left, e.g. RecoverWriter. Any
+// other segment is replaced by a zero filled one to construct the buffer in.
+// Either way the caller finishes with header.MarkReady(). Returns false if a
+// live process owns the segment.
+bool OwnSegment(const std::string& name, uint64_t size, uint32_t count,
+                boost::interprocess::mapped_region* region, bool* reused);
+
+// Waits up to timeout_ns for segment name to be marked ready by a live owner
+// and maps it. Without live_owner it also takes what a stopped owner left
+// behind. Returns false on timeout or if it holds a count other than the
+// expected one.
+bool AttachSegment(const std::string& name, uint32_t count,
+                   uint64_t timeout_ns,
+                   boost::interprocess::mapped_region* region,
+                   bool live_owner = true);
+
+}  // namespace fan_controller
@@ -0,0 +1,130 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+// On disk layout of the telemetry recorder, shared by the recorder and the
+// telemetry_reader tool.
+//
+// A file starts with a TELEMETRY_HEADER_SIZE byte TelemetryFileHeader
+// followed by BLOCK_SIZE byte blocks. Block position p sits at
+// TELEMETRY_HEADER_SIZE + p * block_size. Every (index_interval + 1)th
+// position is an index block describing the index_interval data blocks
+// before it, so a reader can skip whole groups by time without touching
+// their data.
+// Data blocks are columnar: the header is followed by one array per field,
+// each capacity entries long. Records are appended in time order per stream
+// and count is published after each record, so a crashed recording is
+// readable up to the last complete record.
+namespace fan_controller {
+namespace telemetry {
+
+const char FILE_MAGIC[8] = {'F', 'A', 'N', 'T', 'L', 'M', '0', '1'};
+const uint32_t FORMAT_VERSION = 1;
+const uint32_t TELEMETRY_HEADER_SIZE = 4096;
+const uint32_t BLOCK_SIZE = 64 * 1024;
+const uint32_t INDEX_INTERVAL = 64;
+const uint32_t BLOCK_MAGIC = 0x4b4c4254;  // "TBLK"
+
+enum BlockKind : uint32_t {
+  // Columns: uint64_t monotonic_ns, uint32_t sensor_id, float value
+  SENSOR_BLOCK = 1,
+  // Columns: uint64_t monotonic_ns, float max_temp, float duty_cycle and
+  // fan_count uint32_t registers per record
+  CONTROL_BLOCK = 2,
+  // IndexEntry array
+  INDEX_BLOCK = 3,
+};
+
+struct TelemetryFileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t block_size;
+  uint32_t index_interval;
+  uint32_t fan_count;
+  uint32_t sensor_count;
+  // Rotation counter, 0 for the first file of a recording
+  uint32_t file_sequence;
+  // CLOCK_MONOTONIC and CLOCK_REALTIME at the start of the recording, maps
+  // record timestamps to wall clock time
+  uint64_t monotonic_origin_ns;
+  uint64_t realtime_origin_ns;
+};
+
+struct TelemetryBlockHeader {
+  uint32_t magic;
+  uint32_t kind;
+  uint32_t capacity;
+  // Records written so far, or index entries for an index block
+  std::atomic<uint32_t> count;
+  uint64_t first_ns;
+  std::atomic<uint64_t> last_ns;
+  uint8_t reserved[32];
+};
+static_assert(sizeof(TelemetryBlockHeader) == 64,
+              "block header must stay one cache line");
+
+// Describes one closed data block
+struct IndexEntry {
+  uint32_t position;
+  uint32_t kind;
+  uint32_t count;
+  uint32_t reserved;
+  uint64_t first_ns;
+  uint64_t last_ns;
+};
+
+// Records per block and byte offsets of the columns inside a block
+struct BlockLayout {
+  uint32_t capacity;
+  uint32_t column_offset[4];
+
+  static BlockLayout Sensor() {
+    BlockLayout layout;
+    const uint32_t record = sizeof(uint64_t) + sizeof(uint32_t) + sizeof(float);
+    layout.capacity = (BLOCK_SIZE - sizeof(TelemetryBlockHeader)) / record;
+    layout.column_offset[0] = sizeof(TelemetryBlockHeader);
+    layout.column_offset[1] =
+        layout.column_offset[0] + layout.capacity * sizeof(uint64_t);
+    layout.column_offset[2] =
+        layout.column_offset[1] + layout.capacity * sizeof(uint32_t);
+    layout.column_offset[3] = 0;
+    return layout;
+  }
+
+  static BlockLayout Control(uint32_t fan_count) {
+    BlockLayout layout;
+    const uint32_t record = sizeof(uint64_t) + 2 * sizeof(float) +
+                            fan_count * sizeof(uint32_t);
+    layout.capacity = (BLOCK_SIZE - sizeof(TelemetryBlockHeader)) / record;
+    layout.column_offset[0] = sizeof(TelemetryBlockHeader);
+    layout.column_offset[1] =
+        layout.column_offset[0] + layout.capacity * sizeof(uint64_t);
+    layout.column_offset[2] =
+        layout.column_offset[1] + layout.capacity * sizeof(float);
+    layout.column_offset[3] =
+        layout.column_offset[2] + layout.capacity * sizeof(float);
+    return layout;
+  }
+
+  static uint32_t IndexCapacity() {
+    return (BLOCK_SIZE - sizeof(TelemetryBlockHeader)) / sizeof(IndexEntry);
+  }
+};
+
+inline bool IsIndexPosition(uint32_t position) {
+  return position % (INDEX_INTERVAL + 1) == INDEX_INTERVAL;
+}
+
+// Index block of the group holding data block position
+inline uint32_t IndexPositionOf(uint32_t position) {
+  return position / (INDEX_INTERVAL + 1) * (INDEX_INTERVAL + 1) +
+         INDEX_INTERVAL;
+}
+
+inline uint64_t BlockOffset(uint32_t position) {
+  return TELEMETRY_HEADER_SIZE + static_cast<uint64_t>(position) * BLOCK_SIZE;
+}
+
+}  // namespace telemetry
+}  // namespace fan_controller
@@ -0,0 +1,225 @@
+// Prints the records of telemetry files written by the controller as CSV.
+// Times are seconds since the start of the recording. With --from / --to only
+// blocks overlapping the time range are touched: index blocks tell which
+// blocks of a group to skip and a binary search on the time column finds the
+// first record inside a block.
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <string>
+#include <vector>
+#include "../logger/logger.h"
+#include "telemetry_format.h"
+
+using namespace ::fan_controller::telemetry;
+
+namespace {
+
+struct ReadOptions {
+  // Time range in seconds since the start of the recording
+  double from_s = 0;
+  double to_s = std::numeric_limits<double>::infinity();
+  bool sensors = true;
+  bool control = true;
+};
+
+// Blocks looked at and records printed over all files
+uint64_t blocks_read = 0;
+uint64_t records_printed = 0;
+
+void PrintUsage() {
+  LOG_ERROR(
+      "Usage: telemetry_reader [options] FILE...\n"
+      "  --from S      first second of the recording to print (default 0)\n"
+      "  --to S        last second of the recording to print (default end)\n"
+      "  --sensors     print sensor samples only\n"
+      "  --control     print control records only\n");
+}
+
+// Prints the records of one data block with a timestamp in [from_ns, to_ns]
+void PrintBlock(const char* block, uint32_t fan_count, uint64_t origin_ns,
+                uint64_t from_ns, uint64_t to_ns) {
+  const TelemetryBlockHeader* header =
+      reinterpret_cast<const TelemetryBlockHeader*>(block);
+  const BlockLayout layout = header->kind == SENSOR_BLOCK
+                                 ? BlockLayout::Sensor()
+                                 : BlockLayout::Control(fan_count);
+  const uint32_t count = std::min(
+      header->count.load(std::memory_order_acquire), layout.capacity);
+  const uint64_t* times =
+      reinterpret_cast<const uint64_t*>(block + layout.column_offset[0]);
+  blocks_read++;
+  for (uint32_t i = std::lower_bound(times, times + count, from_ns) - times;
+       i < count && times[i] <= to_ns; i++) {
+    const double seconds =
+        (static_cast<int64_t>(times[i] - origin_ns)) / 1e9;
+    if (header->kind == SENSOR_BLOCK) {
+      const uint32_t* ids =
+          reinterpret_cast<const uint32_t*>(block + layout.column_offset[1]);
+      const float* values =
+          reinterpret_cast<const float*>(block + layout.column_offset[2]);
+      std::printf("sensor,%.9f,%u,%f\n", seconds, ids[i], values[i]);
+    } else {
+      const float* max_temps =
+          reinterpret_cast<const float*>(block + layout.column_offset[1]);
+      const float* duty_cycles =
+          reinterpret_cast<const float*>(block + layout.column_offset[2]);
+      const uint32_t* registers =
+          reinterpret_cast<const uint32_t*>(block + layout.column_offset[3]) +
+          static_cast<uint64_t>(i) * fan_count;
+      std::printf("control,%.9f,%f,%f,", seconds, max_temps[i],
+                  duty_cycles[i]);
+      for (uint32_t fan = 0; fan < fan_count; fan++)
+        std::printf(fan == 0 ? "%u" : " %u", registers[fan]);
+      std::printf("\n");
+    }
+    records_printed++;
+  }
+}
+
+bool ReadFile(const std::string& path, const ReadOptions& options) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  struct stat info;
+  if (fd < 0 || fstat(fd, &info) < 0) {
+    LOG_ERROR("Cannot open %s: %s\n", path.c_str(), strerror(errno));
+    if (fd >= 0) close(fd);
+    return false;
+  }
+  const uint64_t size = info.st_size;
+  void* mapping = size >= TELEMETRY_HEADER_SIZE
+                      ? mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0)
+                      : MAP_FAILED;
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    LOG_ERROR("Cannot map %s\n", path.c_str());
+    return false;
+  }
+  const char* data = static_cast<const char*>(mapping);
+  const TelemetryFileHeader* file =
+      reinterpret_cast<const TelemetryFileHeader*>(data);
+  if (memcmp(file->magic, FILE_MAGIC, sizeof(FILE_MAGIC)) != 0 ||
+      file->version != FORMAT_VERSION || file->block_size != BLOCK_SIZE ||
+      file->index_interval != INDEX_INTERVAL) {
+    LOG_ERROR("%s is not a telemetry file of this version\n", path.c_str());
+    munmap(mapping, size);
+    return false;
+  }
+  const uint64_t origin_ns = file->monotonic_origin_ns;
+  const uint64_t from_ns = origin_ns + std::max(options.from_s, 0.0) * 1e9;
+  uint64_t to_ns = std::numeric_limits<uint64_t>::max();
+  if (options.to_s * 1e9 < to_ns - origin_ns)
+    to_ns = origin_ns + static_cast<uint64_t>(options.to_s * 1e9);
+
+  auto wanted = [&](uint32_t kind, uint64_t first_ns, uint64_t last_ns) {
+    if ((kind == SENSOR_BLOCK && !options.sensors) ||
+        (kind == CONTROL_BLOCK && !options.control))
+      return false;
+    return first_ns <= to_ns && last_ns >= from_ns;
+  };
+
+  for (uint32_t group_start = 0; BlockOffset(group_start) < size;
+       group_start += INDEX_INTERVAL + 1) {
+    // Blocks are handed out in order, nothing follows an unused group
+    if (reinterpret_cast<const TelemetryBlockHeader*>(
+            data + BlockOffset(group_start))->magic != BLOCK_MAGIC)
+      break;
+    // Data positions described by the index of this group
+    std::vector<const IndexEntry*> indexed(INDEX_INTERVAL, nullptr);
+    uint32_t indexed_count = 0;
+    const uint32_t index_position = group_start + INDEX_INTERVAL;
+    if (BlockOffset(index_position + 1) <= size) {
+      const TelemetryBlockHeader* index =
+          reinterpret_cast<const TelemetryBlockHeader*>(
+              data + BlockOffset(index_position));
+      if (index->magic == BLOCK_MAGIC && index->kind == INDEX_BLOCK) {
+        const IndexEntry* entries =
+            reinterpret_cast<const IndexEntry*>(index + 1);
+        const uint32_t count =
+            std::min(index->count.load(std::memory_order_acquire),
+                     BlockLayout::IndexCapacity());
+        for (uint32_t i = 0; i < count; i++) {
+          const uint32_t slot = entries[i].position - group_start;
+          if (slot >= INDEX_INTERVAL || indexed[slot] != nullptr) continue;
+          indexed[slot] = &entries[i];
+          indexed_count++;
+        }
+      }
+    }
+    for (uint32_t slot = 0; slot < INDEX_INTERVAL; slot++) {
+      const uint32_t position = group_start + slot;
+      if (BlockOffset(position + 1) > size) break;
+      const char* block = data + BlockOffset(position);
+      if (indexed[slot] != nullptr) {
+        if (wanted(indexed[slot]->kind, indexed[slot]->first_ns,
+                   indexed[slot]->last_ns))
+          PrintBlock(block, file->fan_count, origin_ns, from_ns, to_ns);
+        continue;
+      }
+      // A complete group is fully described by its index, otherwise the
+      // block was still open or the group is unused
+      if (indexed_count == INDEX_INTERVAL) continue;
+      const TelemetryBlockHeader* header =
+          reinterpret_cast<const TelemetryBlockHeader*>(block);
+      if (header->magic != BLOCK_MAGIC ||
+          (header->kind != SENSOR_BLOCK && header->kind != CONTROL_BLOCK) ||
+          header->count.load(std::memory_order_acquire) == 0)
+        continue;
+      if (wanted(header->kind, header->first_ns,
+                 header->last_ns.load(std::memory_order_relaxed)))
+        PrintBlock(block, file->fan_count, origin_ns, from_ns, to_ns);
+    }
+  }
+  munmap(mapping, size);
+  return true;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  static const option long_options[] = {
+      {"from", required_argument, nullptr, 'f'},
+      {"to", required_argument, nullptr, 't'},
+      {"sensors", no_argument, nullptr, 's'},
+      {"control", no_argument, nullptr, 'c'},
+      {"help", no_argument, nullptr, 'h'},
+      {nullptr, 0, nullptr, 0}};
+
+  ReadOptions options;
+  bool sensors_only = false, control_only = false;
+  int option;
+  while ((option = getopt_long(argc, argv, "", long_options, nullptr)) != -1) {
+    switch (option) {
+      case 'f': options.from_s = atof(optarg); break;
+      case 't': options.to_s = atof(optarg); break;
+      case 's': sensors_only = true; break;
+      case 'c': control_only = true; break;
+      default:
+        PrintUsage();
+        return -1;
+    }
+  }
+  if (optind == argc || options.from_s > options.to_s) {
+    PrintUsage();
+    return -1;
+  }
+  if (sensors_only != control_only) {
+    options.sensors = sensors_only;
+    options.control = control_only;
+  }
+
+  bool ok = true;
+  for (int i = optind; i < argc; i++) ok = ReadFile(argv[i], options) && ok;
+  // stdout only carries the records
+  std::fprintf(stderr, "%lu records printed from %lu blocks\n",
+               records_printed, blocks_read);
+  return ok ? 0 : -1;
+}
@@ -0,0 +1,206 @@
+#include "telemetry_recorder.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include "../logger/logger.h"
+
+namespace fan_controller {
+namespace controller {
+
+using namespace telemetry;
+
+TelemetryRecorder::File::~File() {
+  if (mapping != nullptr) munmap(mapping, size);
+  if (fd < 0) return;
+  // Cut the unused tail, keeping the index block of the last group
+  uint64_t used = TELEMETRY_HEADER_SIZE;
+  if (next_position != 0)
+    used = BlockOffset(IndexPositionOf(next_position - 1) + 1);
+  if (used < size && ftruncate(fd, used) < 0)
+    LOG_WARNING("Cannot truncate telemetry file %s: %s\n", path.c_str(),
+                strerror(errno));
+  close(fd);
+}
+
+TelemetryRecorder::TelemetryRecorder(const InputConfiguration& config)
+    : path_(config.telemetry_path_),
+      file_bytes_(config.telemetry_file_bytes_),
+      fan_count_(config.fan_count_),
+      sensor_count_(config.sensor_count_) {
+  sensors_.kind = SENSOR_BLOCK;
+  sensors_.layout = BlockLayout::Sensor();
+  control_.kind = CONTROL_BLOCK;
+  control_.layout = BlockLayout::Control(fan_count_);
+  // The first record opens the first block
+  sensors_.count = sensors_.layout.capacity;
+  control_.count = control_.layout.capacity;
+
+  memset(&file_header_, 0, sizeof(file_header_));
+  memcpy(file_header_.magic, FILE_MAGIC, sizeof(FILE_MAGIC));
+  file_header_.version = FORMAT_VERSION;
+  file_header_.block_size = BLOCK_SIZE;
+  file_header_.index_interval = INDEX_INTERVAL;
+  file_header_.fan_count = fan_count_;
+  file_header_.sensor_count = sensor_count_;
+  timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  file_header_.realtime_origin_ns =
+      static_cast<uint64_t>(now.tv_sec) * 1000000000ull + now.tv_nsec;
+  file_header_.monotonic_origin_ns = MonotonicNowNs();
+}
+
+TelemetryRecorder::~TelemetryRecorder() {
+  CloseBlock(&sensors_);
+  CloseBlock(&control_);
+  if (DroppedRecords() != 0)
+    LOG_WARNING("%lu telemetry records dropped\n", DroppedRecords());
+}
+
+bool TelemetryRecorder::Open() {
+  if (control_.layout.capacity == 0) {
+    LOG_ERROR("Control records of %d fans do not fit into a telemetry block\n",
+              fan_count_);
+    return false;
+  }
+  // At least one group of blocks per file
+  if (file_bytes_ < BlockOffset(INDEX_INTERVAL + 1)) {
+    LOG_ERROR("Telemetry files need at least %lu bytes\n",
+              BlockOffset(INDEX_INTERVAL + 1));
+    return false;
+  }
+  boost::mutex::scoped_lock scoped_lock(mutex_);
+  return RotateLocked();
+}
+
+bool TelemetryRecorder::RotateLocked() {
+  std::shared_ptr<File> file = std::make_shared<File>();
+  file->path = path_ + "." + std::to_string(file_header_.file_sequence) +
+               ".tlm";
+  file->positions = (file_bytes_ - TELEMETRY_HEADER_SIZE) / BLOCK_SIZE;
+  file->size = BlockOffset(file->positions);
+  file->fd = open(file->path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+                  0644);
+  if (file->fd < 0) {
+    LOG_ERROR("Cannot create telemetry file %s: %s\n", file->path.c_str(),
+              strerror(errno));
+    return false;
+  }
+  // Sparse, blocks only take space once written
+  if (ftruncate(file->fd, file->size) < 0) {
+    LOG_ERROR("Cannot size telemetry file %s: %s\n", file->path.c_str(),
+              strerror(errno));
+    return false;
+  }
+  void* mapping = mmap(nullptr, file->size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED, file->fd, 0);
+  if (mapping == MAP_FAILED) {
+    LOG_ERROR("Cannot map telemetry file %s: %s\n", file->path.c_str(),
+              strerror(errno));
+    return false;
+  }
+  file->mapping = static_cast<char*>(mapping);
+  memcpy(file->mapping, &file_header_, sizeof(file_header_));
+  file_header_.file_sequence++;
+  current_ = file;
+  LOG_INFO("Recording telemetry to %s\n", file->path.c_str());
+  return true;
+}
+
+bool TelemetryRecorder::NextBlock(Stream* stream) {
+  CloseBlock(stream);
+  boost::mutex::scoped_lock scoped_lock(mutex_);
+  if (!current_) return false;
+  uint32_t position = current_->next_position;
+  if (IsIndexPosition(position)) position++;
+  // The group index has to fit as well
+  if (IndexPositionOf(position) >= current_->positions) {
+    if (!RotateLocked()) {
+      // Stop recording instead of retrying on every record
+      current_.reset();
+      return false;
+    }
+    position = 0;
+  }
+  File* file = current_.get();
+  file->next_position = position + 1;
+  // Set up the index block the first time a group is used
+  TelemetryBlockHeader* index = reinterpret_cast<TelemetryBlockHeader*>(
+      file->mapping + BlockOffset(IndexPositionOf(position)));
+  if (index->magic != BLOCK_MAGIC) {
+    index->kind = INDEX_BLOCK;
+    index->capacity = BlockLayout::IndexCapacity();
+    index->count.store(0, std::memory_order_relaxed);
+    index->magic = BLOCK_MAGIC;
+  }
+  stream->file = current_;
+  stream->position = position;
+  stream->block = file->mapping + BlockOffset(position);
+  stream->header = reinterpret_cast<TelemetryBlockHeader*>(stream->block);
+  stream->header->kind = stream->kind;
+  stream->header->capacity = stream->layout.capacity;
+  stream->header->count.store(0, std::memory_order_relaxed);
+  stream->header->magic = BLOCK_MAGIC;
+  stream->count = 0;
+  return true;
+}
+
+void TelemetryRecorder::CloseBlock(Stream* stream) {
+  if (!stream->file) return;
+  if (stream->count != 0) {
+    boost::mutex::scoped_lock scoped_lock(mutex_);
+    TelemetryBlockHeader* index = reinterpret_cast<TelemetryBlockHeader*>(
+        stream->file->mapping + BlockOffset(IndexPositionOf(stream->position)));
+    IndexEntry* entries = reinterpret_cast<IndexEntry*>(index + 1);
+    const uint32_t count = index->count.load(std::memory_order_relaxed);
+    IndexEntry& entry = entries[count];
+    entry.position = stream->position;
+    entry.kind = stream->kind;
+    entry.count = stream->count;
+    entry.first_ns = stream->header->first_ns;
+    entry.last_ns = stream->header->last_ns.load(std::memory_order_relaxed);
+    index->count.store(count + 1, std::memory_order_release);
+  }
+  // Drops the last reference of a rotated file once both streams left it
+  stream->file.reset();
+  stream->header = nullptr;
+  stream->block = nullptr;
+}
+
+void TelemetryRecorder::RecordControl(uint64_t monotonic_ns, float max_temp,
+                                      float duty_cycle,
+                                      const u_int32_t* registers) {
+  Stream& stream = control_;
+  if (stream.count == stream.layout.capacity && !NextBlock(&stream)) {
+    dropped_records_.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  const uint32_t i = stream.count;
+  const BlockLayout& layout = stream.layout;
+  reinterpret_cast<uint64_t*>(stream.block + layout.column_offset[0])[i] =
+      monotonic_ns;
+  reinterpret_cast<float*>(stream.block + layout.column_offset[1])[i] =
+      max_temp;
+  reinterpret_cast<float*>(stream.block + layout.column_offset[2])[i] =
+      duty_cycle;
+  memcpy(stream.block + layout.column_offset[3] +
+             static_cast<uint64_t>(i) * fan_count_ * sizeof(u_int32_t),
+         registers, fan_count_ * sizeof(u_int32_t));
+  Publish(&stream, monotonic_ns);
+}
+
+std::unique_ptr<TelemetryRecorder> CreateTelemetryRecorder(
+    const InputConfiguration& config) {
+  if (config.telemetry_path_.empty()) return nullptr;
+  std::unique_ptr<TelemetryRecorder> recorder(new TelemetryRecorder(config));
+  if (!recorder->Open()) {
+    LOG_ERROR("Telemetry recording disabled\n");
+    return nullptr;
+  }
+  return recorder;
+}
+
+}  // namespace controller
+}  // namespace fan_controller
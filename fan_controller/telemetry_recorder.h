@@ -0,0 +1,124 @@
+#pragma once
+
+#include <boost/thread/mutex.hpp>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include "common.h"
+#include "telemetry_format.h"
+
+// Records sensor samples and control decisions into memory mapped telemetry
+// files, see telemetry_format.h for the layout. Appending a record is a few
+// plain stores into the mapping, no syscall and no lock; only opening a new
+// block (every few thousand records) or rotating the file takes the mutex.
+namespace fan_controller {
+namespace controller {
+
+class TelemetryRecorder {
+  // One mapped telemetry file. Shared by the streams with an open block in
+  // it, so a rotated file stays mapped until both moved on.
+  struct File {
+    int fd = -1;
+    char* mapping = nullptr;
+    uint64_t size = 0;
+    // Block positions that fit into the file and the next free one
+    uint32_t positions = 0;
+    uint32_t next_position = 0;
+    std::string path;
+    ~File();
+  };
+
+  // Append state of one record stream. Only ever touched by the thread
+  // writing that stream.
+  struct Stream {
+    telemetry::BlockKind kind;
+    telemetry::BlockLayout layout;
+    std::shared_ptr<File> file;
+    uint32_t position = 0;
+    telemetry::TelemetryBlockHeader* header = nullptr;
+    char* block = nullptr;
+    uint32_t count = 0;
+  };
+
+  const std::string path_;
+  const uint64_t file_bytes_;
+  const uint32_t fan_count_;
+  const uint32_t sensor_count_;
+  telemetry::TelemetryFileHeader file_header_;
+
+  // Guards current_ and the block and index allocation inside it
+  boost::mutex mutex_;
+  std::shared_ptr<File> current_;
+
+  // Sensor samples come from the ingest thread, control records from the
+  // thread publishing the registers
+  Stream sensors_;
+  Stream control_;
+
+  // Counted by both stream threads
+  std::atomic<uint64_t> dropped_records_{0};
+
+  // Creates and maps the next file of the recording. Caller holds mutex_.
+  bool RotateLocked();
+
+  // Closes the open block of stream and starts a new one, rotating the file
+  // if it is full. Returns false if no block could be opened.
+  bool NextBlock(Stream* stream);
+
+  // Adds the closed block of stream to the index of its group
+  void CloseBlock(Stream* stream);
+
+ public:
+  TelemetryRecorder(const InputConfiguration& config);
+  ~TelemetryRecorder();
+  TelemetryRecorder(TelemetryRecorder const& copy) = delete;
+  TelemetryRecorder& operator=(TelemetryRecorder const& copy) = delete;
+
+  // Creates the first file. Returns false on failure.
+  bool Open();
+
+  // Called from the thread ingesting sensor values
+  void RecordSensor(uint64_t monotonic_ns, uint32_t sensor_id, float value) {
+    Stream& stream = sensors_;
+    if (stream.count == stream.layout.capacity && !NextBlock(&stream)) {
+      dropped_records_.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    const uint32_t i = stream.count;
+    const telemetry::BlockLayout& layout = stream.layout;
+    reinterpret_cast<uint64_t*>(stream.block + layout.column_offset[0])[i] =
+        monotonic_ns;
+    reinterpret_cast<uint32_t*>(stream.block + layout.column_offset[1])[i] =
+        sensor_id;
+    reinterpret_cast<float*>(stream.block + layout.column_offset[2])[i] =
+        value;
+    Publish(&stream, monotonic_ns);
+  }
+
+  // Called from the thread publishing the registers, registers holds one
+  // value per fan
+  void RecordControl(uint64_t monotonic_ns, float max_temp, float duty_cycle,
+                     const u_int32_t* registers);
+
+  // Records lost because no file could be created
+  uint64_t DroppedRecords() const {
+    return dropped_records_.load(std::memory_order_relaxed);
+  }
+
+ private:
+  // Makes record stream.count visible to readers
+  static void Publish(Stream* stream, uint64_t monotonic_ns) {
+    if (stream->count == 0) stream->header->first_ns = monotonic_ns;
+    stream->header->last_ns.store(monotonic_ns, std::memory_order_relaxed);
+    stream->header->count.store(++stream->count, std::memory_order_release);
+  }
+};
+
+// Recorder selected by config, nullptr if telemetry is off or the first file
+// cannot be created
+std::unique_ptr<TelemetryRecorder> CreateTelemetryRecorder(
+    const InputConfiguration& config);
+
+}  // namespace controller
+}  // namespace fan_controller
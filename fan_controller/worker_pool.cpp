@@ -0,0 +1,68 @@
+#include "worker_pool.h"
+
+namespace fan_controller {
+namespace controller {
+
+WorkerPool::WorkerPool(uint32_t threads, std::function<void(uint32_t)> task)
+    : task_(task) {
+  for (uint32_t i = 0; i < threads; i++)
+    threads_.create_thread(boost::bind(&WorkerPool::Worker, this));
+}
+
+WorkerPool::~WorkerPool() {
+  {
+    boost::mutex::scoped_lock scoped_lock(mutex_);
+    stop_ = true;
+  }
+  start_cond_.notify_all();
+  threads_.join_all();
+}
+
+void WorkerPool::Work(uint32_t run, uint32_t count) {
+  // A worker waking up late for a finished run finds another run in next_
+  // and leaves without touching it
+  uint64_t next = next_.load();
+  while (static_cast<uint32_t>(next >> 32) == run &&
+         static_cast<uint32_t>(next) < count) {
+    if (next_.compare_exchange_weak(next, next + 1)) {
+      task_(static_cast<uint32_t>(next));
+      next = next_.load();
+    }
+  }
+}
+
+void WorkerPool::Worker() {
+  uint64_t seen = 0;
+  while (true) {
+    uint32_t count;
+    {
+      boost::mutex::scoped_lock scoped_lock(mutex_);
+      while (run_ == seen && !stop_) start_cond_.wait(scoped_lock);
+      if (stop_) return;
+      seen = run_;
+      count = count_;
+      active_++;
+    }
+    Work(static_cast<uint32_t>(seen), count);
+    boost::mutex::scoped_lock scoped_lock(mutex_);
+    if (--active_ == 0) done_cond_.notify_one();
+  }
+}
+
+void WorkerPool::Run(uint32_t count) {
+  uint32_t run;
+  {
+    boost::mutex::scoped_lock scoped_lock(mutex_);
+    count_ = count;
+    run = static_cast<uint32_t>(++run_);
+    next_ = static_cast<uint64_t>(run) << 32;
+  }
+  start_cond_.notify_all();
+  Work(run, count);
+  // Workers that joined late find nothing left and leave right away
+  boost::mutex::scoped_lock scoped_lock(mutex_);
+  while (active_ != 0) done_cond_.wait(scoped_lock);
+}
+
+}  // namespace controller
+}  // namespace fan_controller
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <atomic>
+#include <boost/thread/condition.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+#include <cstdint>
+#include <functional>
+
+// Fixed set of threads running one task over the indices 0 .. count - 1 for
+// a single calling thread. Run hands out the indices through an atomic
+// counter, the caller works along and returns once every index is done.
+// Between runs the workers sleep on a condition variable.
+namespace fan_controller {
+namespace controller {
+
+class WorkerPool {
+  const std::function<void(uint32_t)> task_;
+
+  boost::thread_group threads_;
+
+  boost::mutex mutex_;
+  boost::condition_variable start_cond_, done_cond_;
+
+  // Guarded by mutex_: runs started so far, index count of the current run,
+  // workers still inside it
+  uint64_t run_ = 0;
+  uint32_t count_ = 0;
+  uint32_t active_ = 0;
+  bool stop_ = false;
+
+  // Low 32 bits of the current run_ above the next index to hand out, so an
+  // index is only ever taken for the run it belongs to
+  std::atomic<uint64_t> next_{0};
+
+  void Worker();
+
+  // Runs task_ on indices of run taken from next_ until none is left or
+  // another run started
+  void Work(uint32_t run, uint32_t count);
+
+ public:
+  WorkerPool(uint32_t threads, std::function<void(uint32_t)> task);
+  ~WorkerPool();
+  WorkerPool(WorkerPool const& copy) = delete;
+  WorkerPool& operator=(WorkerPool const& copy) = delete;
+
+  // Runs task for every index below count, not reentrant
+  void Run(uint32_t count);
+};
+
+}  // namespace controller
+}  // namespace fan_controller